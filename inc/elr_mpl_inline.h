@@ -0,0 +1,120 @@
+/*! \file elr_mpl_inline.h.
+ *  \brief inline allocation fast paths of the memory pool for POSIX.
+ *
+ *  a thread cache keeps a small stack of memory blocks taken from one
+ *  memory pool. elr_mpl_tcache_alloc and elr_mpl_tcache_free only push
+ *  and pop that stack, so they inline into the loops using them. the
+ *  library is called only when the stack runs empty or full, and then
+ *  moves half of a stack of memory blocks under one lock hold.
+ *
+ *  memory blocks in a thread cache stay allocated as far as the pool
+ *  is concerned: on_alloc and on_free callbacks run when they move
+ *  between the pool and the cache, not on every call of the cache, and
+ *  the contents of a memory block are kept while it sits in the cache.
+ *
+ *  a thread cache is not thread safe, give each thread its own, for
+ *  example as a __thread variable. the pool must be a sync pool if the
+ *  caches of several threads share it. flush the cache before its pool
+ *  is destroyed, reset or compacted, elr_mpl_compact would move the
+ *  blocks the cache still points to.
+ */
+
+#ifndef __ELR_MPL_INLINE_H__
+#define __ELR_MPL_INLINE_H__
+
+#include "elr_mpl_posix.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \def ELR_MPL_TCACHE_SIZE
+ *  \brief memory blocks a thread cache holds at most, define it before the include to change it.
+ */
+#ifndef ELR_MPL_TCACHE_SIZE
+#define ELR_MPL_TCACHE_SIZE     32
+#endif
+
+/*! \brief thread cache type.
+ *
+ *  initialize it with elr_mpl_tcache_init, don`t modify it`s members manualy.
+ */
+typedef struct __elr_mpl_tcache
+{
+	elr_mpl_ht  pool; /*!< the memory pool the memory blocks come from. */
+	size_t      count; /*!< memory blocks in mem. */
+	void*       mem[ELR_MPL_TCACHE_SIZE]; /*!< the memory blocks, the most recently freed last. */
+}
+elr_mpl_tcache;
+
+/*! \brief bind an empty thread cache to a single-size memory pool.
+ *  \param tc    the thread cache.
+ *  \param pool  pointer to a elr_mpl_t type variable, it must outlive the cache.
+ */
+static inline void elr_mpl_tcache_init(elr_mpl_tcache* tc, elr_mpl_ht pool)
+{
+	tc->pool = pool;
+	tc->count = 0;
+}
+
+/*! \brief refill an empty thread cache and take a memory block from it, the slow path of elr_mpl_tcache_alloc.
+ */
+static inline void* elr_mpl_tcache_refill(elr_mpl_tcache* tc)
+{
+	tc->count = elr_mpl_alloc_batch(tc->pool, tc->mem, ELR_MPL_TCACHE_SIZE/2);
+	if (tc->count == 0)
+		return NULL;
+	return tc->mem[--tc->count];
+}
+
+/*! \brief alloc a memory block through a thread cache.
+ *  \param tc  the thread cache.
+ *  \retval NULL if the pool is out of memory.
+ */
+static inline void* elr_mpl_tcache_alloc(elr_mpl_tcache* tc)
+{
+	if (__builtin_expect(tc->count != 0, 1))
+		return tc->mem[--tc->count];
+	return elr_mpl_tcache_refill(tc);
+}
+
+/*! \brief give the older half of a full thread cache back to the pool, the slow path of elr_mpl_tcache_free.
+ */
+static inline void elr_mpl_tcache_spill(elr_mpl_tcache* tc)
+{
+	size_t  half = ELR_MPL_TCACHE_SIZE/2;
+	size_t  i = 0;
+
+	elr_mpl_free_batch(tc->mem, half);
+	for (i = half; i < tc->count; i++)
+		tc->mem[i - half] = tc->mem[i];
+	tc->count -= half;
+}
+
+/*! \brief free a memory block of the pool of a thread cache through the cache.
+ *  \param tc   the thread cache.
+ *  \param mem  a memory block of tc->pool, may be NULL.
+ */
+static inline void elr_mpl_tcache_free(elr_mpl_tcache* tc, void* mem)
+{
+	if (mem == NULL)
+		return;
+	if (__builtin_expect(tc->count == ELR_MPL_TCACHE_SIZE, 0))
+		elr_mpl_tcache_spill(tc);
+	tc->mem[tc->count++] = mem;
+}
+
+/*! \brief give every memory block of a thread cache back to the pool.
+ *  \param tc  the thread cache.
+ */
+static inline void elr_mpl_tcache_flush(elr_mpl_tcache* tc)
+{
+	elr_mpl_free_batch(tc->mem, tc->count);
+	tc->count = 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -94,6 +94,22 @@ extern "C" {
 
 typedef void (*elr_mpl_callback)(void*);
 
+/*! \brief constructor or destructor of an object cache, gets the object and the user context.
+ */
+typedef void (*elr_mpl_ctor)(void* mem, void* ctx);
+
+/*! \brief called by elr_mpl_compact after an object was copied from old_mem to new_mem.
+ */
+typedef void (*elr_mpl_relocate)(void* old_mem, void* new_mem, void* ctx);
+
+/*! \brief called by elr_mpl_foreach for every allocated memory block.
+ */
+typedef void (*elr_mpl_visit)(void* mem, void* ctx);
+
+/*! \brief called by elr_mpl_foreach_batch with count allocated memory blocks at a time.
+ */
+typedef void (*elr_mpl_visit_batch)(void** mem, size_t count, void* ctx);
+
 /*! \brief memory pool type.
  *
  *  it is highly recommend that you declare a elr_mpl_t variable 
@@ -110,12 +126,191 @@ typedef struct __elr_mpl_t
 }
 elr_mpl_t,*elr_mpl_ht;
 
+/*! \brief called when a new memory node would pass the limit of a pool.
+ *
+ *  gets the pool whose limit is hit, the bytes wanted and the user
+ *  context. returns nonzero to have the charge tried once more.
+ *  see elr_mpl_set_limit_callback for what it may not do.
+ */
+typedef int (*elr_mpl_limit_callback)(elr_mpl_ht pool, size_t need, void* ctx);
+
+/*! \brief mapped memory pool type.
+ *
+ *  returned by elr_mpl_create_shm, elr_mpl_attach_shm, elr_mpl_create_file
+ *  and elr_mpl_open_file. it is a type of its own so that a mapped pool
+ *  can`t be given to the functions taking an elr_mpl_ht.
+ *  don`t modify it`s members manualy.
+ */
+typedef struct __elr_mpl_mapped_t
+{
+	void*  pool; /*!< the mapping of the pool, NULL if none. */
+}
+elr_mpl_mapped_t,*elr_mpl_mapped_ht;
+
 
 /*! \def ELR_MPL_INITIALIZER
  *  \brief elr_mpl_t constant for initializing.
  */
 extern ELR_MPL_API elr_mpl_t ELR_MPL_INITIALIZER;
 
+/*! \def ELR_MPL_SYNC
+ *  \brief creation flag, the pool is guarded by its own lock.
+ *
+ *  the lock parks waiting threads on a futex at once, like a mutex.
+ */
+#define ELR_MPL_SYNC            0x0001
+
+/*! \def ELR_MPL_ADAPTIVE_LOCK
+ *  \brief creation flag, the pool lock spins briefly before it parks.
+ *
+ *  only meaningful with ELR_MPL_SYNC. the spin rounds follow the
+ *  contention really seen, good for the short critical sections of
+ *  alloc and free under moderate contention.
+ */
+#define ELR_MPL_ADAPTIVE_LOCK   0x0002
+
+/*! \def ELR_MPL_BIASED
+ *  \brief creation flag, the pool is biased to the creating thread.
+ *
+ *  implies ELR_MPL_SYNC. the creating thread allocates and frees without
+ *  taking the lock until another thread touches the pool, from then on
+ *  every thread takes the lock. on linux the revoking thread pays for a
+ *  membarrier call so the owner does not need a fence.
+ */
+#define ELR_MPL_BIASED          0x0004
+
+/*! \def ELR_MPL_FULLEST_FIRST
+ *  \brief creation flag, allocate from the fullest memory node first.
+ *
+ *  nodes with free slices are kept in buckets by occupancy and a memory
+ *  block is taken from the fullest one. live objects gather in few nodes,
+ *  so more nodes become empty and can be given back.
+ */
+#define ELR_MPL_FULLEST_FIRST   0x0008
+
+/*! \def ELR_MPL_HANDLES
+ *  \brief creation flag, memory blocks can be named by 32 bits handles.
+ *
+ *  the pool keeps a table of its memory nodes, see elr_mpl_handle.
+ */
+#define ELR_MPL_HANDLES         0x0010
+
+/*! \def ELR_MPL_SIZE_HISTOGRAM
+ *  \brief creation flag, a multi-size pool counts the sizes asked for.
+ *
+ *  sizes up to 32KB are counted in steps of 16 bytes, see
+ *  elr_mpl_suggest_classes.
+ */
+#define ELR_MPL_SIZE_HISTOGRAM  0x0020
+
+/*! \def ELR_MPL_REFINE_CLASSES
+ *  \brief creation flag, a multi-size pool adds classes for frequent sizes.
+ *
+ *  implies ELR_MPL_SIZE_HISTOGRAM. once a size was asked for 256 times
+ *  and its class wastes more than 1/8, a class of that size rounded up
+ *  to 16 bytes is added and serves it from then on.
+ */
+#define ELR_MPL_REFINE_CLASSES  0x0040
+
+/*! \def ELR_MPL_CACHELINE
+ *  \brief creation flag, every memory block starts a 64 bytes cache line.
+ *
+ *  slices are padded to whole cache lines, so no two memory blocks share
+ *  one and threads owning neighbouring objects don`t false share. costs
+ *  up to 63 bytes per memory block.
+ */
+#define ELR_MPL_CACHELINE       0x0080
+
+/*! \def ELR_MPL_COLORED
+ *  \brief creation flag, the memory nodes start their slices at varying cache line offsets.
+ *
+ *  up to 8 offsets, so the same slice of every node does not fall in the
+ *  same cache sets. nodes of 128KB and more are colored anyway, malloc
+ *  rounds them to pages and the colors fit in that slack. smaller nodes
+ *  grow by up to 448 bytes each.
+ */
+#define ELR_MPL_COLORED         0x0100
+
+/*! \brief checkpoint of an arena pool.
+ *
+ *  taken by elr_mpl_mark, given to elr_mpl_rollback.
+ *  don`t modify it`s members manualy.
+ */
+typedef struct __elr_mpl_mark_t
+{
+	void*  node;  /*!< the node being cut when the mark was taken. */
+	void*  avail; /*!< the first free byte of that node. */
+}
+elr_mpl_mark_t;
+
+/*! \brief compact name of a memory block.
+ *
+ *  4 generation bits, 22 bits of node index and 6 bits of slice index.
+ *  0 is never a valid handle.
+ */
+typedef unsigned int elr_mpl_handle_t;
+
+/*! \brief contention counters of a pool lock.
+ */
+typedef struct __elr_mpl_lock_stat
+{
+	unsigned long long  acquired;  /*!< times the lock was taken. */
+	unsigned int        contended; /*!< times the lock was found held. */
+	unsigned int        parked;    /*!< times a thread parked on the futex. */
+	int                 spin;      /*!< spin rounds currently learned, 0 for blocking lock. */
+}
+elr_mpl_lock_stat;
+
+/*! \def ELR_MPL_TRACE_CREATE
+ *  \brief operations of an allocation trace, the op of a elr_mpl_trace_record.
+ */
+#define ELR_MPL_TRACE_CREATE        1
+#define ELR_MPL_TRACE_CREATE_MULTI  2
+#define ELR_MPL_TRACE_DESTROY       3
+#define ELR_MPL_TRACE_ALLOC         4
+#define ELR_MPL_TRACE_ALLOC_MULTI   5
+#define ELR_MPL_TRACE_FREE          6
+#define ELR_MPL_TRACE_CLASS         7
+
+#define ELR_MPL_TRACE_MAGIC         0x54524c45  /*"ELRT"*/
+#define ELR_MPL_TRACE_VERSION       3
+
+/*! \brief start of an allocation trace, followed by its records.
+ */
+typedef struct __elr_mpl_trace_header
+{
+	unsigned int  magic;       /*!< ELR_MPL_TRACE_MAGIC. */
+	unsigned int  version;     /*!< ELR_MPL_TRACE_VERSION. */
+	unsigned int  record_size; /*!< sizeof(elr_mpl_trace_record). */
+	unsigned int  reserved;
+}
+elr_mpl_trace_header;
+
+/*! \brief one recorded call of an allocation trace.
+ *
+ *  pools and memory blocks are named by their addresses at recording
+ *  time. a create names the parent pool in object, 0 for the global
+ *  pool, and gives the object size or, for a multi-size pool, the
+ *  number of classes in size, 0 for an arena pool. object caches and
+ *  buffer pools are recorded as plain creates. a create_multi is followed by a class
+ *  record of the same pool and thread per class, in order, with the
+ *  object size of the class in size. an alloc_multi gives the size
+ *  asked for. version 1 traces have no class records, version 1 and 2
+ *  traces have 32 byte records with 8 bits of flags after op.
+ */
+typedef struct __elr_mpl_trace_record
+{
+	unsigned long long  time;   /*!< nanoseconds since the trace started. */
+	unsigned long long  object; /*!< the memory block, the parent pool of a create. */
+	unsigned long long  pool;   /*!< the memory pool. */
+	unsigned int        size;   /*!< bytes of the memory block, see above for creates. */
+	unsigned short      thread; /*!< number of the recording thread. */
+	unsigned short      flags;  /*!< creation flags of a create. */
+	unsigned char       op;     /*!< one of ELR_MPL_TRACE_*. */
+	unsigned char       reserved[7]; /*!< zero. */
+}
+elr_mpl_trace_record;
+
 /*
 ** Initialize the memory pool and create a global memory pool internally.
 ** This method can be called repeatedly, if the memory pool module has been initialized, the method returns directly.
@@ -156,6 +351,16 @@ ELR_MPL_API elr_mpl_t elr_mpl_create_sync(elr_mpl_ht fpool,
 	elr_mpl_callback on_alloc,
 	elr_mpl_callback on_free);
 
+/*
+** Create a memory pool with creation flags, see ELR_MPL_SYNC and ELR_MPL_ADAPTIVE_LOCK.
+** elr_mpl_create equals flags 0, elr_mpl_create_sync equals flags ELR_MPL_SYNC.
+*/
+ELR_MPL_API elr_mpl_t elr_mpl_create_ex(elr_mpl_ht fpool,
+	size_t obj_size,
+	elr_mpl_callback on_alloc,
+	elr_mpl_callback on_free,
+	int flags);
+
 /*
 ** Create a memory pool from which you can request memory blocks of different sizes.
 ** The first parameter represents the parent memory pool. If it is NULL, it means that the parent memory pool of the created memory pool is the global memory pool.
@@ -190,6 +395,16 @@ ELR_MPL_API elr_mpl_t elr_mpl_create_multi_sync(elr_mpl_ht fpool,
 	elr_mpl_callback on_free);
 
 
+/*
+** Create a multi-size memory pool with creation flags, every size class gets the same flags.
+*/
+ELR_MPL_API elr_mpl_t elr_mpl_create_multi_ex(elr_mpl_ht fpool,
+	int obj_size_count,
+	size_t* obj_size,
+	elr_mpl_callback on_alloc,
+	elr_mpl_callback on_free,
+	int flags);
+
 /*
 ** To determine whether the memory pool is valid, it is generally called immediately after the creation is completed.
 ** return 0 for invalid
@@ -214,12 +429,274 @@ ELR_MPL_API int  elr_mpl_avail(elr_mpl_ht pool);
  */
 ELR_MPL_API void* elr_mpl_alloc(elr_mpl_ht pool);
 
+/*
+** Allocate up to count memory blocks from a single-size memory pool into mem, the lock of the pool is held once.
+** Returns the number of memory blocks taken, less than count if the pool ran out.
+*/
+/*! \brief alloc several memory blocks at once.
+ *  \param pool   pointer to a elr_mpl_t type variable.
+ *  \param mem    receives the memory blocks.
+ *  \param count  most memory blocks wanted.
+ *  \retval the number of memory blocks written to mem.
+ */
+ELR_MPL_API size_t elr_mpl_alloc_batch(elr_mpl_ht pool, void** mem, size_t count);
+
+/*
+** Give back count memory blocks, NULL entries are skipped.
+** The memory blocks may come from different pools, a run of memory blocks of the same pool is given back under one lock hold.
+*/
+/*! \brief free several memory blocks at once.
+ *  \param mem    the memory blocks.
+ *  \param count  entries of mem.
+ */
+ELR_MPL_API void elr_mpl_free_batch(void** mem, size_t count);
+
+/*
+** Limit the number of memory blocks of a single-size memory pool in use at a time, 0 removes the limit.
+** Past the limit elr_mpl_alloc returns NULL and elr_mpl_alloc_wait waits.
+*/
+/*! \brief set the capacity of a memory pool in memory blocks.
+ *  \param pool   pointer to a elr_mpl_t type variable.
+ *  \param count  most memory blocks in use at a time.
+ *
+ *  a capacity lower than the memory blocks already in use refuses new
+ *  ones until enough of them are given back.
+ */
+ELR_MPL_API void elr_mpl_set_capacity(elr_mpl_ht pool, size_t count);
+
+/*
+** Allocate a memory block from a sync memory pool with a capacity, waiting while the pool is full.
+** timeout_ns is the longest wait in nanoseconds, 0 does not wait, a negative value waits forever.
+*/
+/*! \brief alloc a memory block, waiting for one to be given back.
+ *  \param pool        pointer to a elr_mpl_t type variable.
+ *  \param timeout_ns  longest wait, negative for no limit.
+ *  \retval NULL if the wait timed out or the pool has no capacity.
+ *
+ *  waiting threads park on a futex. elr_mpl_free wakes one of them per
+ *  memory block and makes no system call when nobody waits.
+ */
+ELR_MPL_API void* elr_mpl_alloc_wait(elr_mpl_ht pool, long long timeout_ns);
+
 /*
 ** Apply for the specified size of memory from the memory pool.
 ** When pool is NULL, apply from the global memory pool
 */
 ELR_MPL_API void* elr_mpl_alloc_multi(elr_mpl_ht pool, size_t size);
 
+/*
+** Create an object cache, a memory pool that keeps its memory blocks constructed.
+** ctor runs once when a memory block is first cut from a memory node, dtor runs once when the memory node is released,
+** by the reclaimer, elr_mpl_reset or when the pool is destroyed. Both get ctx as their second parameter.
+*/
+/*! \brief create an object cache.
+ *  \param fpool the parent pool of the about to created pool.
+ *  \param obj_size the size of the objects.
+ *  \param ctor builds an object, may be NULL.
+ *  \param dtor tears an object down, may be NULL.
+ *  \param ctx user context given to ctor and dtor.
+ *  \param flags creation flags.
+ *  \retval NULL if failed.
+ *
+ *  elr_mpl_alloc hands out objects as they were last freed, so an
+ *  object must be given back in its constructed state. the destructor
+ *  also runs for objects still in use when the pool is destroyed.
+ */
+ELR_MPL_API elr_mpl_t elr_mpl_create_cache(elr_mpl_ht fpool,
+	size_t obj_size,
+	elr_mpl_ctor ctor,
+	elr_mpl_ctor dtor,
+	void* ctx,
+	int flags);
+
+/*
+** Create a memory pool that never allocates memory nodes, its memory blocks are all cut from buf.
+** The first parameter represents the parent memory pool, as elr_mpl_create.
+** flags may be ELR_MPL_SYNC, ELR_MPL_ADAPTIVE_LOCK, ELR_MPL_BIASED and ELR_MPL_FULLEST_FIRST.
+*/
+/*! \brief create a memory pool inside a buffer of the caller.
+ *  \param fpool the parent pool of the about to created pool.
+ *  \param obj_size the size of the objects.
+ *  \param buf memory the pool cuts its memory blocks from.
+ *  \param len bytes of buf.
+ *  \param flags creation flags.
+ *  \retval NULL if failed or buf can`t hold a single memory block.
+ *
+ *  once buf is used up elr_mpl_alloc returns NULL until memory blocks
+ *  are given back. elr_mpl_free and elr_mpl_size work as usual. buf must
+ *  outlive the pool and is not freed by elr_mpl_destroy. the pool itself
+ *  is taken from the global memory pool like every other pool.
+ */
+ELR_MPL_API elr_mpl_t elr_mpl_create_from_buffer(elr_mpl_ht fpool,
+                                               size_t obj_size,
+                                               void* buf,
+                                               size_t len,
+                                               int flags);
+
+/*
+** Suggest at most count class sizes for a multi-size memory pool created with ELR_MPL_SIZE_HISTOGRAM.
+** The sizes go to obj_size in ascending order, ready for elr_mpl_create_multi.
+*/
+/*! \brief suggest size classes from the sizes asked for so far.
+ *  \param pool      pointer to a elr_mpl_t type variable.
+ *  \param count     most number of classes wanted.
+ *  \param obj_size  receives the class sizes.
+ *  \retval the number of sizes written, zero if nothing was counted.
+ *
+ *  the classes minimize the bytes wasted by rounding the counted sizes
+ *  up to their class. sizes over 32KB are not counted.
+ */
+ELR_MPL_API int elr_mpl_suggest_classes(elr_mpl_ht pool, int count, size_t* obj_size);
+
+/*
+** Create an arena memory pool, memory blocks of any size are cut from big memory nodes.
+** The first parameter represents the parent memory pool, as elr_mpl_create.
+** node_size is the size of each memory node, 0 for the default of 64KB. A larger request gets a node of its own.
+** flags may be ELR_MPL_SYNC and ELR_MPL_ADAPTIVE_LOCK.
+*/
+/*! \brief create an arena memory pool.
+ *  \param fpool the parent pool of the about to created pool.
+ *  \param node_size the size of each memory node, 0 for default.
+ *  \param flags creation flags.
+ *  \retval NULL if failed.
+ *
+ *  memory blocks of an arena pool have no slice header, they can`t be
+ *  given to elr_mpl_free or elr_mpl_size. they are given back together
+ *  by elr_mpl_rollback, elr_mpl_reset or when the pool is destroyed.
+ */
+ELR_MPL_API elr_mpl_t elr_mpl_create_arena(elr_mpl_ht fpool,
+	size_t node_size,
+	int flags);
+
+/*
+** Allocate a memory block of any size from an arena memory pool, aligned to 16 bytes.
+*/
+ELR_MPL_API void* elr_mpl_alloc_arena(elr_mpl_ht pool, size_t size);
+
+/*
+** Take a checkpoint of an arena memory pool.
+*/
+ELR_MPL_API elr_mpl_mark_t elr_mpl_mark(elr_mpl_ht pool);
+
+/*
+** Give back every memory block allocated from an arena memory pool after the checkpoint was taken.
+** Checkpoints must be rolled back in the reverse order they were taken.
+** The memory nodes given back are kept by the pool for later allocations.
+*/
+ELR_MPL_API void elr_mpl_rollback(elr_mpl_ht pool, elr_mpl_mark_t mark);
+
+/*
+** Create a memory pool inside the POSIX shared memory object name, holding at most obj_count blocks of obj_size bytes.
+** The name must not exist yet. The pool does not grow.
+*/
+/*! \brief create a memory pool shared by processes.
+ *  \param name       shared memory object name, like "/frames".
+ *  \param obj_size   size of each memory block.
+ *  \param obj_count  number of memory blocks the pool holds.
+ *  \retval a pool whose pool member is NULL if failed.
+ *
+ *  the pool only keeps offsets, so every process may map it at another
+ *  address. it is guarded by a process shared futex lock. a process that
+ *  dies while it holds the lock leaves the pool locked. memory blocks are
+ *  given to elr_mpl_free_mapped, not to elr_mpl_free, and the pool is not
+ *  part of the pool tree.
+ */
+ELR_MPL_API elr_mpl_mapped_t elr_mpl_create_shm(const char* name, size_t obj_size, size_t obj_count);
+
+/*
+** Map a memory pool created by elr_mpl_create_shm into this process.
+*/
+ELR_MPL_API elr_mpl_mapped_t elr_mpl_attach_shm(const char* name);
+
+/*
+** Remove the name of a shared memory pool, mappings already made stay usable.
+*/
+ELR_MPL_API int elr_mpl_unlink_shm(const char* name);
+
+/*
+** Create a memory pool inside the new file path, holding at most obj_count blocks of obj_size bytes.
+** It works like a shared memory pool but the file keeps it across restarts.
+*/
+/*! \brief create a persistent memory pool.
+ *  \param path       file to create, it must not exist yet.
+ *  \param obj_size   size of each memory block.
+ *  \param obj_count  number of memory blocks the pool holds.
+ *  \retval a pool whose pool member is NULL if failed.
+ *
+ *  the blocks live in the file, so blocks should link each other with
+ *  elr_mpl_mapped_offset rather than with pointers. the pool is restored
+ *  by elr_mpl_open_file without walking or copying any block.
+ */
+ELR_MPL_API elr_mpl_mapped_t elr_mpl_create_file(const char* path, size_t obj_size, size_t obj_count);
+
+/*
+** Map a memory pool file made by elr_mpl_create_file, the blocks in use and the free blocks are restored.
+** The pool lock is reset, so no other process may use the file at that time.
+*/
+ELR_MPL_API elr_mpl_mapped_t elr_mpl_open_file(const char* path);
+
+/*
+** Write a file memory pool to disk, a snapshot taken while no block is allocated or freed.
+** Most of the pool is written before its lock is taken, the lock is only held to write the pages dirtied meanwhile.
+** Returns zero if writing failed.
+*/
+ELR_MPL_API int elr_mpl_sync_mapped(elr_mpl_mapped_ht pool);
+
+/*
+** Set the memory block of a mapped memory pool to start from after a reopen, NULL clears it.
+*/
+ELR_MPL_API void elr_mpl_set_root(elr_mpl_mapped_ht pool, void* mem);
+
+/*
+** Get the memory block set by elr_mpl_set_root, NULL if none.
+*/
+ELR_MPL_API void* elr_mpl_get_root(elr_mpl_mapped_ht pool);
+
+/*
+** Allocate a memory block from a mapped memory pool, aligned to 16 bytes, NULL once the pool is full.
+*/
+ELR_MPL_API void* elr_mpl_alloc_mapped(elr_mpl_mapped_ht pool);
+
+/*
+** Give back a memory block to a mapped memory pool, any process that mapped the pool may do it.
+*/
+ELR_MPL_API void elr_mpl_free_mapped(elr_mpl_mapped_ht pool, void* mem);
+
+/*
+** Get the offset of a memory block in a mapped memory pool, it can be passed to other processes.
+** Returns 0 if mem is not a memory block of the pool.
+*/
+ELR_MPL_API size_t elr_mpl_mapped_offset(elr_mpl_mapped_ht pool, void* mem);
+
+/*
+** Get the memory block at an offset taken by elr_mpl_mapped_offset, in this process`s mapping.
+*/
+ELR_MPL_API void* elr_mpl_mapped_ptr(elr_mpl_mapped_ht pool, size_t offset);
+
+/*
+** Unmap a mapped memory pool from this process.
+*/
+ELR_MPL_API void elr_mpl_detach(elr_mpl_mapped_ht pool);
+
+/*
+** Get a 32 bits handle of a memory block from a single-size memory pool created with ELR_MPL_HANDLES.
+** Returns 0 for a memory block of any other pool.
+*/
+/*! \brief get the handle of a memory block.
+ *  \param mem pointer to a memory block from a memory pool.
+ *  \retval 0 if the pool of the memory block has no handles.
+ *
+ *  the handle carries 4 bits of the memory block`s generation, so a
+ *  handle kept after the block was freed is caught by elr_mpl_resolve,
+ *  unless the slot was reused exactly a multiple of 16 times since.
+ */
+ELR_MPL_API elr_mpl_handle_t elr_mpl_handle(void* mem);
+
+/*
+** Get the memory block a handle names, NULL if the handle is stale or invalid.
+*/
+ELR_MPL_API void* elr_mpl_resolve(elr_mpl_ht pool, elr_mpl_handle_t handle);
+
 /*
 ** Get the size of the memory block requested from the memory pool.
 */
@@ -236,10 +713,252 @@ ELR_MPL_API size_t elr_mpl_size(void* mem);
  */
 ELR_MPL_API void elr_mpl_free(void* mem);
 
+/*
+** Limit the bytes of memory nodes a memory pool and all pools below it may hold, 0 removes the limit.
+** A memory block that would need a memory node over the limit of any ancestor is refused, the allocation returns NULL.
+*/
+/*! \brief set the memory budget of a pool subtree.
+ *  \param pool   pointer to a elr_mpl_t type variable.
+ *  \param bytes  the limit, node headers included.
+ *
+ *  nodes are charged to the pool and every ancestor when they are taken
+ *  from the system and uncharged when they are released. to limit a
+ *  multi-size pool, create it below a pool that has the limit.
+ */
+ELR_MPL_API void elr_mpl_set_limit(elr_mpl_ht pool, size_t bytes);
+
+/*
+** Set the function called when the limit of a memory pool is hit.
+** It runs while the pool being allocated from is locked, it must not allocate from or give back to that pool.
+** It must not create, destroy or dump any pool either, those lock the pool tree before pool locks.
+** It may raise the limit, or have another thread release memory, and return nonzero to retry.
+*/
+ELR_MPL_API void elr_mpl_set_limit_callback(elr_mpl_ht pool, elr_mpl_limit_callback on_limit, void* ctx);
+
+/*
+** Get the bytes of memory nodes a memory pool and all pools below it hold.
+*/
+ELR_MPL_API size_t elr_mpl_charged(elr_mpl_ht pool);
+
+/*
+** Take one more reference to a memory block, the caller must already hold one.
+*/
+/*! \brief add a reference to a memory block.
+ *  \param mem pointer to a memory block from a memory pool.
+ *
+ *  a memory block starts with the one reference of its allocation. the
+ *  count is kept atomically in the slice header, so references may be
+ *  passed to and dropped by other threads without any side allocation.
+ */
+ELR_MPL_API void elr_mpl_retain(void* mem);
+
+/*
+** Drop a reference to a memory block, the last one gives it back to its pool as elr_mpl_free does.
+** A retained memory block must be given back by elr_mpl_release, not by elr_mpl_free.
+*/
+ELR_MPL_API void elr_mpl_release(void* mem);
+
+/*
+** Give back every memory block of the memory pool at once, the pool keeps its memory nodes.
+** on_free is invoked for each memory block still in use when it was set at creation.
+** For a multi-size memory pool all of its size classes are reset.
+*/
+/*! \brief give back all memory blocks of a memory pool.
+ *  \param pool  pointer to a elr_mpl_t type variable.
+ *
+ *  costs one step per memory node and never frees or allocates memory,
+ *  so a pool can be reused every frame or request. child pools are not
+ *  reset. all memory blocks of the pool become invalid.
+ */
+ELR_MPL_API void elr_mpl_reset(elr_mpl_ht pool);
+
+/*
+** Move the memory blocks of the most sparsely used memory nodes into free memory blocks of fuller nodes and give the emptied nodes back.
+** relocate is called for each moved memory block to fix up references to it. Returns the bytes of the memory nodes given back.
+*/
+/*! \brief compact a memory pool.
+ *  \param pool      pointer to a elr_mpl_t type variable.
+ *  \param relocate  gets the old and the new address of every moved memory block and ctx.
+ *  \param ctx       user context given to relocate.
+ *  \retval bytes of memory nodes given back.
+ *
+ *  memory blocks are moved with memcpy, their reference count moves with
+ *  them, the alloc and free callbacks are not called. nodes are emptied
+ *  from the sparsest one on as long as fuller nodes have room for them.
+ *  the pool lock is held throughout, relocate must not use the pool and
+ *  no other thread may touch its memory blocks meanwhile. handles of the
+ *  moved memory blocks become stale. arena pools, buffer pools and
+ *  object caches are not compacted. over-range classes of a multi-size
+ *  pool are not compacted.
+ *
+ *  blocks parked in a thread cache of elr_mpl_inline.h look allocated to
+ *  the pool and would be moved behind the cache`s back, flush the thread
+ *  caches of the pool first. nothing is compacted while blocks of the
+ *  pool wait in a retire list, call elr_mpl_retire_flush first.
+ */
+ELR_MPL_API size_t elr_mpl_compact(elr_mpl_ht pool, elr_mpl_relocate relocate, void* ctx);
+
+/*
+** Call visit for every allocated memory block of a memory pool, memory node by memory node in address order.
+** Returns the number of memory blocks visited.
+*/
+/*! \brief visit the allocated memory blocks of a memory pool.
+ *  \param pool   pointer to a elr_mpl_t type variable.
+ *  \param visit  gets every allocated memory block and ctx.
+ *  \param ctx    user context given to visit.
+ *  \retval number of memory blocks visited.
+ *
+ *  the sweep walks the memory of each node in order and prefetches ahead,
+ *  instead of chasing the list of allocated blocks. the pool lock is held
+ *  throughout, visit must not allocate from or free to the pool. blocks
+ *  held by thread caches count as allocated. arena pools and over-range
+ *  blocks of a multi-size pool are not visited, child pools neither.
+ */
+ELR_MPL_API size_t elr_mpl_foreach(elr_mpl_ht pool, elr_mpl_visit visit, void* ctx);
+
+/*
+** Like elr_mpl_foreach but visit gets the allocated memory blocks of a memory node in arrays of up to 64.
+*/
+/*! \brief visit the allocated memory blocks of a memory pool in batches.
+ *  \param pool   pointer to a elr_mpl_t type variable.
+ *  \param visit  gets an array of allocated memory blocks, its length and ctx.
+ *  \param ctx    user context given to visit.
+ *  \retval number of memory blocks visited.
+ *
+ *  a batch never spans two memory nodes, the array is only valid during
+ *  the call.
+ */
+ELR_MPL_API size_t elr_mpl_foreach_batch(elr_mpl_ht pool, elr_mpl_visit_batch visit, void* ctx);
+
+/*
+** Get the lock contention counters of a memory pool.
+** For a multi-size memory pool the counters of its first size class are reported.
+*/
+/*! \brief get the lock contention counters of a memory pool.
+ *  \param pool  pointer to a elr_mpl_t type variable.
+ *  \param stat  receives the counters.
+ *  \retval zero if the pool has no lock.
+ */
+ELR_MPL_API int elr_mpl_lock_stats(elr_mpl_ht pool, elr_mpl_lock_stat* stat);
+
+/*
+** Write a dump of a memory pool, its memory nodes and its child memory pools to the file descriptor fd.
+** When pool is NULL the whole pool tree is dumped. tools/elr_mpl_dumptool renders and compares dumps.
+*/
+/*! \brief dump the layout of memory pools for fragmentation analysis.
+ *  \param pool  pointer to a elr_mpl_t type variable, NULL for all pools.
+ *  \param fd    file descriptor the dump is written to.
+ *  \retval zero if memory ran out or a write failed.
+ *
+ *  the dump is JSON lines: a header line, then for every pool a line
+ *  with its geometry, node count and memory blocks in use, followed by a
+ *  line per memory node with its address, slices carved, slices in use,
+ *  free list length and a hex map of its slices, 1 bits for those in use.
+ *  the lines are collected with the pool tree lock and each pool lock
+ *  held and written once they are dropped. a biased pool still owned by
+ *  another thread is not locked, locking would take its bias away, so
+ *  its line carries "biased":1 instead of nodes and blocks in use.
+ *  unsynchronized pools must not be in use.
+ */
+ELR_MPL_API int elr_mpl_dump(elr_mpl_ht pool, int fd);
+
+/*
+** Start recording elr_mpl_create*, elr_mpl_create_multi*, elr_mpl_destroy, elr_mpl_alloc, elr_mpl_alloc_multi
+** and elr_mpl_free calls of all threads into a binary trace written to fd. test/replay.c plays a trace back.
+*/
+/*! \brief start recording an allocation trace.
+ *  \param fd  file descriptor the trace is written to.
+ *  \retval zero if a trace is already being recorded or the header could not be written.
+ *
+ *  the trace is a elr_mpl_trace_header followed by elr_mpl_trace_records.
+ *  every thread collects 256 records before it writes them out, so the
+ *  records of different threads are interleaved in blocks, sort them by
+ *  time. while no trace is recorded the calls only test a flag. calls
+ *  made through other functions, like the memory blocks of arena or
+ *  mapped pools, are not recorded, elr_mpl_alloc_wait and elr_mpl_release are recorded as the
+ *  alloc and free they make, elr_mpl_alloc_batch and elr_mpl_free_batch
+ *  as one alloc or free per memory block.
+ */
+ELR_MPL_API int elr_mpl_trace_start(int fd);
+
+/*
+** Stop recording and write out the records all threads still hold. fd is not closed.
+*/
+/*! \brief stop recording an allocation trace.
+ *  \retval zero if no trace was recorded or writing it failed.
+ */
+ELR_MPL_API int elr_mpl_trace_stop();
+
+/*
+** Start a background thread that gives back memory nodes no memory block was taken from for decay_ms milliseconds.
+** It wakes up every interval_ms milliseconds and walks all memory pools.
+*/
+/*! \brief start the idle node reclaimer.
+ *  \param decay_ms     how long a memory node must stay unused.
+ *  \param interval_ms  time between two walks of the pool tree.
+ *  \retval zero if the reclaimer is already running or can not be started.
+ *
+ *  only sync pools and biased pools already used by several threads are
+ *  reclaimed, the lock of a pool is held for a few memory nodes at a time.
+ *  arena pools only give back their spare nodes, nodes kept by the
+ *  global node cache of destroyed pools are freed after decay_ms too.
+ */
+ELR_MPL_API int elr_mpl_start_reclaimer(unsigned int decay_ms, unsigned int interval_ms);
+
+/*
+** Stop the reclaimer thread, elr_mpl_finalize stops it too.
+*/
+/*! \brief stop the idle node reclaimer.
+ *  \retval bytes given back since the reclaimer was started.
+ */
+ELR_MPL_API size_t elr_mpl_stop_reclaimer();
+
+/*
+** Enter a read-side critical section of epoch based reclamation, calls may nest.
+** Memory blocks retired while a thread is inside are not given back before it leaves.
+*/
+/*! \brief enter a read-side critical section.
+ *
+ *  readers of lock-free structures built on memory pools call this
+ *  before they load pointers to shared memory blocks, and elr_mpl_exit
+ *  when they drop them. it costs a store and a fence, no lock.
+ */
+ELR_MPL_API void elr_mpl_enter();
+
+/*
+** Leave a read-side critical section.
+*/
+ELR_MPL_API void elr_mpl_exit();
+
+/*
+** Retire a memory block already unlinked from every shared structure, it is given back to its pool
+** once every thread that was inside a critical section at that time has left it.
+** Returns zero if the block could not be recorded, the caller still owns it then.
+*/
+/*! \brief give back a memory block after a grace period.
+ *  \param mem pointer to a memory block from a memory pool.
+ *
+ *  retired blocks are kept per thread in chunks and given back in
+ *  batches. blocks of a thread that finished are given back by other
+ *  threads. a thread must not retire while it blocks the grace period
+ *  forever, by never leaving a critical section.
+ */
+ELR_MPL_API int elr_mpl_retire(void* mem);
+
+/*
+** Give back the retired memory blocks whose grace period has passed.
+** Returns the number of blocks the calling thread still holds.
+*/
+ELR_MPL_API size_t elr_mpl_retire_flush();
+
 /*
 ** Destroy the memory pool and its child memory pools。
 */
 /*! \brief destroy a memory pool and it`s child pools.
+ *
+ *  up to 16MB of the released memory nodes are kept in a global cache,
+ *  the next pools with the same node size take them before calling
+ *  malloc. the reclaimer frees cached nodes once they decayed.
  */
 ELR_MPL_API void elr_mpl_destroy(elr_mpl_ht pool);
 
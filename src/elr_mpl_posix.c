@@ -3,7 +3,20 @@
 #include <cstdlib>
 #include <cassert>
 #include <cstring>
+#include <cerrno>
+#include <cstdarg>
+#include <climits>
+#include <ctime>
 #include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#endif
 
 #include "elr_mpl_posix.h"
 
@@ -16,6 +29,16 @@
 /*The size of the memory node is guaranteed to be approximately equal to ELR_MAX_SLICE_COUNT*ELR_MAX_SLICE_SIZE*/
 #define ELR_MAX_SLICE_COUNT             64     /*64*/
 
+/*Cache line and page size the node layout is planned for*/
+#define ELR_CACHE_LINE                  64
+#define ELR_PAGE_SIZE                   4096
+/*Smallest node malloc maps on its own and so rounds to pages, glibc`s default M_MMAP_THRESHOLD*/
+#define ELR_MMAP_THRESHOLD              131072 /*128KB*/
+/*Header malloc puts in front of such a node, inside the pages it maps*/
+#define ELR_MMAP_CHUNK_HEADER           (2*sizeof(size_t))
+/*Most cache line offsets the nodes of a pool start their slices at, see _elr_color_setup*/
+#define ELR_MAX_COLORS                  8
+
 /*The cardinality of the memory block size of the newly created memory pool when none of the sub-pools in the multi-size memory pool meet the requested size*/
 /* That is, the memory block size of the newly created memory pool should be the smallest integer multiple of ELR_OVERRANGE_UNIT_SIZE larger than the application size*/
 #define ELR_OVERRANGE_UNIT_SIZE         1024  /*1KB*/
@@ -26,6 +49,90 @@
 
 #define ELR_ALIGN(size, boundary)       (((size) + ((boundary) - 1)) & ~((boundary) - 1)) 
 
+/*Default node size of an arena pool*/
+#define ELR_ARENA_NODE_SIZE             65536  /*64KB*/
+/*Alignment of every memory block from an arena pool*/
+#define ELR_ARENA_ALIGN                 16
+
+/*Internal creation flag, the pool is an arena, it bumps a pointer through its nodes*/
+#define ELR_MPL_ARENA_POOL              0x10000
+/*Internal creation flag, the nodes of the pool are cut from a buffer of the caller and never freed*/
+#define ELR_MPL_BUFFER_POOL             0x20000
+
+/*Values of elr_mem_pool.sync*/
+#define ELR_SYNC_NONE                   0
+#define ELR_SYNC_LOCK                   1
+#define ELR_SYNC_BIASED                 2
+
+/*Upper bound of the spin rounds an adaptive pool lock tries before parking on the futex*/
+#define ELR_LOCK_MAX_SPIN               200
+/*Spin rounds an adaptive pool lock starts with, it then follows the rounds really needed*/
+#define ELR_LOCK_INIT_SPIN              50
+
+/*Magic number and layout version at the start of a mapped pool*/
+#define ELR_MAPPED_MAGIC                0x4d524c45  /*"ELRM"*/
+#define ELR_MAPPED_VERSION              1
+/*Alignment of every memory block of a mapped pool*/
+#define ELR_MAPPED_ALIGN                16
+
+/*Layout of an elr_mpl_handle_t, [generation:4][node index:22][slice index:6]*/
+#define ELR_HANDLE_SLICE_BITS           6
+#define ELR_HANDLE_NODE_BITS            22
+#define ELR_HANDLE_GEN_BITS             4
+/*Initial entries of the node table of a pool handing out handles*/
+#define ELR_NODE_TABLE_INIT             64
+
+/*Requested sizes up to ELR_HISTOGRAM_LIMIT are counted in bins of ELR_HISTOGRAM_UNIT bytes*/
+#define ELR_HISTOGRAM_UNIT              16
+#define ELR_HISTOGRAM_LIMIT             32768  /*32KB*/
+#define ELR_HISTOGRAM_BINS              (ELR_HISTOGRAM_LIMIT/ELR_HISTOGRAM_UNIT + 1)
+/*Requests a histogram bin needs before a refined class is made for it*/
+#define ELR_REFINE_THRESHOLD            256
+
+/*Retired memory blocks per chunk of a retire list*/
+#define ELR_EBR_CHUNK                   62
+/*Retirements a thread makes between two attempts to advance the epoch*/
+#define ELR_EBR_BATCH                   128
+
+/*Occupancy buckets of a fullest-first pool, a node with free slices sits in bucket using*ELR_OCCUPANCY_BUCKETS/slice_count*/
+#define ELR_OCCUPANCY_BUCKETS           8
+
+/*Nodes the reclaimer looks at per pool lock hold, the lock is dropped between batches*/
+#define ELR_RECLAIM_BATCH               16
+
+/*Node sizes the global node cache keeps nodes of at a time*/
+#define ELR_NODE_CACHE_CLASSES          16
+/*Most bytes of nodes released by destroyed pools the global node cache keeps*/
+#define ELR_NODE_CACHE_LIMIT            16777216 /*16MB*/
+
+/*Memory blocks handed to a batch visitor at a time*/
+#define ELR_VISIT_BATCH                 64
+/*Slices a sweep prefetches ahead of the one it looks at*/
+#define ELR_PREFETCH_SLICES             4
+
+/*Trace records a thread collects before it writes them out*/
+#define ELR_TRACE_RECORDS               256
+
+/*! \brief compact pool lock.
+ *
+ *  a three state futex lock, 0 is unlocked, 1 is locked, 2 is locked
+ *  and some thread may be parked on it. an adaptive lock spins a while
+ *  before it parks, a blocking lock parks at once like a plain mutex.
+ *  the counters are only written by the lock holder.
+ */
+typedef struct __elr_mem_lock
+{
+    int                          state;
+    /*Spin rounds learned from recent contention, 0 for a blocking lock*/
+    int                          spin;
+    unsigned long long           acquired;
+    unsigned int                 contended;
+    unsigned int                 parked;
+    /*Nonzero when the lock lives in memory shared by several processes*/
+    int                          shared;
+}
+elr_mem_lock;
+
 /*! \brief memory node type.
  *
  */
@@ -43,6 +150,23 @@ typedef struct __elr_mem_node
     /*The number of slices used*/
     size_t                       used_slice_count;
     char                        *first_avail;
+    /*Bytes of the node including this header*/
+    size_t                       size;
+    /*The first slice of the node, the header is followed by the color offset of the node*/
+    char                        *first_slice;
+    /*Reclaimer tick at which the node was last seen with no slice in use*/
+    unsigned long                idle_since;
+    /*Fullest-first pools only, the links of the occupancy bucket holding the node*/
+    struct __elr_mem_node       *avail_prev;
+    struct __elr_mem_node       *avail_next;
+    /*Fullest-first pools only, the occupancy bucket of the node, -1 when it has no free slice*/
+    int                          bucket;
+    /*Pools handing out handles only, the entry of the node in the node table, 0 for none*/
+    unsigned int                 index;
+    /*Even tag the slices of the node start from, above every tag of the nodes that had its entry before*/
+    int                          first_tag;
+    /*Slices carved since the node was allocated, their tags are kept when elr_mpl_reset rewinds the node*/
+    size_t                       carved_slice_count;
 }
 elr_mem_node;
 
@@ -54,52 +178,234 @@ typedef struct __elr_mem_slice
     elr_mem_node                *node;
     /*The label of the inner slice, the initial value is 0, and it will be incremented by 1 every time it is taken out and returned from the memory pool*/
     int                          tag;
+    /*References taken by elr_mpl_retain beyond the one of the allocation, fits the padding after tag*/
+    int                          refs;
 }
 elr_mem_slice;
 
 typedef struct __elr_mem_pool
 {
-    struct __elr_mem_pool       *parent;
-    struct __elr_mem_pool       *first_child;
-    struct __elr_mem_pool       *prev;
-    struct __elr_mem_pool       *next;
-	/* Cooperate with this memory pool to complete the application for other memory pools of different size memory blocks*/
-	struct __elr_mem_pool      **multi;
-	/*Number of memory pools included in multi*/
-	int                          multi_count;
-	/*The number of slices contained in each elr_mem_node*/
-    size_t                       slice_count;
-    size_t                       slice_size;
-    size_t                       object_size;
-    size_t                       node_size;
-    /*A linked list of all elr_mem_nodes*/
-    elr_mem_node                *first_node;
+    /* hot, read or written by every alloc and free, the pool lock is taken by the same threads that write the lists. */
+    /*How the pool is synchronized, one of ELR_SYNC_NONE, ELR_SYNC_LOCK, ELR_SYNC_BIASED*/
+	int                          sync;
+    /*The ELR_MPL_* flags the pool was created with*/
+    int                          flags;
+    elr_mem_lock                 pool_mutex;
+    /*Thread token of the thread a biased pool belongs to*/
+    void                        *bias_owner;
+    /*Set by the owner while it works on a biased pool without the lock*/
+    int                          bias_busy;
+    /*Set once another thread touched a biased pool, then everybody locks*/
+    int                          bias_revoked;
+    /*Linked list of free memory slices, not used by fullest-first pools*/
+    elr_mem_slice               *first_free_slice;
     /*Just created elr_mem_node*/
     elr_mem_node                *newly_alloc_node;
-    /*Linked list of free memory slices*/
-    elr_mem_slice               *first_free_slice;
+    /*The linked list of memory slices in use, if on_slice_free is NULL, this member is not used*/
+    elr_mem_slice               *first_occupied_slice;
+    /*The number of memory blocks in use*/
+    size_t                       using_count;
+    /*Most memory blocks in use at a time, 0 for no limit*/
+    size_t                       capacity;
+    size_t                       slice_size;
+    size_t                       object_size;
     /*Function pointer, the parameter is the currently allocated memory, executed when the slice is allocated*/
     elr_mpl_callback             on_slice_alloc;
     /*Function pointer, the parameter is the currently freed memory, executed when the slice is freed*/
     elr_mpl_callback             on_slice_free;
-    /*The linked list of memory slices in use, if on_slice_free is NULL, this member is not used*/
-    elr_mem_slice               *first_occupied_slice;
+    /*Object cache pools only, run once when a slice is carved and once when its node is released*/
+    elr_mpl_ctor                 obj_ctor;
+    elr_mpl_ctor                 obj_dtor;
+    /*User context given to obj_ctor and obj_dtor*/
+    void                        *obj_ctx;
+	/* Cooperate with this memory pool to complete the application for other memory pools of different size memory blocks*/
+	struct __elr_mem_pool      **multi;
+	/*Number of memory pools included in multi*/
+	int                          multi_count;
     /* The label of the memory slice that holds the object of this memory pool */
     int                          slice_tag;
-#ifdef USE_THREADLOCK
-    /*Whether the synchronization lock is created*/
-	int                          sync;
-    pthread_mutex_t              pool_mutex;
-#endif /// of USE_PTHREAD
+    /*multi[0] of a ELR_MPL_SIZE_HISTOGRAM pool only, requests per bin of ELR_HISTOGRAM_UNIT bytes*/
+    unsigned int                *size_histogram;
+    /*multi[0] of a ELR_MPL_REFINE_CLASSES pool only, the class made for a histogram bin, if any*/
+    struct __elr_mem_pool      **refined_class;
+    /*Fullest-first pools only, nodes with free slices by occupancy, the fullest bucket is the last*/
+    elr_mem_node                *avail_bucket[ELR_OCCUPANCY_BUCKETS];
+
+    /* warm, touched when a node is taken or given back. */
+    /*The number of slices contained in each elr_mem_node*/
+    size_t                       slice_count;
+    size_t                       node_size;
+    /*A linked list of all elr_mem_nodes*/
+    elr_mem_node                *first_node;
+    /*After a reset, the next node of first_node list whose slices were never used again*/
+    elr_mem_node                *fresh_node;
+    /*Arena pools only, nodes given back by rollback, kept for reuse and linked by next*/
+    elr_mem_node                *spare_node;
+    /*The node of first_node list the next batch of the reclaimer starts at, moved on when it is unlinked*/
+    elr_mem_node                *reclaim_cursor;
+    /*Cache line offsets new nodes start their slices at in turn, 1 for no coloring*/
+    size_t                       color_count;
+    /*The color of the next new node*/
+    size_t                       next_color;
+    /*Buffer pools only, the part of the caller`s buffer no node was cut from yet*/
+    char                        *buffer_avail;
+    char                        *buffer_end;
+    /*ELR_MPL_HANDLES pools only, nodes by the index handles carry, entry 0 is never used*/
+    elr_mem_node               **node_table;
+    /*Entries allocated and entries handed out so far in node_table*/
+    size_t                       node_table_size;
+    size_t                       node_table_count;
+    /*No entry below this one is free*/
+    size_t                       node_table_hint;
+    /*Per entry of node_table, the tag the slices of the next node taking the entry start from*/
+    int                         *node_table_tag;
+    /*Most bytes of memory nodes the pool and its children may hold, 0 for no limit*/
+    size_t                       limit;
+    /*Called when a new memory node would pass the limit*/
+    elr_mpl_limit_callback       on_limit;
+    void                        *limit_ctx;
+
+    /* cold, written by other threads, kept off the cache lines above. */
+    /*Bytes of memory nodes the pool and its children hold, updated atomically, children charge it too*/
+    size_t                       charged __attribute__((aligned(ELR_CACHE_LINE)));
+    /*Threads parked in elr_mpl_alloc_wait*/
+    int                          waiters;
+    /*Futex word of elr_mpl_alloc_wait, bumped when a memory block is given back while somebody waits*/
+    int                          free_seq;
+    /*Memory blocks retired by elr_mpl_retire and not given back yet, updated atomically*/
+    size_t                       retired_count;
+    /*Guards lookup and creation of over-range classes, only used by multi[0] of a sync multi pool*/
+    elr_mem_lock                 multi_mutex;
+    /*Tree links, changed when a sibling or a child is created or destroyed*/
+    struct __elr_mem_pool       *parent;
+    struct __elr_mem_pool       *first_child;
+    struct __elr_mem_pool       *prev;
+    struct __elr_mem_pool       *next;
 }
 elr_mem_pool;
 
+/*! \brief header at the start of a mapped pool.
+ *
+ *  a mapped pool lives entirely inside one mapping that several processes
+ *  may map at different addresses, so it only holds offsets from the
+ *  start of the mapping, 0 stands for none.
+ */
+typedef struct __elr_mapped_header
+{
+    /*ELR_MAPPED_MAGIC once the creator finished the layout*/
+    unsigned int                 magic;
+    unsigned int                 version;
+    /*Bytes of the whole mapping*/
+    size_t                       map_size;
+    size_t                       object_size;
+    size_t                       slice_size;
+    /*Offset of the first slice of the mapping*/
+    size_t                       first_slice;
+    /*Offset of the first free slice*/
+    size_t                       first_free;
+    /*Offset of the first slice never handed out*/
+    size_t                       first_avail;
+    /*The number of slices in use*/
+    size_t                       using_count;
+    /*Offset of the memory block the user finds the others from after a reopen*/
+    size_t                       root;
+    elr_mem_lock                 lock;
+}
+elr_mapped_header;
+
+typedef struct __elr_mapped_slice
+{
+    /*Offset of the next free slice*/
+    size_t                       next;
+    /*Odd while the slice is allocated, like elr_mem_slice.tag*/
+    int                          tag;
+}
+elr_mapped_slice;
+
+
+/*! \brief chunk of a retire list.
+ *
+ *  all memory blocks of a chunk were retired in the same epoch.
+ */
+typedef struct __elr_ebr_chunk
+{
+    struct __elr_ebr_chunk      *next;
+    /*Global epoch the memory blocks were retired in*/
+    unsigned long                epoch;
+    int                          count;
+    void                        *mem[ELR_EBR_CHUNK];
+}
+elr_ebr_chunk;
+
+/*! \brief epoch record of a thread.
+ *
+ *  records are never freed, the record of a finished thread is taken
+ *  over by the next thread that needs one.
+ */
+typedef struct __elr_ebr_record
+{
+    /*Global epoch the thread entered in, 0 while it is outside*/
+    unsigned long                epoch;
+    /*Depth of nested elr_mpl_enter calls*/
+    int                          nest;
+    /*Nonzero while a thread owns the record*/
+    int                          in_use;
+    /*Memory blocks retired by the thread, newest chunk first*/
+    elr_ebr_chunk               *retired;
+    /*Retirements since the last attempt to advance the epoch*/
+    int                          since_advance;
+    struct __elr_ebr_record     *next;
+}
+elr_ebr_record;
+
+/*! \brief nodes of one size in the global node cache.
+ *
+ *  the nodes are linked by next, the most recently released first.
+ */
+typedef struct __elr_node_cache_class
+{
+    /*Bytes of every node of the class, 0 for an unused class*/
+    size_t                       node_size;
+    elr_mem_node                *first;
+}
+elr_node_cache_class;
+
+/*! \brief text of a pool dump collected under the pool tree lock and written after it.
+ */
+typedef struct __elr_dump_buf
+{
+    char                        *data;
+    size_t                       len;
+    size_t                       size;
+    /*Set once memory or a write failed, nothing more is collected then*/
+    int                          failed;
+}
+elr_dump_buf;
+
+/*! \brief trace records of a thread waiting to be written.
+ *
+ *  buffers are never freed, the buffer of a finished thread is taken
+ *  over by the next thread that records. the lock is only contended by
+ *  elr_mpl_trace_stop collecting the buffer.
+ */
+typedef struct __elr_trace_buffer
+{
+    elr_mem_lock                 lock;
+    /*Nonzero while a thread owns the buffer*/
+    int                          in_use;
+    /*Number of the buffer, written as the thread of its records*/
+    unsigned short               thread;
+    size_t                       count;
+    struct __elr_trace_buffer   *next;
+    elr_mpl_trace_record         records[ELR_TRACE_RECORDS];
+}
+elr_trace_buffer;
 
 /*global memory pool*/
 static elr_mem_pool     g_mem_pool;
 /*Global multi-size memory pool*/
 static elr_mpl_t        g_multi_mem_pool;
-/* The total amount of memory occupied by all memory pools */
+/* The total amount of memory occupied by all memory pools, updated atomically as pools lock independently */
 static size_t           g_occupation_size = 0;
 
 elr_mpl_t ELR_MPL_INITIALIZER = { NULL,0 };
@@ -108,589 +414,2594 @@ elr_mpl_t ELR_MPL_INITIALIZER = { NULL,0 };
 static long             g_mpl_refs = 0;
 static pthread_mutex_t  g_mpl_refs_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-/*Create a memory pool and specify the allocation unit size, whether sync is performed with synchronization support. */
+/*Its address identifies the calling thread for biased pools*/
+static __thread char    g_thread_token = 0;
+/*Whether the owner of a biased pool may skip the full fence, revokers issue membarrier instead*/
+static int              g_bias_membarrier = -1;
+
+/*Guards linking and unlinking of pools in the pool tree, taken before any pool lock*/
+static elr_mem_lock     g_tree_lock = { 0, 0, 0, 0, 0, 0 };
+/*Set while the calling thread runs a limit callback, which holds a pool lock and must not take g_tree_lock*/
+static __thread int     g_in_limit_callback = 0;
+
+/*Global epoch of deferred reclamation, a block retired in epoch e is given back once it reaches e+2*/
+static unsigned long    g_ebr_epoch = 1;
+/*Epoch records of all threads that used deferred reclamation, pushed at the head only*/
+static elr_ebr_record*  g_ebr_records = NULL;
+/*Chunks left by finished threads, guarded by g_ebr_mtx*/
+static elr_ebr_chunk*   g_ebr_orphans = NULL;
+static pthread_mutex_t  g_ebr_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t    g_ebr_key;
+static pthread_once_t   g_ebr_once = PTHREAD_ONCE_INIT;
+static __thread elr_ebr_record* g_ebr_self = NULL;
+
+/*Trace recording state, g_trace_on is checked by every traced call, g_trace_mtx guards writes to g_trace_fd*/
+static int              g_trace_on = 0;
+static int              g_trace_fd = -1;
+static int              g_trace_failed = 0;
+static unsigned long long g_trace_start = 0;
+static pthread_mutex_t  g_trace_mtx = PTHREAD_MUTEX_INITIALIZER;
+/*Serializes elr_mpl_trace_start and elr_mpl_trace_stop*/
+static pthread_mutex_t  g_trace_ctl_mtx = PTHREAD_MUTEX_INITIALIZER;
+/*Trace buffers of all threads that recorded, pushed at the head only*/
+static elr_trace_buffer* g_trace_buffers = NULL;
+static unsigned short   g_trace_threads = 0;
+static pthread_key_t    g_trace_key;
+static pthread_once_t   g_trace_once = PTHREAD_ONCE_INIT;
+static __thread elr_trace_buffer* g_trace_self = NULL;
+
+/*Background reclaimer state, g_reclaim_mtx guards all but the tick*/
+static pthread_mutex_t  g_reclaim_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   g_reclaim_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t        g_reclaim_thread;
+static int              g_reclaim_running = 0;
+static int              g_reclaim_stop = 0;
+static unsigned int     g_reclaim_interval = 0;
+/*Decay time in reclaimer ticks*/
+static unsigned long    g_reclaim_decay = 0;
+/*Bumped by the reclaimer every interval, stamps nodes as they become idle*/
+static unsigned long    g_reclaim_tick = 0;
+/*Bytes given back to the system since the reclaimer started*/
+static size_t           g_reclaim_released = 0;
+
+/*Nodes of destroyed pools kept for the next pools with the same node size, guarded by g_node_cache_lock*/
+static elr_node_cache_class g_node_cache[ELR_NODE_CACHE_CLASSES];
+/*Bytes of all nodes in g_node_cache, also read without the lock*/
+static size_t           g_node_cache_bytes = 0;
+static elr_mem_lock     g_node_cache_lock = { 0, 0, 0, 0, 0, 0 };
+
+/*Create a memory pool and specify the allocation unit size, flags are the ELR_MPL_SYNC* creation flags. */
 elr_mem_pool*       _elr_mpl_create(elr_mem_pool* pool, 
 	                                size_t obj_size, 
 	                                elr_mpl_callback on_alloc, 
 	                                elr_mpl_callback on_free, 
-	                                int sync);
-/*Create a memory pool from which you can apply for memory blocks of different sizes, whether sync is executed with synchronization support. */
+	                                int flags);
+/*Create a memory pool from which you can apply for memory blocks of different sizes, flags are the ELR_MPL_SYNC* creation flags. */
 elr_mem_pool*       _elr_mpl_create_multi(elr_mem_pool* pool,
 	                                      int obj_size_count,
 	                                      size_t* obj_size,
 	                                      elr_mpl_callback on_alloc, 
 	                                      elr_mpl_callback on_free, 
-	                                      int sync);
+	                                      int flags);
 /* Determine if the memory pool is valid */
 int                 _elr_mpl_avail(elr_mem_pool* pool);
+/*Allocate a memory block from a single-size memory pool, without tracing it*/
+void*               _elr_mpl_alloc(elr_mem_pool* pool);
+/*Allocate a memory block of size bytes from a multi-size memory pool, without tracing it*/
+void*               _elr_mpl_alloc_multi(elr_mem_pool* pool, size_t size);
+/*Give a memory block back to its memory pool, without tracing it*/
+void                _elr_mpl_free(void* mem);
 /* Apply for a memory node for the memory pool */
 void                 _elr_alloc_mem_node(elr_mem_pool *pool);
 /*Remove an unused NODE, return 0 for no removal*/
 void                _elr_free_mem_node(elr_mem_node* node);
+/*Detach an unused node from its pool without freeing it*/
+void                _elr_unlink_mem_node(elr_mem_node* node);
+/*Get the class made for a histogram bin of a multi pool, creating it if needed*/
+elr_mem_pool*       _elr_multi_refine(elr_mem_pool *pool, size_t bin);
+/*Run the destructor of an object cache pool over every slice ever carved from the node*/
+void                _elr_node_destruct(elr_mem_pool *pool, elr_mem_node* node);
+/*Give a node an entry in the node table of its pool, it keeps index 0 if there is no room*/
+void                _elr_node_table_add(elr_mem_pool *pool, elr_mem_node* node);
 /*Allocate a memory slice in the just created memory node of the memory pool*/
 elr_mem_slice*      _elr_slice_from_node(elr_mem_pool *pool);
 /*Allocate a memory slice in the memory pool, this method will call the above two methods*/
 elr_mem_slice*      _elr_slice_from_pool(elr_mem_pool *pool);
+/*Take a slice from the pool or give one back, the caller holds the pool*/
+static inline elr_mem_slice* _elr_slice_take(elr_mem_pool* pool);
+static inline void  _elr_slice_give(elr_mem_pool* pool, elr_mem_slice* slice, void* mem);
+/*Get a node able to hold size bytes for an arena pool and make it the current one*/
+elr_mem_node*       _elr_arena_grow(elr_mem_pool *pool, size_t size);
+/*Give back the arena nodes newer than node and rewind node to avail*/
+void                _elr_arena_rollback(elr_mem_pool *pool, elr_mem_node *node, char *avail);
+/*Mark all slices of the memory pool free, keeping its nodes*/
+void                _elr_mpl_reset(elr_mem_pool *pool);
 /*Destroy the memory pool, inter indicates whether it is an internal call*/
 void                _elr_mpl_destory(elr_mem_pool *pool, int inner, int lock_this);
+/*Give back the nodes of the pool and its children that stayed idle for the decay time*/
+size_t              _elr_mpl_reclaim(elr_mem_pool *pool);
+/*Move the live memory blocks of the sparsest nodes of the pool into free slices of denser ones and free the emptied nodes*/
+size_t              _elr_mpl_compact(elr_mem_pool *pool, elr_mpl_relocate relocate, void *ctx);
+/*Call visit or visit_batch for every allocated memory block of the pool, node by node in address order*/
+size_t              _elr_mpl_foreach(elr_mem_pool *pool, elr_mpl_visit visit, elr_mpl_visit_batch visit_batch, void *ctx);
+/*Collect a JSON line for the pool and each of its nodes, then recurse into its children, the caller holds g_tree_lock*/
+void                _elr_mpl_dump(elr_mem_pool *pool, elr_dump_buf *buf);
+/*Lay out a mapped pool in the file fd refers to and map it*/
+void*               _elr_mapped_create(int fd, size_t obj_size, size_t obj_count);
+/*Map a mapped pool laid out before*/
+void*               _elr_mapped_attach(int fd);
 
-static long elr_atomic_inc( long* p )
+/*Add the bytes of a memory node to a pool and its parents, the first limit it would pass makes it fail*/
+static elr_mem_pool* _elr_charge_limited(elr_mem_pool* pool, size_t bytes)
 {
-    if ( p != NULL )
+    elr_mem_pool  *p = NULL;
+    elr_mem_pool  *q = NULL;
+    size_t         limit = 0;
+
+    for (p = pool; p != NULL; p = p->parent)
     {
-        pthread_mutex_lock( &g_mpl_refs_mtx );
-        *p += 1;
-        pthread_mutex_unlock( &g_mpl_refs_mtx);
-        return *p;
+        limit = __atomic_load_n(&p->limit, __ATOMIC_RELAXED);
+        if (__atomic_add_fetch(&p->charged, bytes, __ATOMIC_RELAXED) > limit && limit != 0)
+        {
+            for (q = pool; q != p->parent; q = q->parent)
+                __atomic_fetch_sub(&q->charged, bytes, __ATOMIC_RELAXED);
+            return p;
+        }
     }
-    
-    return 0;
+
+    __atomic_fetch_add(&g_occupation_size, bytes, __ATOMIC_RELAXED);
+    return NULL;
 }
 
-static long elr_atomic_dec( long* p )
+/*Charge a new memory node, giving the callback of a full pool one chance to make room, 0 if it does not fit*/
+static int _elr_charge(elr_mem_pool* pool, size_t bytes)
 {
-    if ( p != NULL )
+    elr_mem_pool           *full = _elr_charge_limited(pool, bytes);
+    elr_mpl_limit_callback  on_limit = NULL;
+    elr_mpl_t               mpl = ELR_MPL_INITIALIZER;
+
+    if (full != NULL)
+        on_limit = __atomic_load_n(&full->on_limit, __ATOMIC_ACQUIRE);
+    if (on_limit != NULL)
     {
-        pthread_mutex_lock( &g_mpl_refs_mtx );
-        if ( *p > 0 ) *p -= 1;
-        pthread_mutex_unlock( &g_mpl_refs_mtx);
-        return *p;
+        mpl.pool = full;
+        mpl.tag = full->slice_tag;
+        g_in_limit_callback = 1;
+        if (on_limit(&mpl, bytes, __atomic_load_n(&full->limit_ctx, __ATOMIC_RELAXED)) != 0)
+            full = _elr_charge_limited(pool, bytes);
+        g_in_limit_callback = 0;
     }
-    
-    return -1;
+
+    return full == NULL ? 1 : 0;
 }
 
-/*** Initialize the memory pool and create a global memory pool internally.
-** This method can be called repeatedly.
-** If the memory pool module has already been initialized, just increment the reference count and return.
-*/
-ELR_MPL_API int elr_mpl_init()
+/*Take the bytes of a released memory node off a pool and its parents*/
+static void _elr_uncharge(elr_mem_pool* pool, size_t bytes)
 {
-	int obj_size_count = 13;
-	size_t obj_size[13] = { 64, 98, 128, 192, 256, 384, 512, 768, 1024, 1280, 1536, 1792, 2048 };
-    long refs = elr_atomic_inc(&g_mpl_refs);
-    if(refs == 1)
+    elr_mem_pool  *p = NULL;
+
+    for (p = pool; p != NULL; p = p->parent)
+        __atomic_fetch_sub(&p->charged, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&g_occupation_size, bytes, __ATOMIC_RELAXED);
+}
+
+/*Initialize a pool lock, adaptive lock spins before parking*/
+static void _elr_lock_init(elr_mem_lock* lock, int adaptive)
+{
+    lock->state = 0;
+    lock->spin = adaptive ? ELR_LOCK_INIT_SPIN : 0;
+    lock->acquired = 0;
+    lock->contended = 0;
+    lock->parked = 0;
+    lock->shared = 0;
+}
+
+static inline void _elr_cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/*Park the calling thread while *addr still equals val, at most timeout if not NULL, a shared addr may be waited on from other processes*/
+static void _elr_futex_wait(int* addr, int val, int shared, const struct timespec* timeout)
+{
+#if defined(__linux__)
+    syscall(SYS_futex, addr, shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+#else
+    (void)shared;
+    (void)timeout;
+    if (__atomic_load_n(addr, __ATOMIC_RELAXED) == val)
+        sched_yield();
+#endif
+}
+
+/*Wake up at most count threads parked on addr*/
+static void _elr_futex_wake(int* addr, int count, int shared)
+{
+#if defined(__linux__)
+    syscall(SYS_futex, addr, shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+#else
+    (void)addr;
+    (void)count;
+    (void)shared;
+#endif
+}
+
+static void _elr_lock_acquire_slow(elr_mem_lock* lock)
+{
+    int          expect = 0;
+    int          spin = __atomic_load_n(&lock->spin, __ATOMIC_RELAXED);
+    int          max_spin = 0;
+    int          i = 0;
+    unsigned int parks = 0;
+
+    if (spin > 0)
     {
-        g_mem_pool.parent = NULL;
-        g_mem_pool.first_child = NULL;
-        g_mem_pool.prev = NULL;
-        g_mem_pool.next = NULL;
-		g_mem_pool.multi = NULL;
-		g_mem_pool.multi_count = 0;
-        g_mem_pool.object_size = sizeof(elr_mem_pool);
-        g_mem_pool.slice_size = ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int))
-            + ELR_ALIGN(sizeof(elr_mem_pool),sizeof(int));
-        g_mem_pool.slice_count = ELR_MAX_SLICE_COUNT;
-        g_mem_pool.node_size = g_mem_pool.slice_size*g_mem_pool.slice_count 
-            + ELR_ALIGN(sizeof(elr_mem_node),sizeof(int));
-        g_mem_pool.first_node = NULL;
-        g_mem_pool.newly_alloc_node = NULL;
-        g_mem_pool.first_free_slice = NULL;
-        g_mem_pool.on_slice_alloc = NULL;
-        g_mem_pool.on_slice_free = NULL;
-        g_mem_pool.first_occupied_slice = NULL;
-        g_mem_pool.slice_tag = 0;
-#ifdef USE_THREADLOCK
-		g_mem_pool.sync = 1;
-        if( pthread_mutex_init( &g_mem_pool.pool_mutex, NULL ) != 0 )
+        max_spin = spin * 2 + 10;
+        if (max_spin > ELR_LOCK_MAX_SPIN)
+            max_spin = ELR_LOCK_MAX_SPIN;
+
+        for (i = 0; i < max_spin; i++)
         {
-            elr_atomic_dec( &g_mpl_refs );
-            g_mem_pool.sync = 0;
-            return 0;
+            _elr_cpu_relax();
+            expect = 0;
+            if (__atomic_load_n(&lock->state, __ATOMIC_RELAXED) == 0
+                && __atomic_compare_exchange_n(&lock->state, &expect, 1, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                break;
         }
-		g_multi_mem_pool = elr_mpl_create_multi_sync(NULL, obj_size_count, obj_size, NULL, NULL);
-		if (g_multi_mem_pool.pool == NULL)
-		{
-			elr_atomic_dec(&g_mpl_refs);
-            g_mem_pool.sync = 0;
-			return 0;
-		}
-#else
-		g_multi_mem_pool = elr_mpl_create_multi(NULL, obj_size_count, obj_size, NULL, NULL);
-		if (g_multi_mem_pool.pool == NULL)
-		{
-			g_mpl_refs--;
-			return 0;
-		}
-#endif /// OF USE_THREADLOCK
     }
 
-    return 1;
-}
+    if (spin == 0 || i == max_spin)
+    {
+        while (__atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE) != 0)
+        {
+            parks++;
+            _elr_futex_wait(&lock->state, 2, lock->shared, NULL);
+        }
+    }
 
-/*
-** Create a memory pool and specify the maximum allocation unit size.
-** The first parameter represents the parent memory pool. If it is NULL, it means that the parent memory pool of the created memory pool is the global memory pool.
-*/
-ELR_MPL_API elr_mpl_t elr_mpl_create(elr_mpl_ht fpool,
-                                  	 size_t obj_size,
-                                  	 elr_mpl_callback on_alloc,
-                                  	 elr_mpl_callback on_free)
-{
-	elr_mpl_t      mpl = ELR_MPL_INITIALIZER;
-	elr_mem_pool  *pool = NULL;
+    /* follow the spin rounds really needed, like glibc adaptive mutex. */
+    if (spin > 0)
+    {
+        spin += (i - spin) / 8;
+        __atomic_store_n(&lock->spin, spin < 1 ? 1 : spin, __ATOMIC_RELAXED);
+    }
 
-	assert(fpool == NULL || elr_mpl_avail(fpool) != 0);
+    lock->acquired++;
+    lock->contended++;
+    lock->parked += parks;
+}
 
-    elr_mem_pool* tpl = NULL;
-    if ( fpool != NULL )
-        tpl = (elr_mem_pool*)fpool->pool;
+static inline void _elr_lock_acquire(elr_mem_lock* lock)
+{
+    int expect = 0;
 
-	pool = _elr_mpl_create( tpl, obj_size, on_alloc, on_free, 0);
-	if (pool != NULL)
-	{
-		mpl.pool = pool;
-		mpl.tag = pool->slice_tag;
+    if (__atomic_compare_exchange_n(&lock->state, &expect, 1, 0,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        lock->acquired++;
+        return;
     }
 
-	return mpl;
+    _elr_lock_acquire_slow(lock);
 }
 
-/*
-** Create a memory pool.
-** The first parameter represents the parent memory pool. If it is NULL, it means that the parent memory pool of the created memory pool is the global memory pool.
-** The second parameter represents the allocation unit size.
-** The third parameter provides a pointer to a function that will be executed when the memory is freed.
-*/
-ELR_MPL_API elr_mpl_t elr_mpl_create_sync(elr_mpl_ht fpool,
-                                        size_t obj_size,
-                                        elr_mpl_callback on_alloc,
-                                        elr_mpl_callback on_free)
+static inline void _elr_lock_release(elr_mem_lock* lock)
 {
-    elr_mpl_t      mpl = ELR_MPL_INITIALIZER;
-    elr_mem_pool  *pool = NULL;
+    if (__atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE) == 2)
+        _elr_futex_wake(&lock->state, 1, lock->shared);
+}
 
-#ifdef DEBUG
-    assert(fpool==NULL || elr_mpl_avail(fpool)!=0);
+/*Register for expedited membarrier once, biased owners then only need a compiler barrier*/
+static void _elr_bias_setup()
+{
+    int ok = 0;
+
+    if (__atomic_load_n(&g_bias_membarrier, __ATOMIC_ACQUIRE) != -1)
+        return;
+#if defined(__linux__) && defined(__NR_membarrier)
+    ok = syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
 #endif
+    __atomic_store_n(&g_bias_membarrier, ok, __ATOMIC_RELEASE);
+}
 
-    elr_mem_pool* tpl = NULL;
-    if ( fpool != NULL )
-        tpl = (elr_mem_pool*)fpool->pool;
+/*Try to work on a biased pool without its lock, return 0 if the lock must be taken*/
+static inline int _elr_bias_enter(elr_mem_pool* pool)
+{
+    if (pool->bias_owner != &g_thread_token)
+        return 0;
 
-	pool = _elr_mpl_create( tpl, obj_size, on_alloc, on_free, 1);
-	if (pool != NULL)
-	{
-		mpl.pool = pool;
-		mpl.tag = pool->slice_tag;
-	}
+    __atomic_store_n(&pool->bias_busy, 1, __ATOMIC_RELAXED);
+    if (g_bias_membarrier == 1)
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    else
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-        return mpl;
+    if (__atomic_load_n(&pool->bias_revoked, __ATOMIC_RELAXED) == 0)
+        return 1;
+
+    __atomic_store_n(&pool->bias_busy, 0, __ATOMIC_RELEASE);
+    return 0;
 }
 
-/*Create a memory pool and specify the allocation unit size, whether sync is performed with synchronization support. */
-elr_mem_pool* _elr_mpl_create(elr_mem_pool* fpool,
-	size_t obj_size,
-	elr_mpl_callback on_alloc,
-	elr_mpl_callback on_free,
-	int sync)
+/*Called with the pool lock held, make the owner of a biased pool take the lock from now on*/
+static void _elr_bias_revoke(elr_mem_pool* pool)
 {
-	elr_mem_slice *pslice = NULL;
-	elr_mem_pool  *pool = NULL;
+    if (pool->bias_revoked == 1)
+        return;
 
-	if ((pslice = _elr_slice_from_pool(&g_mem_pool)) == NULL)
+    __atomic_store_n(&pool->bias_revoked, 1, __ATOMIC_RELAXED);
+#if defined(__linux__) && defined(__NR_membarrier)
+    if (g_bias_membarrier == 1)
+        syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+    else
+#endif
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    /* the owner may be in the middle of an unlocked operation. */
+    while (__atomic_load_n(&pool->bias_busy, __ATOMIC_ACQUIRE) != 0)
+        sched_yield();
+}
+
+/*Enter a pool for modification, the return value must be passed to _elr_pool_unlock*/
+static inline int _elr_pool_lock(elr_mem_pool* pool)
+{
+    if (pool->sync == ELR_SYNC_NONE)
+        return ELR_SYNC_NONE;
+
+    if (pool->sync == ELR_SYNC_BIASED && _elr_bias_enter(pool))
+        return ELR_SYNC_BIASED;
+
+    _elr_lock_acquire(&pool->pool_mutex);
+    if (pool->sync == ELR_SYNC_BIASED)
+        _elr_bias_revoke(pool);
+
+    return ELR_SYNC_LOCK;
+}
+
+static inline void _elr_pool_unlock(elr_mem_pool* pool, int entered)
+{
+    if (entered == ELR_SYNC_LOCK)
+        _elr_lock_release(&pool->pool_mutex);
+    else if (entered == ELR_SYNC_BIASED)
+        __atomic_store_n(&pool->bias_busy, 0, __ATOMIC_RELEASE);
+}
+
+/*Keep a node released by a destroyed pool for reuse, returns 0 if the cache is full and the caller must free it*/
+static int _elr_node_cache_put(elr_mem_node* node)
+{
+    int    slot = -1;
+    int    i = 0;
+
+    _elr_lock_acquire(&g_node_cache_lock);
+    if (g_node_cache_bytes + node->size <= ELR_NODE_CACHE_LIMIT)
+    {
+        for (i = 0; i < ELR_NODE_CACHE_CLASSES; i++)
+        {
+            if (g_node_cache[i].node_size == node->size)
+            {
+                slot = i;
+                break;
+            }
+            if (slot < 0 && g_node_cache[i].first == NULL)
+                slot = i;
+        }
+    }
+    if (slot >= 0)
+    {
+        g_node_cache[slot].node_size = node->size;
+        node->idle_since = __atomic_load_n(&g_reclaim_tick, __ATOMIC_RELAXED);
+        node->next = g_node_cache[slot].first;
+        g_node_cache[slot].first = node;
+        __atomic_store_n(&g_node_cache_bytes, g_node_cache_bytes + node->size, __ATOMIC_RELAXED);
+    }
+    _elr_lock_release(&g_node_cache_lock);
+
+    return slot >= 0;
+}
+
+/*Take a cached node of exactly size bytes, NULL if there is none*/
+static elr_mem_node* _elr_node_cache_get(size_t size)
+{
+    elr_mem_node  *node = NULL;
+    int            i = 0;
+
+    /* most allocations find the cache empty, they don`t take the lock. */
+    if (__atomic_load_n(&g_node_cache_bytes, __ATOMIC_RELAXED) == 0)
+        return NULL;
+
+    _elr_lock_acquire(&g_node_cache_lock);
+    for (i = 0; i < ELR_NODE_CACHE_CLASSES; i++)
+    {
+        if (g_node_cache[i].node_size == size && g_node_cache[i].first != NULL)
+        {
+            node = g_node_cache[i].first;
+            g_node_cache[i].first = node->next;
+            __atomic_store_n(&g_node_cache_bytes, g_node_cache_bytes - size, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    _elr_lock_release(&g_node_cache_lock);
+
+    return node;
+}
+
+/*Free the cached nodes kept for at least decay reclaimer ticks, returns the bytes freed*/
+static size_t _elr_node_cache_trim(unsigned long decay)
+{
+    elr_mem_node   *released = NULL;
+    elr_mem_node   *node = NULL;
+    elr_mem_node  **link = NULL;
+    unsigned long   tick = __atomic_load_n(&g_reclaim_tick, __ATOMIC_RELAXED);
+    size_t          bytes = 0;
+    int             i = 0;
+
+    _elr_lock_acquire(&g_node_cache_lock);
+    for (i = 0; i < ELR_NODE_CACHE_CLASSES; i++)
+    {
+        /* newest first, so everything after the first old node is old too. */
+        link = &g_node_cache[i].first;
+        while (*link != NULL && tick - (*link)->idle_since < decay)
+            link = &(*link)->next;
+        while ((node = *link) != NULL)
+        {
+            *link = node->next;
+            bytes += node->size;
+            node->next = released;
+            released = node;
+        }
+    }
+    __atomic_store_n(&g_node_cache_bytes, g_node_cache_bytes - bytes, __ATOMIC_RELAXED);
+    _elr_lock_release(&g_node_cache_lock);
+
+    while ((node = released) != NULL)
+    {
+        released = node->next;
+        free(node);
+    }
+
+    return bytes;
+}
+
+/*Append formatted text to a dump*/
+static void _elr_dump_printf(elr_dump_buf* buf, const char* fmt, ...)
+{
+    va_list  ap;
+    char    *data = NULL;
+    size_t   size = 0;
+    int      n = 0;
+
+    while (buf->failed == 0)
+    {
+        va_start(ap, fmt);
+        n = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            buf->failed = 1;
+        else if (buf->len + n < buf->size)
+        {
+            buf->len += n;
+            return;
+        }
+        else
+        {
+            size = buf->size == 0 ? 4096 : buf->size*2;
+            while (size <= buf->len + n)
+                size *= 2;
+            data = (char*)realloc(buf->data, size);
+            if (data == NULL)
+                buf->failed = 1;
+            buf->data = data != NULL ? data : buf->data;
+            buf->size = data != NULL ? size : buf->size;
+        }
+    }
+}
+
+/*Write out and empty a dump*/
+static void _elr_dump_flush(elr_dump_buf* buf, int fd)
+{
+    size_t   done = 0;
+    ssize_t  n = 0;
+
+    while (buf->failed == 0 && done < buf->len)
+    {
+        n = write(fd, buf->data + done, buf->len - done);
+        if (n < 0 && errno != EINTR)
+            buf->failed = 1;
+        else if (n > 0)
+            done += n;
+    }
+    buf->len = 0;
+}
+
+/*Whether calls are being recorded, the only cost of tracing while it is off*/
+static inline int _elr_tracing()
+{
+    return __atomic_load_n(&g_trace_on, __ATOMIC_RELAXED);
+}
+
+static unsigned long long _elr_trace_now()
+{
+    struct timespec  now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec*1000000000ULL + now.tv_nsec;
+}
+
+/*Write out and empty the records of a trace buffer, the caller holds the buffer*/
+static void _elr_trace_write(elr_trace_buffer* buf)
+{
+    const char  *data = (const char*)buf->records;
+    size_t       len = buf->count*sizeof(elr_mpl_trace_record);
+    size_t       done = 0;
+    ssize_t      n = 0;
+
+    pthread_mutex_lock(&g_trace_mtx);
+    while (g_trace_failed == 0 && done < len)
+    {
+        n = write(g_trace_fd, data + done, len - done);
+        if (n < 0 && errno != EINTR)
+            g_trace_failed = 1;
+        else if (n > 0)
+            done += n;
+    }
+    pthread_mutex_unlock(&g_trace_mtx);
+    buf->count = 0;
+}
+
+/*Write out the records of a finished thread and free its buffer for the next thread*/
+static void _elr_trace_thread_exit(void* arg)
+{
+    elr_trace_buffer  *buf = (elr_trace_buffer*)arg;
+
+    _elr_lock_acquire(&buf->lock);
+    if (buf->count > 0)
+        _elr_trace_write(buf);
+    _elr_lock_release(&buf->lock);
+    __atomic_store_n(&buf->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void _elr_trace_key_create()
+{
+    pthread_key_create(&g_trace_key, _elr_trace_thread_exit);
+}
+
+/*Get the trace buffer of the calling thread, NULL if none could be allocated*/
+static elr_trace_buffer* _elr_trace_self()
+{
+    elr_trace_buffer  *buf = g_trace_self;
+    int                expect = 0;
+
+    if (buf != NULL)
+        return buf;
+
+    pthread_once(&g_trace_once, _elr_trace_key_create);
+    for (buf = __atomic_load_n(&g_trace_buffers, __ATOMIC_ACQUIRE); buf != NULL; buf = buf->next)
+    {
+        expect = 0;
+        if (__atomic_load_n(&buf->in_use, __ATOMIC_RELAXED) == 0
+            && __atomic_compare_exchange_n(&buf->in_use, &expect, 1, 0,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (buf == NULL)
+    {
+        buf = (elr_trace_buffer*)calloc(1, sizeof(elr_trace_buffer));
+        if (buf == NULL)
+            return NULL;
+        _elr_lock_init(&buf->lock, 0);
+        buf->in_use = 1;
+        buf->thread = __atomic_fetch_add(&g_trace_threads, 1, __ATOMIC_RELAXED);
+        buf->next = __atomic_load_n(&g_trace_buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&g_trace_buffers, &buf->next, buf, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    pthread_setspecific(g_trace_key, buf);
+    g_trace_self = buf;
+    return buf;
+}
+
+/*Record a call in the trace buffer of the calling thread*/
+static void _elr_trace(int op, const void* pool, const void* object, size_t size, int flags)
+{
+    elr_trace_buffer      *buf = _elr_trace_self();
+    elr_mpl_trace_record  *rec = NULL;
+
+    if (buf == NULL)
+        return;
+
+    /* checked again under the buffer lock, a record made after elr_mpl_trace_stop collected the buffer is dropped. */
+    _elr_lock_acquire(&buf->lock);
+    if (__atomic_load_n(&g_trace_on, __ATOMIC_RELAXED) != 0)
+    {
+        rec = &buf->records[buf->count++];
+        rec->time = _elr_trace_now() - g_trace_start;
+        rec->object = (unsigned long long)(size_t)object;
+        rec->pool = (unsigned long long)(size_t)pool;
+        rec->size = (unsigned int)size;
+        rec->thread = buf->thread;
+        rec->flags = (unsigned short)flags;
+        rec->op = (unsigned char)op;
+        memset(rec->reserved, 0, sizeof(rec->reserved));
+        if (buf->count == ELR_TRACE_RECORDS)
+            _elr_trace_write(buf);
+    }
+    _elr_lock_release(&buf->lock);
+}
+
+/*Record the creation of a multi-size pool, then the object size of each of its classes*/
+static void _elr_trace_create_multi(elr_mem_pool* pool, elr_mem_pool* parent, int flags)
+{
+    int  i = 0;
+
+    _elr_trace(ELR_MPL_TRACE_CREATE_MULTI, pool, parent, pool->multi_count, flags);
+    for (i = 0; i < pool->multi_count; i++)
+        _elr_trace(ELR_MPL_TRACE_CLASS, pool, NULL, pool->multi[i]->object_size, 0);
+}
+
+/*Wake up at most count threads waiting in elr_mpl_alloc_wait, called after memory blocks were given back*/
+static void _elr_wake_waiters(elr_mem_pool* pool, int count)
+{
+    /* pairs with the waiter counting itself before it tries, it sees the block or gets woken. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->waiters, __ATOMIC_RELAXED) == 0)
+        return;
+
+    __atomic_fetch_add(&pool->free_seq, 1, __ATOMIC_RELEASE);
+    _elr_futex_wake(&pool->free_seq, count, 0);
+}
+
+static long elr_atomic_inc( long* p )
+{
+    if ( p != NULL )
+    {
+        pthread_mutex_lock( &g_mpl_refs_mtx );
+        *p += 1;
+        pthread_mutex_unlock( &g_mpl_refs_mtx);
+        return *p;
+    }
+    
+    return 0;
+}
+
+static long elr_atomic_dec( long* p )
+{
+    if ( p != NULL )
+    {
+        pthread_mutex_lock( &g_mpl_refs_mtx );
+        if ( *p > 0 ) *p -= 1;
+        pthread_mutex_unlock( &g_mpl_refs_mtx);
+        return *p;
+    }
+    
+    return -1;
+}
+
+/*Spread the slices of the pool`s nodes over up to ELR_MAX_COLORS cache line offsets, paid from the slack the page rounding of node_size and its chunk header leaves*/
+static void _elr_color_setup(elr_mem_pool* pool, int flags)
+{
+    size_t  slack = ELR_ALIGN(pool->node_size + ELR_MMAP_CHUNK_HEADER, ELR_PAGE_SIZE)
+        - pool->node_size - ELR_MMAP_CHUNK_HEADER;
+
+    /* malloc does not round smaller nodes to pages, there the colors cost memory and are asked for. */
+    if (pool->node_size < ELR_MMAP_THRESHOLD && (flags & ELR_MPL_COLORED) == 0)
+        slack = 0;
+    /* nodes at the same offsets put the same field of every node in the same cache sets. */
+    pool->color_count = slack / ELR_CACHE_LINE + 1;
+    if (pool->color_count > ELR_MAX_COLORS)
+        pool->color_count = ELR_MAX_COLORS;
+    pool->node_size += (pool->color_count - 1) * ELR_CACHE_LINE;
+    pool->next_color = 0;
+}
+
+/*** Initialize the memory pool and create a global memory pool internally.
+** This method can be called repeatedly.
+** If the memory pool module has already been initialized, just increment the reference count and return.
+*/
+ELR_MPL_API int elr_mpl_init()
+{
+	int obj_size_count = 13;
+	size_t obj_size[13] = { 64, 98, 128, 192, 256, 384, 512, 768, 1024, 1280, 1536, 1792, 2048 };
+    long refs = elr_atomic_inc(&g_mpl_refs);
+    if(refs == 1)
+    {
+        g_mem_pool.parent = NULL;
+        g_mem_pool.first_child = NULL;
+        g_mem_pool.prev = NULL;
+        g_mem_pool.next = NULL;
+		g_mem_pool.multi = NULL;
+		g_mem_pool.multi_count = 0;
+        g_mem_pool.size_histogram = NULL;
+        g_mem_pool.refined_class = NULL;
+        g_mem_pool.object_size = sizeof(elr_mem_pool);
+        /* pool descriptors start a cache line, so the hot and cold parts of elr_mem_pool stay apart. */
+        g_mem_pool.slice_size = ELR_ALIGN(ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int))
+            + sizeof(elr_mem_pool), ELR_CACHE_LINE);
+        g_mem_pool.slice_count = ELR_MAX_SLICE_COUNT;
+        g_mem_pool.node_size = g_mem_pool.slice_size*g_mem_pool.slice_count 
+            + ELR_ALIGN(sizeof(elr_mem_node),sizeof(int)) + ELR_CACHE_LINE;
+        _elr_color_setup(&g_mem_pool, 0);
+        g_mem_pool.first_node = NULL;
+        g_mem_pool.newly_alloc_node = NULL;
+        g_mem_pool.fresh_node = NULL;
+        g_mem_pool.spare_node = NULL;
+        g_mem_pool.reclaim_cursor = NULL;
+        g_mem_pool.buffer_avail = NULL;
+        g_mem_pool.buffer_end = NULL;
+        g_mem_pool.first_free_slice = NULL;
+        memset(g_mem_pool.avail_bucket, 0, sizeof(g_mem_pool.avail_bucket));
+        g_mem_pool.node_table = NULL;
+        g_mem_pool.node_table_size = 0;
+        g_mem_pool.node_table_count = 1;
+        g_mem_pool.node_table_hint = 1;
+        g_mem_pool.node_table_tag = NULL;
+        g_mem_pool.on_slice_alloc = NULL;
+        g_mem_pool.on_slice_free = NULL;
+        g_mem_pool.obj_ctor = NULL;
+        g_mem_pool.obj_dtor = NULL;
+        g_mem_pool.obj_ctx = NULL;
+        g_mem_pool.first_occupied_slice = NULL;
+        g_mem_pool.slice_tag = 0;
+		g_mem_pool.flags = ELR_MPL_SYNC | ELR_MPL_ADAPTIVE_LOCK | ELR_MPL_CACHELINE;
+		g_mem_pool.sync = ELR_SYNC_LOCK;
+        _elr_lock_init(&g_mem_pool.pool_mutex, 1);
+        g_mem_pool.using_count = 0;
+        g_mem_pool.capacity = 0;
+        g_mem_pool.waiters = 0;
+        g_mem_pool.free_seq = 0;
+        g_mem_pool.retired_count = 0;
+        g_mem_pool.limit = 0;
+        g_mem_pool.charged = 0;
+        g_mem_pool.on_limit = NULL;
+        g_mem_pool.limit_ctx = NULL;
+        g_mem_pool.bias_owner = NULL;
+        g_mem_pool.bias_busy = 0;
+        g_mem_pool.bias_revoked = 0;
+		g_multi_mem_pool = elr_mpl_create_multi_ex(NULL, obj_size_count, obj_size, NULL, NULL,
+			ELR_MPL_SYNC | ELR_MPL_ADAPTIVE_LOCK);
+		if (g_multi_mem_pool.pool == NULL)
+		{
+			elr_atomic_dec(&g_mpl_refs);
+			return 0;
+		}
+    }
+
+    return 1;
+}
+
+/*
+** Create a memory pool and specify the maximum allocation unit size.
+** The first parameter represents the parent memory pool. If it is NULL, it means that the parent memory pool of the created memory pool is the global memory pool.
+*/
+ELR_MPL_API elr_mpl_t elr_mpl_create(elr_mpl_ht fpool,
+                                  	 size_t obj_size,
+                                  	 elr_mpl_callback on_alloc,
+                                  	 elr_mpl_callback on_free)
+{
+	elr_mpl_t      mpl = ELR_MPL_INITIALIZER;
+	elr_mem_pool  *pool = NULL;
+
+	assert(fpool == NULL || elr_mpl_avail(fpool) != 0);
+
+    elr_mem_pool* tpl = NULL;
+    if ( fpool != NULL )
+        tpl = (elr_mem_pool*)fpool->pool;
+
+	pool = _elr_mpl_create( tpl, obj_size, on_alloc, on_free, 0);
+	if (pool != NULL)
+	{
+		mpl.pool = pool;
+		mpl.tag = pool->slice_tag;
+		if (_elr_tracing())
+			_elr_trace(ELR_MPL_TRACE_CREATE, pool, tpl, obj_size, 0);
+    }
+
+	return mpl;
+}
+
+/*
+** Create a memory pool.
+** The first parameter represents the parent memory pool. If it is NULL, it means that the parent memory pool of the created memory pool is the global memory pool.
+** The second parameter represents the allocation unit size.
+** The third parameter provides a pointer to a function that will be executed when the memory is freed.
+*/
+ELR_MPL_API elr_mpl_t elr_mpl_create_sync(elr_mpl_ht fpool,
+                                        size_t obj_size,
+                                        elr_mpl_callback on_alloc,
+                                        elr_mpl_callback on_free)
+{
+    elr_mpl_t      mpl = ELR_MPL_INITIALIZER;
+    elr_mem_pool  *pool = NULL;
+
+#ifdef DEBUG
+    assert(fpool==NULL || elr_mpl_avail(fpool)!=0);
+#endif
+
+    elr_mem_pool* tpl = NULL;
+    if ( fpool != NULL )
+        tpl = (elr_mem_pool*)fpool->pool;
+
+	pool = _elr_mpl_create( tpl, obj_size, on_alloc, on_free, ELR_MPL_SYNC);
+	if (pool != NULL)
+	{
+		mpl.pool = pool;
+		mpl.tag = pool->slice_tag;
+		if (_elr_tracing())
+			_elr_trace(ELR_MPL_TRACE_CREATE, pool, tpl, obj_size, ELR_MPL_SYNC);
+	}
+
+        return mpl;
+}
+
+/*
+** Create a memory pool with the ELR_MPL_* creation flags.
+*/
+ELR_MPL_API elr_mpl_t elr_mpl_create_ex(elr_mpl_ht fpool,
+                                      size_t obj_size,
+                                      elr_mpl_callback on_alloc,
+                                      elr_mpl_callback on_free,
+                                      int flags)
+{
+    elr_mpl_t      mpl = ELR_MPL_INITIALIZER;
+    elr_mem_pool  *pool = NULL;
+
+	assert(fpool == NULL || elr_mpl_avail(fpool) != 0);
+
+    elr_mem_pool* tpl = NULL;
+    if ( fpool != NULL )
+        tpl = (elr_mem_pool*)fpool->pool;
+
+	pool = _elr_mpl_create( tpl, obj_size, on_alloc, on_free, flags);
+	if (pool != NULL)
+	{
+		mpl.pool = pool;
+		mpl.tag = pool->slice_tag;
+		if (_elr_tracing())
+			_elr_trace(ELR_MPL_TRACE_CREATE, pool, tpl, obj_size, flags);
+	}
+
+    return mpl;
+}
+
+/*Create a memory pool and specify the allocation unit size, flags are the ELR_MPL_SYNC* creation flags. */
+elr_mem_pool* _elr_mpl_create(elr_mem_pool* fpool,
+	size_t obj_size,
+	elr_mpl_callback on_alloc,
+	elr_mpl_callback on_free,
+	int flags)
+{
+	elr_mem_slice *pslice = NULL;
+	elr_mem_pool  *pool = NULL;
+	int            entered = 0;
+
+	if ((pslice = _elr_slice_from_pool(&g_mem_pool)) == NULL)
+		return NULL;
+    
+    pool = (elr_mem_pool*)((char*)pslice
+        + ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int)));
+    if (flags & ELR_MPL_BIASED)
+    {
+        flags |= ELR_MPL_SYNC;
+        pool->sync = ELR_SYNC_BIASED;
+        _elr_bias_setup();
+    }
+    else
+    {
+        pool->sync = (flags & ELR_MPL_SYNC) ? ELR_SYNC_LOCK : ELR_SYNC_NONE;
+    }
+    _elr_lock_init(&pool->pool_mutex, (flags & ELR_MPL_ADAPTIVE_LOCK) ? 1 : 0);
+    pool->using_count = 0;
+    pool->capacity = 0;
+    pool->waiters = 0;
+    pool->free_seq = 0;
+    pool->retired_count = 0;
+    pool->limit = 0;
+    pool->charged = 0;
+    pool->on_limit = NULL;
+    pool->limit_ctx = NULL;
+    pool->bias_owner = &g_thread_token;
+    pool->bias_busy = 0;
+    pool->bias_revoked = 0;
+    pool->flags = flags;
+	pool->slice_tag = pslice->tag;
+	pool->first_child = NULL;
+	pool->parent = fpool == NULL ? &g_mem_pool : fpool;
+	pool->multi = NULL;
+	pool->multi_count = 0;
+    pool->size_histogram = NULL;
+    pool->refined_class = NULL;
+    pool->object_size = obj_size;
+    pool->slice_size = ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int))
+        + ELR_ALIGN(obj_size,sizeof(int));
+    if (flags & ELR_MPL_CACHELINE)
+        pool->slice_size = ELR_ALIGN(pool->slice_size, ELR_CACHE_LINE);
+    if(pool->slice_size < ELR_MAX_SLICE_SIZE)
+        pool->slice_count = ELR_MAX_SLICE_COUNT 
+        - pool->slice_size*(ELR_MAX_SLICE_COUNT-1)/ELR_MAX_SLICE_SIZE;
+    else
+        pool->slice_count = 1;
+    pool->node_size = pool->slice_size*pool->slice_count 
+        + ELR_ALIGN(sizeof(elr_mem_node),sizeof(int));
+    /* room to move the first memory block of a node onto a cache line. */
+    if (flags & ELR_MPL_CACHELINE)
+        pool->node_size += ELR_CACHE_LINE;
+    _elr_color_setup(pool, flags);
+    pool->first_node = NULL;
+    pool->newly_alloc_node = NULL;
+    pool->fresh_node = NULL;
+    pool->spare_node = NULL;
+    pool->reclaim_cursor = NULL;
+    pool->buffer_avail = NULL;
+    pool->buffer_end = NULL;
+    pool->first_free_slice = NULL;
+    memset(pool->avail_bucket, 0, sizeof(pool->avail_bucket));
+    pool->node_table = NULL;
+    pool->node_table_size = 0;
+    pool->node_table_count = 1;
+    pool->node_table_hint = 1;
+    pool->node_table_tag = NULL;
+    pool->on_slice_alloc = on_alloc;
+    pool->on_slice_free = on_free;
+    pool->obj_ctor = NULL;
+    pool->obj_dtor = NULL;
+    pool->obj_ctx = NULL;
+    pool->first_occupied_slice = NULL;
+    assert(g_in_limit_callback == 0);
+    _elr_lock_acquire(&g_tree_lock);
+    entered = _elr_pool_lock(pool->parent);
+    pool->prev = NULL;
+    pool->next = pool->parent->first_child;
+    if(pool->next != NULL)
+        pool->next->prev = pool;
+    pool->parent->first_child = pool;
+	_elr_pool_unlock(pool->parent, entered);
+    _elr_lock_release(&g_tree_lock);
+    return pool;
+}
+
+/*Create a memory pool from which you can apply for memory blocks of different sizes, flags are the ELR_MPL_SYNC* creation flags. */
+elr_mem_pool* _elr_mpl_create_multi(elr_mem_pool* fpool,
+	int obj_size_count,
+	size_t* obj_size,
+	elr_mpl_callback on_alloc,
+	elr_mpl_callback on_free,
+	int flags)
+{
+	elr_mem_pool  *first_pool = NULL;
+	elr_mem_pool  *pool = NULL;
+	elr_mem_pool **multi_pool = NULL;
+
+	int i = 0;
+	int j = 0;
+	int valid = 1;
+
+	multi_pool = (elr_mem_pool**)malloc(obj_size_count * sizeof(elr_mem_pool*));
+	if (multi_pool == NULL)
 		return NULL;
-    
-    pool = (elr_mem_pool*)((char*)pslice
-        + ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int)));
-#ifdef USE_THREADLOCK
-    pool->sync = sync;
-	if (sync == 1 && pthread_mutex_init(&pool->pool_mutex, NULL) != 0)
+
+	for (i = 0; i < obj_size_count; i++)
+	{
+		/* every size class owns its lock, so different classes never serialize each other. */
+		pool = _elr_mpl_create(fpool, obj_size[i], on_alloc, on_free, flags);
+		if (pool == NULL)
+		{
+			valid = 0;
+			break;
+		}
+		multi_pool[i] = (elr_mem_pool*)pool;
+		if (i == 0)
+		{
+			first_pool = pool;
+			pool->multi = multi_pool;
+			pool->multi_count = obj_size_count;
+		}
+	}
+
+	if (valid == 1)
+		_elr_lock_init(&first_pool->multi_mutex, (flags & ELR_MPL_ADAPTIVE_LOCK) ? 1 : 0);
+
+	if (valid == 1 && (flags & (ELR_MPL_SIZE_HISTOGRAM | ELR_MPL_REFINE_CLASSES)))
+	{
+		first_pool->size_histogram = (unsigned int*)calloc(ELR_HISTOGRAM_BINS, sizeof(unsigned int));
+		if (first_pool->size_histogram == NULL)
+			valid = 0;
+	}
+
+	if (valid == 1 && (flags & ELR_MPL_REFINE_CLASSES))
+	{
+		first_pool->refined_class = (elr_mem_pool**)calloc(ELR_HISTOGRAM_BINS, sizeof(elr_mem_pool*));
+		if (first_pool->refined_class == NULL)
+			valid = 0;
+	}
+
+	if (valid == 1)
+	{
+        //g_multi_mem_pool is also applied through this method,
+        //But this method needs to rely on g_multi_mem_pool;
+        //So if g_multi_mem_pool has not been applied for, let it be valid first.
+		if (g_multi_mem_pool.pool == NULL)
+		{
+			g_multi_mem_pool.pool = first_pool;
+			g_multi_mem_pool.tag = first_pool->slice_tag;
+		}
+		multi_pool[0]->multi = (elr_mem_pool**)_elr_mpl_alloc_multi((elr_mem_pool*)g_multi_mem_pool.pool,
+			obj_size_count * sizeof(elr_mem_pool*));
+		if (multi_pool[0]->multi != NULL)
+		{
+			memcpy(multi_pool[0]->multi, multi_pool, obj_size_count * sizeof(elr_mem_pool*));
+		}
+		else
+		{
+			valid = 0;
+		}
+	}
+
+	if (valid == 0)
+	{
+		if (first_pool != NULL)
+		{
+			/* multi may still point to the temporary array, destory must not free it. */
+			first_pool->multi = NULL;
+			first_pool->multi_count = 0;
+		}
+		first_pool = NULL;
+		for (j = 0; j < i; j++)
+		{
+			_elr_mpl_destory(multi_pool[j], 0, 0);
+		}
+	}
+
+	free(multi_pool);
+
+	return first_pool;
+}
+
+ELR_MPL_API elr_mpl_t elr_mpl_create_multi(elr_mpl_ht fpool,
+	int obj_size_count,
+	size_t* obj_size,
+	elr_mpl_callback on_alloc,
+	elr_mpl_callback on_free)
+{
+	elr_mpl_t      mpl = ELR_MPL_INITIALIZER;
+	elr_mem_pool  *pool = NULL;
+
+	assert(fpool == NULL || elr_mpl_avail(fpool) != 0);
+
+    elr_mem_pool* tpl = NULL;
+    if ( fpool != NULL )
+        tpl = (elr_mem_pool*)fpool->pool;
+
+	pool = _elr_mpl_create_multi( tpl, obj_size_count, obj_size, on_alloc, on_free, 0);
+	if (pool != NULL)
+	{
+		mpl.pool = pool;
+		mpl.tag = pool->slice_tag;
+		if (_elr_tracing())
+			_elr_trace_create_multi(pool, tpl, 0);
+	}
+
+	return mpl;
+}
+
+ELR_MPL_API elr_mpl_t elr_mpl_create_multi_sync(elr_mpl_ht fpool,
+	int obj_size_count,
+	size_t* obj_size,
+	elr_mpl_callback on_alloc,
+	elr_mpl_callback on_free)
+{
+	elr_mpl_t      mpl = ELR_MPL_INITIALIZER;
+	elr_mem_pool  *pool = NULL;
+
+	assert(fpool == NULL || elr_mpl_avail(fpool) != 0);
+
+    elr_mem_pool* tpl = NULL;
+    if ( fpool != NULL )
+        tpl = (elr_mem_pool*)fpool->pool;
+	
+	pool = _elr_mpl_create_multi( tpl, obj_size_count, obj_size, on_alloc, on_free, ELR_MPL_SYNC);
+	if (pool != NULL)
+	{
+      mpl.pool = pool;
+      mpl.tag = pool->slice_tag;
+      if (_elr_tracing())
+          _elr_trace_create_multi(pool, tpl, ELR_MPL_SYNC);
+	}
+
+    return mpl;
+}
+
+ELR_MPL_API elr_mpl_t elr_mpl_create_multi_ex(elr_mpl_ht fpool,
+	int obj_size_count,
+	size_t* obj_size,
+	elr_mpl_callback on_alloc,
+	elr_mpl_callback on_free,
+	int flags)
+{
+	elr_mpl_t      mpl = ELR_MPL_INITIALIZER;
+	elr_mem_pool  *pool = NULL;
+
+	assert(fpool == NULL || elr_mpl_avail(fpool) != 0);
+
+    elr_mem_pool* tpl = NULL;
+    if ( fpool != NULL )
+        tpl = (elr_mem_pool*)fpool->pool;
+
+	pool = _elr_mpl_create_multi( tpl, obj_size_count, obj_size, on_alloc, on_free, flags);
+	if (pool != NULL)
+	{
+		mpl.pool = pool;
+		mpl.tag = pool->slice_tag;
+		if (_elr_tracing())
+			_elr_trace_create_multi(pool, tpl, flags);
+	}
+
+	return mpl;
+}
+
+/*** To determine whether the memory pool is valid, it is generally called immediately after the creation is completed.
+** return 0 for invalid
+** pool cannot be NULL
+*/
+ELR_MPL_API int  elr_mpl_avail(elr_mpl_ht hpool)
+{
+    int              ret = 1;
+    elr_mem_slice   *pslice = NULL;
+	elr_mem_pool    *pool = NULL;
+
+	assert(hpool != NULL);
+
+    if(hpool->pool == NULL)
+    {
+        ret = 0;
+    }
+    else
+    {
+		pool = (elr_mem_pool*)hpool->pool;
+		pslice = (elr_mem_slice*)((char*)pool
+            - ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int)));
+		if (hpool->tag != pool->slice_tag 
+			|| hpool->tag != pslice->tag)
+            ret = 0;
+    }
+
+    return ret;
+}
+
+int _elr_mpl_avail(elr_mem_pool* pool)
+{
+	elr_mem_slice* pslice = NULL;
+	assert(pool != NULL);
+
+	pslice = (elr_mem_slice*)((char*)pool
+		- ELR_ALIGN(sizeof(elr_mem_slice), sizeof(int)));
+
+	if (pool->slice_tag != pslice->tag)
+		return 0;
+
+	return 1;
+}
+
+/*
+** Allocate up to count memory blocks from the memory pool with a single lock hold, returns how many were taken.
+*/
+ELR_MPL_API size_t elr_mpl_alloc_batch(elr_mpl_ht hpool, void** mem, size_t count)
+{
+    elr_mem_slice *pslice = NULL;
+    elr_mem_pool  *pool = NULL;
+    size_t         taken = 0;
+    size_t         i = 0;
+    int            entered = 0;
+
+    if ( hpool == NULL || mem == NULL )
+        return 0;
+
+#ifdef DEBUG
+    assert(elr_mpl_avail(hpool)!=0);
+#endif
+
+    pool = (elr_mem_pool*)hpool->pool;
+    entered = _elr_pool_lock(pool);
+    while (taken < count && (pslice = _elr_slice_take(pool)) != NULL)
+    {
+        mem[taken++] = (char*)pslice + ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int));
+    }
+    _elr_pool_unlock(pool, entered);
+
+    if (pool->on_slice_alloc != NULL)
+    {
+        for (i = 0; i < taken; i++)
+            pool->on_slice_alloc(mem[i]);
+    }
+    if (_elr_tracing())
+    {
+        for (i = 0; i < taken; i++)
+            _elr_trace(ELR_MPL_TRACE_ALLOC, pool, mem[i], pool->object_size, 0);
+    }
+
+    return taken;
+}
+
+/*
+** Return count memory blocks to their memory pools, the lock of a pool is held once for a run of its blocks.
+*/
+ELR_MPL_API void elr_mpl_free_batch(void** mem, size_t count)
+{
+    elr_mem_slice *slice = NULL;
+    elr_mem_pool  *pool = NULL;
+    elr_mem_pool  *held = NULL;
+    size_t         given = 0;
+    size_t         i = 0;
+    int            entered = 0;
+
+    /* taken before any block is given back, as elr_mpl_free does. */
+    if (_elr_tracing())
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (mem[i] != NULL)
+                _elr_trace(ELR_MPL_TRACE_FREE, ((elr_mem_slice*)((char*)mem[i]
+                    - ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int))))->node->owner, mem[i], 0, 0);
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (mem[i] == NULL)
+            continue;
+
+        slice = (elr_mem_slice*)((char*)mem[i]
+            - ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int)));
+        pool = slice->node->owner;
+        if (pool != held)
+        {
+            if (held != NULL)
+            {
+                _elr_pool_unlock(held, entered);
+                if (__atomic_load_n(&held->capacity, __ATOMIC_RELAXED) != 0)
+                    _elr_wake_waiters(held, (int)given);
+            }
+            entered = _elr_pool_lock(pool);
+            held = pool;
+            given = 0;
+        }
+        _elr_slice_give(pool, slice, mem[i]);
+        given++;
+    }
+
+    if (held != NULL)
+    {
+        _elr_pool_unlock(held, entered);
+        if (__atomic_load_n(&held->capacity, __ATOMIC_RELAXED) != 0)
+            _elr_wake_waiters(held, (int)given);
+    }
+}
+
+/*
+** Limit the number of memory blocks of a memory pool in use at a time, 0 removes the limit.
+*/
+ELR_MPL_API void elr_mpl_set_capacity(elr_mpl_ht hpool, size_t count)
+{
+    elr_mem_pool  *pool = NULL;
+    int            entered = 0;
+
+    assert(hpool != NULL && hpool->pool != NULL);
+
+    pool = (elr_mem_pool*)hpool->pool;
+    entered = _elr_pool_lock(pool);
+    __atomic_store_n(&pool->capacity, count, __ATOMIC_RELAXED);
+    _elr_pool_unlock(pool, entered);
+
+    /* a raised capacity may let waiters through. */
+    _elr_wake_waiters(pool, 0x7fffffff);
+}
+
+/*
+** Allocate memory from a memory pool with a capacity, waiting up to timeout_ns for a memory block to be given back.
+*/
+ELR_MPL_API void* elr_mpl_alloc_wait(elr_mpl_ht hpool, long long timeout_ns)
+{
+    elr_mem_pool    *pool = NULL;
+    void            *mem = NULL;
+    struct timespec  deadline;
+    struct timespec  now;
+    struct timespec  rel;
+    long long        left = 0;
+    int              seq = 0;
+
+    mem = elr_mpl_alloc(hpool);
+    if (mem != NULL || timeout_ns == 0)
+        return mem;
+
+    pool = (elr_mem_pool*)hpool->pool;
+    if (__atomic_load_n(&pool->capacity, __ATOMIC_RELAXED) == 0)
+        return NULL;
+
+    if (timeout_ns > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ns / 1000000000;
+        deadline.tv_nsec += timeout_ns % 1000000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    /* counted before trying, so a free either leaves a block to take or sees the waiter. */
+    __atomic_fetch_add(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+    for (;;)
     {
-        pool->sync = 0;
-        elr_mpl_free(pool);
-    	return NULL;
+        seq = __atomic_load_n(&pool->free_seq, __ATOMIC_ACQUIRE);
+        mem = elr_mpl_alloc(hpool);
+        if (mem != NULL)
+            break;
+
+        if (timeout_ns > 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left = (long long)(deadline.tv_sec - now.tv_sec) * 1000000000
+                + (deadline.tv_nsec - now.tv_nsec);
+            if (left <= 0)
+                break;
+            rel.tv_sec = left / 1000000000;
+            rel.tv_nsec = left % 1000000000;
+            _elr_futex_wait(&pool->free_seq, seq, 0, &rel);
+        }
+        else
+        {
+            _elr_futex_wait(&pool->free_seq, seq, 0, NULL);
+        }
     }
+    __atomic_fetch_sub(&pool->waiters, 1, __ATOMIC_RELAXED);
+
+    return mem;
+}
+
+/*
+** Allocate memory from the memory pool。
+*/
+ELR_MPL_API void*  elr_mpl_alloc(elr_mpl_ht hpool)
+{
+    elr_mem_pool  *pool = NULL;
+    void          *mem = NULL;
+    
+    if ( hpool == NULL )
+        return NULL;
+
+#ifdef DEBUG
+    assert(hpool != NULL  && elr_mpl_avail(hpool)!=0);
 #endif
-	pool->slice_tag = pslice->tag;
-	pool->first_child = NULL;
-	pool->parent = fpool == NULL ? &g_mem_pool : fpool;
-	pool->multi = NULL;
-	pool->multi_count = 0;
-    pool->object_size = obj_size;
-    pool->slice_size = ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int))
-        + ELR_ALIGN(obj_size,sizeof(int));
-    if(pool->slice_size < ELR_MAX_SLICE_SIZE)
-        pool->slice_count = ELR_MAX_SLICE_COUNT 
-        - pool->slice_size*(ELR_MAX_SLICE_COUNT-1)/ELR_MAX_SLICE_SIZE;
+
+    pool = (elr_mem_pool*)hpool->pool;
+    mem = _elr_mpl_alloc(pool);
+    if (mem != NULL && _elr_tracing())
+        _elr_trace(ELR_MPL_TRACE_ALLOC, pool, mem, pool->object_size, 0);
+
+    return mem;
+}
+
+void* _elr_mpl_alloc(elr_mem_pool* pool)
+{
+    elr_mem_slice *pslice = NULL;
+
+    pslice = _elr_slice_from_pool(pool);
+
+    if(pslice == NULL)
+        return NULL;
     else
-        pool->slice_count = 1;
-    pool->node_size = pool->slice_size*pool->slice_count 
-        + ELR_ALIGN(sizeof(elr_mem_node),sizeof(int));
-    pool->first_node = NULL;
-    pool->newly_alloc_node = NULL;
-    pool->first_free_slice = NULL;
-    pool->on_slice_alloc = on_alloc;
-    pool->on_slice_free = on_free;
-    pool->first_occupied_slice = NULL;
-#ifdef USE_THREADLOCK
-    if(pool->parent->sync == 1)
-        pthread_mutex_lock(&pool->parent->pool_mutex);
-#endif
-    pool->prev = NULL;
-    pool->next = pool->parent->first_child;
-    if(pool->next != NULL)
-        pool->next->prev = pool;
-    pool->parent->first_child = pool;
-#ifdef USE_THREADLOCK
-	if (pool->parent->sync == 1)
-		pthread_mutex_unlock(&pool->parent->pool_mutex);
+    {
+        char *mem = (char*)pslice 
+            + ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int));
+        if (pool->on_slice_alloc != NULL)
+            pool->on_slice_alloc(mem);
+
+        return mem;
+    }
+}
+
+ELR_MPL_API void * elr_mpl_alloc_multi(elr_mpl_ht hpool, size_t size)
+{
+	void*          mem = NULL;
+	elr_mem_pool  *pool = NULL;
+
+	assert(hpool == NULL || elr_mpl_avail(hpool) != 0);
+
+	if (hpool == NULL)
+		hpool = &g_multi_mem_pool;
+    
+	pool = (elr_mem_pool*)hpool->pool;
+	mem = _elr_mpl_alloc_multi(pool, size);
+	if (mem != NULL && _elr_tracing())
+		_elr_trace(ELR_MPL_TRACE_ALLOC_MULTI, pool, mem, size, 0);
+
+	return mem;
+}
+
+void* _elr_mpl_alloc_multi(elr_mem_pool* pool, size_t size)
+{
+	void*          mem = NULL;
+	elr_mem_pool  *parent_pool = NULL;
+	elr_mem_pool  *child_pool = NULL;
+	elr_mem_pool  *alloc_pool = NULL;
+	size_t         bin = 0;
+	unsigned int   seen = 0;
+	int i = 0;
+
+	assert(pool->multi != NULL);
+
+	parent_pool = pool->multi[pool->multi_count - 1];
+
+	if (pool->size_histogram != NULL && size <= ELR_HISTOGRAM_LIMIT)
+	{
+		bin = (size + ELR_HISTOGRAM_UNIT - 1) / ELR_HISTOGRAM_UNIT;
+		seen = __atomic_add_fetch(&pool->size_histogram[bin], 1, __ATOMIC_RELAXED);
+		if (pool->refined_class != NULL)
+			alloc_pool = __atomic_load_n(&pool->refined_class[bin], __ATOMIC_ACQUIRE);
+	}
+
+	/* the class table never changes after creation, scanning it needs no lock. */
+	for (i = 0; i < pool->multi_count && alloc_pool == NULL; i++)
+	{
+		if (pool->multi[i]->object_size >= size)
+		{
+			alloc_pool = pool->multi[i];
+			break;
+		}
+	}
+
+	if (alloc_pool == NULL)
+	{
+		/* over-range classes are children of the last class, guarded by their own lock. */
+		if (pool->sync != ELR_SYNC_NONE)
+			_elr_lock_acquire(&pool->multi_mutex);
+		child_pool = parent_pool->first_child;
+		while (child_pool != NULL)
+		{
+			if (child_pool->object_size >= size)
+			{
+				alloc_pool = child_pool;
+				break;
+			}
+			child_pool = child_pool->next;
+		}
+
+		if (alloc_pool == NULL)
+		{
+			size = ELR_OVERRANGE_UNIT_SIZE*((size + ELR_OVERRANGE_UNIT_SIZE - 1) / ELR_OVERRANGE_UNIT_SIZE);
+			alloc_pool = _elr_mpl_create(parent_pool, size,
+				parent_pool->on_slice_alloc, parent_pool->on_slice_free, pool->flags);
+			/* a biased class belongs to the owner of the multi pool, not to the creating thread. */
+			if (alloc_pool != NULL)
+				alloc_pool->bias_owner = pool->bias_owner;
+		}
+		if (pool->sync != ELR_SYNC_NONE)
+			_elr_lock_release(&pool->multi_mutex);
+	}
+
+	/* a size asked for often enough that wastes over 1/8 of its class gets a class of its own. */
+	if (alloc_pool != NULL && pool->refined_class != NULL && bin > 0
+		&& seen >= ELR_REFINE_THRESHOLD
+		&& alloc_pool->object_size - bin*ELR_HISTOGRAM_UNIT > alloc_pool->object_size / 8)
+	{
+		child_pool = _elr_multi_refine(pool, bin);
+		if (child_pool != NULL)
+			alloc_pool = child_pool;
+	}
+
+	/* the class pool takes its own lock, if any. */
+	if (alloc_pool != NULL)
+		mem = _elr_mpl_alloc(alloc_pool);
+	return mem;
+}
+
+/*
+** Create an object cache, objects are constructed once when carved and destructed when their node is released.
+*/
+ELR_MPL_API elr_mpl_t elr_mpl_create_cache(elr_mpl_ht fpool,
+                                         size_t obj_size,
+                                         elr_mpl_ctor ctor,
+                                         elr_mpl_ctor dtor,
+                                         void* ctx,
+                                         int flags)
+{
+	elr_mpl_t      mpl = ELR_MPL_INITIALIZER;
+	elr_mem_pool  *pool = NULL;
+
+	assert(fpool == NULL || elr_mpl_avail(fpool) != 0);
+
+    elr_mem_pool* tpl = NULL;
+    if ( fpool != NULL )
+        tpl = (elr_mem_pool*)fpool->pool;
+
+	pool = _elr_mpl_create( tpl, obj_size, NULL, NULL, flags);
+	if (pool != NULL)
+	{
+		/* nothing was carved yet, so no lock is needed to set them. */
+		pool->obj_ctor = ctor;
+		pool->obj_dtor = dtor;
+		pool->obj_ctx = ctx;
+		mpl.pool = pool;
+		mpl.tag = pool->slice_tag;
+		if (_elr_tracing())
+			_elr_trace(ELR_MPL_TRACE_CREATE, pool, tpl, obj_size, flags);
+	}
+
+	return mpl;
+}
+
+/*
+** Create a memory pool whose memory nodes and slices are all cut from a buffer given by the caller.
+*/
+ELR_MPL_API elr_mpl_t elr_mpl_create_from_buffer(elr_mpl_ht fpool,
+                                               size_t obj_size,
+                                               void* buf,
+                                               size_t len,
+                                               int flags)
+{
+	elr_mpl_t      mpl = ELR_MPL_INITIALIZER;
+	elr_mem_pool  *pool = NULL;
+	char          *start = NULL;
+	size_t         head = ELR_ALIGN(sizeof(elr_mem_node),sizeof(int));
+	size_t         count = 0;
+
+	assert(fpool == NULL || elr_mpl_avail(fpool) != 0);
+	assert(buf != NULL);
+
+    elr_mem_pool* tpl = NULL;
+    if ( fpool != NULL )
+        tpl = (elr_mem_pool*)fpool->pool;
+
+	/* the node table of handles grows with realloc, so buffer pools go without. */
+	pool = _elr_mpl_create( tpl, obj_size, NULL, NULL,
+		(flags & ~(ELR_MPL_HANDLES | ELR_MPL_SIZE_HISTOGRAM | ELR_MPL_REFINE_CLASSES)) | ELR_MPL_BUFFER_POOL);
+	if (pool == NULL)
+		return mpl;
+
+	if (flags & ELR_MPL_CACHELINE)
+		head += ELR_CACHE_LINE;
+
+	/* the whole buffer becomes a single node, so no slice is lost to node headers. */
+	start = (char*)ELR_ALIGN((size_t)buf, sizeof(void*));
+	if (len > (size_t)(start - (char*)buf) + head)
+		count = (len - (size_t)(start - (char*)buf) - head) / pool->slice_size;
+	if (count == 0)
+	{
+		_elr_mpl_destory(pool, 0, 1);
+		return mpl;
+	}
+
+	/* nothing was carved yet, so no lock is needed to set them. */
+	pool->slice_count = count;
+	pool->node_size = head + pool->slice_size*count;
+	pool->color_count = 1;
+	pool->buffer_avail = start;
+	pool->buffer_end = start + pool->node_size;
+	mpl.pool = pool;
+	mpl.tag = pool->slice_tag;
+	if (_elr_tracing())
+		_elr_trace(ELR_MPL_TRACE_CREATE, pool, tpl, obj_size, flags);
+
+	return mpl;
+}
+
+/*
+** Suggest a class table for a multi-size memory pool from the sizes requested so far.
+*/
+ELR_MPL_API int elr_mpl_suggest_classes(elr_mpl_ht hpool, int count, size_t* obj_size)
+{
+	elr_mem_pool        *pool = NULL;
+	size_t              *sizes = NULL;
+	unsigned long long  *counts = NULL;
+	unsigned long long  *prefix_count = NULL;
+	unsigned long long  *prefix_bytes = NULL;
+	unsigned long long  *waste = NULL;
+	int                 *cut = NULL;
+	unsigned long long   cost = 0;
+	size_t               bin = 0;
+	int                  n = 0;
+	int                  m = 0;
+	int                  k = 0;
+	int                  i = 0;
+	int                  j = 0;
+
+	assert(hpool != NULL && hpool->pool != NULL && obj_size != NULL);
+
+	pool = (elr_mem_pool*)hpool->pool;
+	if (pool->size_histogram == NULL || count <= 0)
+		return 0;
+
+	sizes = (size_t*)malloc(ELR_HISTOGRAM_BINS * sizeof(size_t));
+	counts = (unsigned long long*)malloc(ELR_HISTOGRAM_BINS * sizeof(unsigned long long));
+	if (sizes == NULL || counts == NULL)
+		goto done;
+
+	for (bin = 1; bin < ELR_HISTOGRAM_BINS; bin++)
+	{
+		cost = __atomic_load_n(&pool->size_histogram[bin], __ATOMIC_RELAXED);
+		if (cost != 0)
+		{
+			sizes[n] = bin * ELR_HISTOGRAM_UNIT;
+			counts[n] = cost;
+			n++;
+		}
+	}
+	if (n == 0)
+		goto done;
+	if (count > n)
+		count = n;
+
+	prefix_count = (unsigned long long*)malloc((n + 1) * sizeof(unsigned long long));
+	prefix_bytes = (unsigned long long*)malloc((n + 1) * sizeof(unsigned long long));
+	waste = (unsigned long long*)malloc((size_t)count * n * sizeof(unsigned long long));
+	cut = (int*)malloc((size_t)count * n * sizeof(int));
+	if (prefix_count == NULL || prefix_bytes == NULL || waste == NULL || cut == NULL)
+		goto done;
+
+	prefix_count[0] = 0;
+	prefix_bytes[0] = 0;
+	for (i = 0; i < n; i++)
+	{
+		prefix_count[i + 1] = prefix_count[i] + counts[i];
+		prefix_bytes[i + 1] = prefix_bytes[i] + counts[i] * sizes[i];
+	}
+
+	/* waste[k*n+j] is the least waste of bins 0..j served by up to k+1 classes, the largest being sizes[j].
+	** cut[k*n+j] is the first bin of that largest class, -1 if fewer classes do as well. */
+#define ELR_CLASS_WASTE(a, b) (sizes[b] * (prefix_count[(b) + 1] - prefix_count[a]) \
+		- (prefix_bytes[(b) + 1] - prefix_bytes[a]))
+	for (j = 0; j < n; j++)
+	{
+		waste[j] = ELR_CLASS_WASTE(0, j);
+		cut[j] = 0;
+	}
+	for (k = 1; k < count; k++)
+	{
+		for (j = 0; j < n; j++)
+		{
+			waste[k*n + j] = waste[(k - 1)*n + j];
+			cut[k*n + j] = -1;
+			for (i = k; i <= j; i++)
+			{
+				cost = waste[(k - 1)*n + i - 1] + ELR_CLASS_WASTE(i, j);
+				if (cost < waste[k*n + j])
+				{
+					waste[k*n + j] = cost;
+					cut[k*n + j] = i;
+				}
+			}
+		}
+	}
+#undef ELR_CLASS_WASTE
+
+	/* walk the cuts back from the largest size. */
+	k = count - 1;
+	j = n - 1;
+	while (j >= 0)
+	{
+		while (k > 0 && cut[k*n + j] == -1)
+			k--;
+		obj_size[m++] = sizes[j];
+		if (k == 0)
+			break;
+		j = cut[k*n + j] - 1;
+		k--;
+	}
+	for (i = 0; i < m / 2; i++)
+	{
+		bin = obj_size[i];
+		obj_size[i] = obj_size[m - 1 - i];
+		obj_size[m - 1 - i] = bin;
+	}
+
+done:
+	free(sizes);
+	free(counts);
+	free(prefix_count);
+	free(prefix_bytes);
+	free(waste);
+	free(cut);
+	return m;
+}
+
+/*
+** Create an arena pool, memory blocks of any size are cut from big nodes by bumping a pointer.
+*/
+ELR_MPL_API elr_mpl_t elr_mpl_create_arena(elr_mpl_ht fpool, size_t node_size, int flags)
+{
+	elr_mpl_t      mpl = ELR_MPL_INITIALIZER;
+	elr_mem_pool  *pool = NULL;
+
+	assert(fpool == NULL || elr_mpl_avail(fpool) != 0);
+
+    elr_mem_pool* tpl = NULL;
+    if ( fpool != NULL )
+        tpl = (elr_mem_pool*)fpool->pool;
+
+	pool = _elr_mpl_create( tpl, 0, NULL, NULL, flags | ELR_MPL_ARENA_POOL);
+	if (pool != NULL)
+	{
+		pool->node_size = node_size == 0 ? ELR_ARENA_NODE_SIZE : node_size;
+		if (pool->node_size < ELR_ALIGN(sizeof(elr_mem_node),ELR_ARENA_ALIGN) + ELR_ARENA_ALIGN)
+			pool->node_size = ELR_ALIGN(sizeof(elr_mem_node),ELR_ARENA_ALIGN) + ELR_ARENA_ALIGN;
+		pool->slice_count = 0;
+		pool->color_count = 1;
+		mpl.pool = pool;
+		mpl.tag = pool->slice_tag;
+		/* size 0 tells an arena, its blocks are not recorded but its children are. */
+		if (_elr_tracing())
+			_elr_trace(ELR_MPL_TRACE_CREATE, pool, tpl, 0, flags);
+	}
+
+	return mpl;
+}
+
+ELR_MPL_API void* elr_mpl_alloc_arena(elr_mpl_ht hpool, size_t size)
+{
+	void*          mem = NULL;
+	elr_mem_pool  *pool = NULL;
+	elr_mem_node  *node = NULL;
+	int            entered = 0;
+
+#ifdef DEBUG
+	assert(hpool != NULL && elr_mpl_avail(hpool) != 0);
 #endif
-    return pool;
+	pool = (elr_mem_pool*)hpool->pool;
+	assert(pool->flags & ELR_MPL_ARENA_POOL);
+
+	size = size == 0 ? ELR_ARENA_ALIGN : ELR_ALIGN(size, ELR_ARENA_ALIGN);
+
+	entered = _elr_pool_lock(pool);
+	node = pool->newly_alloc_node;
+	if (node == NULL || (size_t)((char*)node + node->size - node->first_avail) < size)
+		node = _elr_arena_grow(pool, size);
+
+	if (node != NULL)
+	{
+		mem = node->first_avail;
+		node->first_avail += size;
+	}
+	_elr_pool_unlock(pool, entered);
+
+	return mem;
 }
 
-/*Create a memory pool from which you can apply for memory blocks of different sizes, whether sync is executed with synchronization support. */
-elr_mem_pool* _elr_mpl_create_multi(elr_mem_pool* fpool,
-	int obj_size_count,
-	size_t* obj_size,
-	elr_mpl_callback on_alloc,
-	elr_mpl_callback on_free,
-	int sync)
+ELR_MPL_API elr_mpl_mark_t elr_mpl_mark(elr_mpl_ht hpool)
 {
-	elr_mem_pool  *first_pool = NULL;
+	elr_mpl_mark_t mark = { NULL, NULL };
 	elr_mem_pool  *pool = NULL;
-	elr_mem_pool **multi_pool = NULL;
+	int            entered = 0;
 
-	int i = 0;
-	int j = 0;
-	int valid = 1;
+	pool = (elr_mem_pool*)hpool->pool;
+	assert(pool->flags & ELR_MPL_ARENA_POOL);
 
-	multi_pool = (elr_mem_pool**)malloc(obj_size_count * sizeof(elr_mem_pool*));
-	if (multi_pool == NULL)
-		return NULL;
+	entered = _elr_pool_lock(pool);
+	if (pool->newly_alloc_node != NULL)
+	{
+		mark.node = pool->newly_alloc_node;
+		mark.avail = pool->newly_alloc_node->first_avail;
+	}
+	_elr_pool_unlock(pool, entered);
 
-	for (i = 0; i < obj_size_count; i++)
+	return mark;
+}
+
+ELR_MPL_API void elr_mpl_rollback(elr_mpl_ht hpool, elr_mpl_mark_t mark)
+{
+	elr_mem_pool  *pool = NULL;
+	int            entered = 0;
+
+	pool = (elr_mem_pool*)hpool->pool;
+	assert(pool->flags & ELR_MPL_ARENA_POOL);
+
+	entered = _elr_pool_lock(pool);
+	_elr_arena_rollback(pool, (elr_mem_node*)mark.node, (char*)mark.avail);
+	_elr_pool_unlock(pool, entered);
+}
+
+/*
+** Create a memory pool inside a POSIX shared memory object, other processes map it with elr_mpl_attach_shm.
+*/
+ELR_MPL_API elr_mpl_mapped_t elr_mpl_create_shm(const char* name, size_t obj_size, size_t obj_count)
+{
+	elr_mpl_mapped_t  mpl = { NULL };
+	int               fd = -1;
+
+	assert(name != NULL && obj_size > 0 && obj_count > 0);
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		return mpl;
+
+	mpl.pool = _elr_mapped_create(fd, obj_size, obj_count);
+	close(fd);
+	if (mpl.pool == NULL)
+		shm_unlink(name);
+
+	return mpl;
+}
+
+/*
+** Map a memory pool created by elr_mpl_create_shm, possibly in another process.
+*/
+ELR_MPL_API elr_mpl_mapped_t elr_mpl_attach_shm(const char* name)
+{
+	elr_mpl_mapped_t  mpl = { NULL };
+	int               fd = -1;
+
+	assert(name != NULL);
+
+	fd = shm_open(name, O_RDWR, 0600);
+	if (fd < 0)
+		return mpl;
+
+	mpl.pool = _elr_mapped_attach(fd);
+	close(fd);
+
+	return mpl;
+}
+
+/*
+** Remove the name of a shared memory pool, the memory goes away once every process detached.
+*/
+ELR_MPL_API int elr_mpl_unlink_shm(const char* name)
+{
+	return shm_unlink(name) == 0 ? 1 : 0;
+}
+
+/*
+** Create a memory pool inside a new file, its blocks survive the process.
+*/
+ELR_MPL_API elr_mpl_mapped_t elr_mpl_create_file(const char* path, size_t obj_size, size_t obj_count)
+{
+	elr_mpl_mapped_t  mpl = { NULL };
+	int               fd = -1;
+
+	assert(path != NULL && obj_size > 0 && obj_count > 0);
+
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		return mpl;
+
+	mpl.pool = _elr_mapped_create(fd, obj_size, obj_count);
+	close(fd);
+	if (mpl.pool == NULL)
+		unlink(path);
+
+	return mpl;
+}
+
+/*
+** Map a memory pool file again, the blocks in use and the free list are as they were at the last sync.
+*/
+ELR_MPL_API elr_mpl_mapped_t elr_mpl_open_file(const char* path)
+{
+	elr_mpl_mapped_t    mpl = { NULL };
+	elr_mapped_header  *hdr = NULL;
+	int                 fd = -1;
+
+	assert(path != NULL);
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return mpl;
+
+	hdr = (elr_mapped_header*)_elr_mapped_attach(fd);
+	close(fd);
+	if (hdr != NULL)
 	{
-		pool = _elr_mpl_create(fpool, obj_size[i], on_alloc, on_free, i == 0 ? sync : 0);
-		if (pool == NULL)
-		{
-			valid = 0;
-			break;
-		}
-		multi_pool[i] = (elr_mem_pool*)pool;
-		if (i == 0)
-		{
-			first_pool = pool;
-			pool->multi = multi_pool;
-			pool->multi_count = obj_size_count;
-		}
+		/* a process that went down while holding the lock must not keep it. */
+		_elr_lock_init(&hdr->lock, 1);
+		hdr->lock.shared = 1;
+		mpl.pool = hdr;
 	}
 
-	if (valid == 1)
+	return mpl;
+}
+
+/*
+** Write a mapped memory pool through to its file, a consistent snapshot of it.
+*/
+ELR_MPL_API int elr_mpl_sync_mapped(elr_mpl_mapped_ht hpool)
+{
+	elr_mapped_header  *hdr = NULL;
+	int                 ret = 0;
+
+	assert(hpool != NULL && hpool->pool != NULL);
+
+	/* the bulk is written without the lock, allocs and frees of every process go on meanwhile. */
+	hdr = (elr_mapped_header*)hpool->pool;
+	if (msync(hdr, hdr->map_size, MS_SYNC) != 0)
+		return 0;
+
+	/* holding the lock keeps the free list and counters consistent on disk, only pages dirtied since are left to write. */
+	_elr_lock_acquire(&hdr->lock);
+	ret = msync(hdr, hdr->map_size, MS_SYNC) == 0 ? 1 : 0;
+	_elr_lock_release(&hdr->lock);
+
+	return ret;
+}
+
+/*
+** Remember a memory block of a mapped memory pool as its root, NULL clears it.
+*/
+ELR_MPL_API void elr_mpl_set_root(elr_mpl_mapped_ht hpool, void* mem)
+{
+	elr_mapped_header  *hdr = NULL;
+
+	assert(hpool != NULL && hpool->pool != NULL);
+
+	hdr = (elr_mapped_header*)hpool->pool;
+	__atomic_store_n(&hdr->root, mem == NULL ? 0 : elr_mpl_mapped_offset(hpool, mem), __ATOMIC_RELEASE);
+}
+
+/*
+** Get the root memory block of a mapped memory pool.
+*/
+ELR_MPL_API void* elr_mpl_get_root(elr_mpl_mapped_ht hpool)
+{
+	elr_mapped_header  *hdr = NULL;
+
+	assert(hpool != NULL && hpool->pool != NULL);
+
+	hdr = (elr_mapped_header*)hpool->pool;
+	return elr_mpl_mapped_ptr(hpool, __atomic_load_n(&hdr->root, __ATOMIC_ACQUIRE));
+}
+
+/*
+** Allocate a memory block from a mapped memory pool.
+*/
+ELR_MPL_API void* elr_mpl_alloc_mapped(elr_mpl_mapped_ht hpool)
+{
+	elr_mapped_header  *hdr = NULL;
+	elr_mapped_slice   *slice = NULL;
+	size_t              offset = 0;
+
+	assert(hpool != NULL && hpool->pool != NULL);
+
+	hdr = (elr_mapped_header*)hpool->pool;
+	_elr_lock_acquire(&hdr->lock);
+	if (hdr->first_free != 0)
 	{
-        //g_multi_mem_pool is also applied through this method,
-        //But this method needs to rely on g_multi_mem_pool;
-        //So if g_multi_mem_pool has not been applied for, let it be valid first.
-		if (g_multi_mem_pool.pool == NULL)
-		{
-			g_multi_mem_pool.pool = first_pool;
-			g_multi_mem_pool.tag = first_pool->slice_tag;
-		}
-		multi_pool[0]->multi = (elr_mem_pool**)elr_mpl_alloc_multi(&g_multi_mem_pool, obj_size_count * sizeof(elr_mem_pool*));
-		if (multi_pool[0]->multi != NULL)
-		{
-			memcpy(multi_pool[0]->multi, multi_pool, obj_size_count * sizeof(elr_mem_pool*));
-		}
-		else
-		{
-			valid = 0;
-		}
+		offset = hdr->first_free;
+		slice = (elr_mapped_slice*)((char*)hdr + offset);
+		hdr->first_free = slice->next;
+	}
+	else if (hdr->first_avail + hdr->slice_size <= hdr->map_size)
+	{
+		offset = hdr->first_avail;
+		slice = (elr_mapped_slice*)((char*)hdr + offset);
+		hdr->first_avail += hdr->slice_size;
+	}
+
+	if (slice != NULL)
+	{
+		slice->next = 0;
+		slice->tag++;
+		hdr->using_count++;
 	}
+	_elr_lock_release(&hdr->lock);
+
+	if (slice == NULL)
+		return NULL;
+	return (char*)slice + ELR_ALIGN(sizeof(elr_mapped_slice),ELR_MAPPED_ALIGN);
+}
+
+/*
+** Give back a memory block to a mapped memory pool, from any process that mapped it.
+*/
+ELR_MPL_API void elr_mpl_free_mapped(elr_mpl_mapped_ht hpool, void* mem)
+{
+	elr_mapped_header  *hdr = NULL;
+	elr_mapped_slice   *slice = NULL;
+
+	if (mem == NULL)
+		return;
+
+	assert(hpool != NULL && hpool->pool != NULL);
+	assert(elr_mpl_mapped_offset(hpool, mem) != 0);
+
+	hdr = (elr_mapped_header*)hpool->pool;
+	slice = (elr_mapped_slice*)((char*)mem
+		- ELR_ALIGN(sizeof(elr_mapped_slice),ELR_MAPPED_ALIGN));
+
+	_elr_lock_acquire(&hdr->lock);
+	assert((slice->tag & 1) == 1);
+	slice->tag++;
+	slice->next = hdr->first_free;
+	hdr->first_free = (char*)slice - (char*)hdr;
+	hdr->using_count--;
+	_elr_lock_release(&hdr->lock);
+}
+
+/*
+** Turn a memory block of a mapped memory pool into an offset valid in every process, 0 if it is not one.
+*/
+ELR_MPL_API size_t elr_mpl_mapped_offset(elr_mpl_mapped_ht hpool, void* mem)
+{
+	elr_mapped_header  *hdr = NULL;
+	size_t              offset = 0;
+
+	hdr = (elr_mapped_header*)hpool->pool;
+	if (hdr == NULL || (char*)mem < (char*)hdr)
+		return 0;
+
+	offset = (char*)mem - (char*)hdr
+		- ELR_ALIGN(sizeof(elr_mapped_slice),ELR_MAPPED_ALIGN);
+	if (offset < hdr->first_slice || offset >= hdr->map_size
+		|| (offset - hdr->first_slice) % hdr->slice_size != 0)
+		return 0;
+
+	return (char*)mem - (char*)hdr;
+}
+
+/*
+** Turn an offset from elr_mpl_mapped_offset back into a memory block of this process`s mapping.
+*/
+ELR_MPL_API void* elr_mpl_mapped_ptr(elr_mpl_mapped_ht hpool, size_t offset)
+{
+	elr_mapped_header  *hdr = NULL;
+
+	hdr = (elr_mapped_header*)hpool->pool;
+	if (hdr == NULL || offset == 0 || offset >= hdr->map_size)
+		return NULL;
+
+	return (char*)hdr + offset;
+}
+
+/*
+** Unmap a mapped memory pool from this process, the pool itself is left alone.
+*/
+ELR_MPL_API void elr_mpl_detach(elr_mpl_mapped_ht hpool)
+{
+	elr_mapped_header  *hdr = NULL;
+
+	if (hpool == NULL || hpool->pool == NULL)
+		return;
+
+	hdr = (elr_mapped_header*)hpool->pool;
+	munmap(hdr, hdr->map_size);
+	hpool->pool = NULL;
+}
+
+/*
+** Get the 32 bits handle of a memory block from a memory pool created with ELR_MPL_HANDLES.
+*/
+ELR_MPL_API elr_mpl_handle_t elr_mpl_handle(void* mem)
+{
+    elr_mem_slice *slice = NULL;
+    elr_mem_node  *node = NULL;
+    size_t         index = 0;
+
+    if (mem == NULL)
+        return 0;
+
+    slice = (elr_mem_slice*)((char*)mem
+        - ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int)));
+    node = slice->node;
+    if (node->index == 0)
+        return 0;
+
+    index = ((char*)slice - node->first_slice) / node->owner->slice_size;
+    return ((elr_mpl_handle_t)((slice->tag >> 1) & ((1 << ELR_HANDLE_GEN_BITS) - 1))
+            << (ELR_HANDLE_NODE_BITS + ELR_HANDLE_SLICE_BITS))
+        | ((elr_mpl_handle_t)node->index << ELR_HANDLE_SLICE_BITS)
+        | (elr_mpl_handle_t)index;
+}
+
+/*
+** Get the memory block of a handle, NULL if the handle is stale.
+*/
+ELR_MPL_API void* elr_mpl_resolve(elr_mpl_ht hpool, elr_mpl_handle_t handle)
+{
+    elr_mem_pool  *pool = NULL;
+    elr_mem_node  *node = NULL;
+    elr_mem_slice *slice = NULL;
+    size_t         node_index = 0;
+    size_t         slice_index = 0;
+    void          *mem = NULL;
+    int            entered = 0;
+
+    assert(hpool != NULL && hpool->pool != NULL);
+
+    pool = (elr_mem_pool*)hpool->pool;
+    assert((pool->flags & ELR_MPL_HANDLES) && pool->multi == NULL);
+
+    node_index = (handle >> ELR_HANDLE_SLICE_BITS) & ((1 << ELR_HANDLE_NODE_BITS) - 1);
+    slice_index = handle & ((1 << ELR_HANDLE_SLICE_BITS) - 1);
+
+    /* nodes may go away under a stale handle, so the table is read with the pool held. */
+    entered = _elr_pool_lock(pool);
+    if (node_index != 0 && node_index < pool->node_table_count)
+        node = pool->node_table[node_index];
+    if (node != NULL && slice_index < node->used_slice_count)
+    {
+        slice = (elr_mem_slice*)(node->first_slice + slice_index * pool->slice_size);
+        if ((slice->tag & 1) == 1
+            && (elr_mpl_handle_t)((slice->tag >> 1) & ((1 << ELR_HANDLE_GEN_BITS) - 1))
+                == handle >> (ELR_HANDLE_NODE_BITS + ELR_HANDLE_SLICE_BITS))
+            mem = (char*)slice + ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int));
+    }
+    _elr_pool_unlock(pool, entered);
+
+    return mem;
+}
+
+/*
+** Get the size of the memory block requested from the memory pool。
+*/
+ELR_MPL_API size_t elr_mpl_size(void* mem)
+{
+    if ( mem == NULL )
+        return 0;
+
+    elr_mem_slice *slice = (elr_mem_slice*)((char*)mem
+        - ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int)));
+    return slice->node->owner->object_size;
+}
+
+/*Take a node of a fullest-first pool out of its occupancy bucket*/
+static inline void _elr_bucket_remove(elr_mem_pool* pool, elr_mem_node* node)
+{
+    if (node->avail_next != NULL)
+        node->avail_next->avail_prev = node->avail_prev;
+    if (node->avail_prev != NULL)
+        node->avail_prev->avail_next = node->avail_next;
+    else
+        pool->avail_bucket[node->bucket] = node->avail_next;
+    node->avail_prev = NULL;
+    node->avail_next = NULL;
+    node->bucket = -1;
+}
+
+/*Move a node of a fullest-first pool to the bucket of its occupancy, the caller holds the pool*/
+static inline void _elr_bucket_place(elr_mem_pool* pool, elr_mem_node* node)
+{
+    int  bucket = -1;
+
+    if (node->free_slice_head != NULL)
+        bucket = (int)(node->using_slice_count * ELR_OCCUPANCY_BUCKETS / pool->slice_count);
+    if (bucket == node->bucket)
+        return;
+
+    if (node->bucket >= 0)
+        _elr_bucket_remove(pool, node);
+    if (bucket >= 0)
+    {
+        node->bucket = bucket;
+        node->avail_prev = NULL;
+        node->avail_next = pool->avail_bucket[bucket];
+        if (node->avail_next != NULL)
+            node->avail_next->avail_prev = node;
+        pool->avail_bucket[bucket] = node;
+    }
+}
+
+/*Give a slice back to its pool, the caller holds the pool*/
+static inline void _elr_slice_give(elr_mem_pool* pool, elr_mem_slice* slice, void* mem)
+{
+    elr_mem_node*  node = slice->node;
+
+	slice->tag++;
+	node->using_slice_count--;
+	pool->using_count--;
+
+    if (pool->on_slice_free != NULL)
+    {
+        pool->on_slice_free(mem);
+    }
+
+	if (slice->next != NULL)
+		slice->next->prev = slice->prev;
+
+	if (slice->prev != NULL)
+		slice->prev->next = slice->next;
+     else
+		pool->first_occupied_slice = slice->next;
+
+	if (node->using_slice_count == 0
+		&& (pool->flags & ELR_MPL_BUFFER_POOL) == 0
+		&& __atomic_load_n(&g_occupation_size, __ATOMIC_RELAXED) >= ELR_AUTO_FREE_NODE_THRESHOLD)
+    {
+		_elr_free_mem_node(node);
+    }
+    else
+    {
+		if (node->using_slice_count == 0)
+			node->idle_since = __atomic_load_n(&g_reclaim_tick, __ATOMIC_RELAXED);
 
-	if (valid == 0)
-	{
-		first_pool = NULL;
-		for (j = 0; j < i; j++)
+		if (pool->flags & ELR_MPL_FULLEST_FIRST)
 		{
-			_elr_mpl_destory(multi_pool[j], 0, 0);
+			/* the node keeps its free slices to itself, newest first. */
+			slice->prev = NULL;
+			slice->next = node->free_slice_head;
+			if (node->free_slice_head != NULL)
+				node->free_slice_head->prev = slice;
+			else
+				node->free_slice_tail = slice;
+			node->free_slice_head = slice;
+			_elr_bucket_place(pool, node);
 		}
-	}
+		else if (node->free_slice_head == NULL)
+        {
+			node->free_slice_head = slice;
+			node->free_slice_tail = slice;
+			slice->prev = NULL;
+			slice->next = pool->first_free_slice;
+			if (pool->first_free_slice != NULL)
+				pool->first_free_slice->prev = slice;
+			pool->first_free_slice = slice;
+		}
+		else
+		{
+			slice->next = node->free_slice_tail->next;
+			if (slice->next != NULL)
+				slice->next->prev = slice;
+			node->free_slice_tail->next = slice;
+			slice->prev = node->free_slice_tail;
+			node->free_slice_tail = slice;
+        }
+    }
+}
 
-	free(multi_pool);
+/*
+** Return memory to the memory pool. Executing this method may also return memory to the system.
+*/
+ELR_MPL_API void  elr_mpl_free(void* mem)
+{
+    if ( mem == NULL )
+        return;
 
-	return first_pool;
+    /* taken before the block is given back, so it comes before the next allocation of the block. */
+    if (_elr_tracing())
+        _elr_trace(ELR_MPL_TRACE_FREE, ((elr_mem_slice*)((char*)mem
+            - ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int))))->node->owner, mem, 0, 0);
+    _elr_mpl_free(mem);
 }
 
-ELR_MPL_API elr_mpl_t elr_mpl_create_multi(elr_mpl_ht fpool,
-	int obj_size_count,
-	size_t* obj_size,
-	elr_mpl_callback on_alloc,
-	elr_mpl_callback on_free)
+void _elr_mpl_free(void* mem)
 {
-	elr_mpl_t      mpl = ELR_MPL_INITIALIZER;
-	elr_mem_pool  *pool = NULL;
-
-	assert(fpool == NULL || elr_mpl_avail(fpool) != 0);
+    int            entered = 0;
+    
+    elr_mem_slice *slice = (elr_mem_slice*)((char*)mem 
+        - ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int)));
+    elr_mem_pool*  pool = slice->node->owner;
 
-    elr_mem_pool* tpl = NULL;
-    if ( fpool != NULL )
-        tpl = (elr_mem_pool*)fpool->pool;
+#ifdef DEBUG
+	assert(_elr_mpl_avail(pool) != 0);
+#endif
+    /* an unsynchronized pool goes straight to the list work. */
+	if (pool->sync == ELR_SYNC_NONE)
+    {
+        _elr_slice_give(pool, slice, mem);
+        return;
+    }
 
-	pool = _elr_mpl_create_multi( tpl, obj_size_count, obj_size, on_alloc, on_free, 0);
-	if (pool != NULL)
-	{
-		mpl.pool = pool;
-		mpl.tag = pool->slice_tag;
-	}
+    entered = _elr_pool_lock(pool);
+    _elr_slice_give(pool, slice, mem);
+    _elr_pool_unlock(pool, entered);
 
-	return mpl;
+    if (__atomic_load_n(&pool->capacity, __ATOMIC_RELAXED) != 0)
+        _elr_wake_waiters(pool, 1);
 }
 
-ELR_MPL_API elr_mpl_t elr_mpl_create_multi_sync(elr_mpl_ht fpool,
-	int obj_size_count,
-	size_t* obj_size,
-	elr_mpl_callback on_alloc,
-	elr_mpl_callback on_free)
+/*
+** Limit the bytes of memory nodes a memory pool and its children may hold, 0 removes the limit.
+*/
+ELR_MPL_API void elr_mpl_set_limit(elr_mpl_ht hpool, size_t bytes)
 {
-	elr_mpl_t      mpl = ELR_MPL_INITIALIZER;
-	elr_mem_pool  *pool = NULL;
+    elr_mem_pool  *pool = NULL;
 
-	assert(fpool == NULL || elr_mpl_avail(fpool) != 0);
+    assert(hpool != NULL && hpool->pool != NULL);
 
-    elr_mem_pool* tpl = NULL;
-    if ( fpool != NULL )
-        tpl = (elr_mem_pool*)fpool->pool;
-	
-	pool = _elr_mpl_create_multi( tpl, obj_size_count, obj_size, on_alloc, on_free, 1);
-	if (pool != NULL)
-	{
-      mpl.pool = pool;
-      mpl.tag = pool->slice_tag;
-	}
+    pool = (elr_mem_pool*)hpool->pool;
+    __atomic_store_n(&pool->limit, bytes, __ATOMIC_RELAXED);
+}
 
-    return mpl;
+/*
+** Set the function called when a memory node would pass the limit of a memory pool.
+*/
+ELR_MPL_API void elr_mpl_set_limit_callback(elr_mpl_ht hpool, elr_mpl_limit_callback on_limit, void* ctx)
+{
+    elr_mem_pool  *pool = NULL;
+
+    assert(hpool != NULL && hpool->pool != NULL);
+
+    /* read by threads allocating from any pool below, the context is published by the callback. */
+    pool = (elr_mem_pool*)hpool->pool;
+    __atomic_store_n(&pool->limit_ctx, ctx, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->on_limit, on_limit, __ATOMIC_RELEASE);
 }
 
-/*** To determine whether the memory pool is valid, it is generally called immediately after the creation is completed.
-** return 0 for invalid
-** pool cannot be NULL
+/*
+** Get the bytes of memory nodes a memory pool and its children hold.
 */
-ELR_MPL_API int  elr_mpl_avail(elr_mpl_ht hpool)
+ELR_MPL_API size_t elr_mpl_charged(elr_mpl_ht hpool)
 {
-    int              ret = 1;
-    elr_mem_slice   *pslice = NULL;
-	elr_mem_pool    *pool = NULL;
+    assert(hpool != NULL && hpool->pool != NULL);
 
-	assert(hpool != NULL);
+    return __atomic_load_n(&((elr_mem_pool*)hpool->pool)->charged, __ATOMIC_RELAXED);
+}
 
-    if(hpool->pool == NULL)
-    {
-        ret = 0;
-    }
-    else
-    {
-		pool = (elr_mem_pool*)hpool->pool;
-		pslice = (elr_mem_slice*)((char*)pool
-            - ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int)));
-		if (hpool->tag != pool->slice_tag 
-			|| hpool->tag != pslice->tag)
-            ret = 0;
-    }
+/*
+** Take one more reference to a memory block, each reference is dropped by elr_mpl_release.
+*/
+ELR_MPL_API void elr_mpl_retain(void* mem)
+{
+    elr_mem_slice *slice = (elr_mem_slice*)((char*)mem
+        - ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int)));
 
-    return ret;
+    assert(mem != NULL && (slice->tag & 1) == 1);
+    /* the caller holds a reference, so the block can`t go away meanwhile. */
+    __atomic_fetch_add(&slice->refs, 1, __ATOMIC_RELAXED);
 }
 
-int _elr_mpl_avail(elr_mem_pool* pool)
+/*
+** Drop a reference to a memory block, the last one gives it back to its pool.
+*/
+ELR_MPL_API void elr_mpl_release(void* mem)
 {
-	elr_mem_slice* pslice = NULL;
-	assert(pool != NULL);
+    elr_mem_slice *slice = NULL;
 
-	pslice = (elr_mem_slice*)((char*)pool
-		- ELR_ALIGN(sizeof(elr_mem_slice), sizeof(int)));
+    if ( mem == NULL )
+        return;
 
-	if (pool->slice_tag != pslice->tag)
-		return 0;
+    slice = (elr_mem_slice*)((char*)mem
+        - ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int)));
+    assert((slice->tag & 1) == 1);
 
-	return 1;
+    /* a block never retained costs no atomic read-modify-write. */
+    if (__atomic_load_n(&slice->refs, __ATOMIC_ACQUIRE) != 0
+        && __atomic_fetch_sub(&slice->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    __atomic_store_n(&slice->refs, 0, __ATOMIC_RELAXED);
+    elr_mpl_free(mem);
 }
 
 /*
-** Allocate memory from the memory pool。
+** Read the contention counters of a sync memory pool`s lock.
 */
-ELR_MPL_API void*  elr_mpl_alloc(elr_mpl_ht hpool)
+ELR_MPL_API int elr_mpl_lock_stats(elr_mpl_ht hpool, elr_mpl_lock_stat* stat)
 {
-    elr_mem_slice *pslice = NULL;
     elr_mem_pool  *pool = NULL;
-    
-    if ( hpool == NULL )
-        return NULL;
 
-#ifdef DEBUG
-    assert(hpool != NULL  && elr_mpl_avail(hpool)!=0);
-#endif
+    assert(hpool != NULL && stat != NULL);
 
+    memset(stat, 0, sizeof(elr_mpl_lock_stat));
     pool = (elr_mem_pool*)hpool->pool;
-    pslice = _elr_slice_from_pool(pool);
-
-    if(pslice == NULL)
-        return NULL;
-    else
+    if (pool == NULL)
+        return 0;
+    if (pool->sync != ELR_SYNC_NONE)
     {
-        char *mem = (char*)pslice 
-            + ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int));
-        if (pool->on_slice_alloc != NULL)
-            pool->on_slice_alloc(mem);
-
-        return mem;
+        /* the counters are written by the holder only, a racy read is good enough. */
+        stat->acquired = __atomic_load_n(&pool->pool_mutex.acquired, __ATOMIC_RELAXED);
+        stat->contended = __atomic_load_n(&pool->pool_mutex.contended, __ATOMIC_RELAXED);
+        stat->parked = __atomic_load_n(&pool->pool_mutex.parked, __ATOMIC_RELAXED);
+        stat->spin = __atomic_load_n(&pool->pool_mutex.spin, __ATOMIC_RELAXED);
+        return 1;
     }
+    return 0;
 }
 
-ELR_MPL_API void * elr_mpl_alloc_multi(elr_mpl_ht hpool, size_t size)
+/*
+** Give back all memory blocks of the memory pool at once, its nodes are kept for reuse.
+*/
+ELR_MPL_API void elr_mpl_reset(elr_mpl_ht hpool)
 {
-	void*          mem = NULL;
-	elr_mpl_t      alloc_mpl = ELR_MPL_INITIALIZER;
-	elr_mem_slice *slice = NULL;
-	elr_mem_pool  *pool = NULL;
-	elr_mem_pool  *parent_pool = NULL;
-	elr_mem_pool  *child_pool = NULL;
-	elr_mem_pool  *alloc_pool = NULL;
-	int i = 0;
-
-	assert(hpool == NULL || elr_mpl_avail(hpool) != 0);
-
-	if (hpool == NULL)
-		hpool = &g_multi_mem_pool;
-    
-	pool = (elr_mem_pool*)hpool->pool;
+    elr_mem_pool  *pool = NULL;
+    elr_mem_pool  *child_pool = NULL;
+	int            j = 0;
 
-	assert(pool->multi != NULL);
+    if ( hpool == NULL || hpool->pool == NULL )
+        return;
 
-	parent_pool = pool->multi[pool->multi_count - 1];
-#ifdef USE_THREADLOCK
-	if(pool->sync == 1)
-		pthread_mutex_lock(&pool->pool_mutex);
+#ifdef DEBUG
+    assert(elr_mpl_avail(hpool)!=0);
 #endif
-	for (i = 0; i < pool->multi_count; i++)
+    pool = (elr_mem_pool*)hpool->pool;
+	if (pool->flags & ELR_MPL_ARENA_POOL)
 	{
-		if (pool->multi[i]->object_size >= size)
-		{
-			alloc_pool = pool->multi[i];
-			break;
-		}
+		elr_mpl_mark_t empty = { NULL, NULL };
+		elr_mpl_rollback(hpool, empty);
 	}
+	else if (pool->multi != NULL)
+    {
+		for (j = 0; j < pool->multi_count; j++)
+			_elr_mpl_reset(pool->multi[j]);
 
-	if (alloc_pool == NULL)
-	{		
-		child_pool = parent_pool->first_child;
+		/* over-range classes belong to the multi pool too. */
+		if (pool->sync != ELR_SYNC_NONE)
+			_elr_lock_acquire(&pool->multi_mutex);
+		child_pool = pool->multi[pool->multi_count - 1]->first_child;
 		while (child_pool != NULL)
 		{
-			if (child_pool->object_size >= size)
-			{
-				alloc_pool = child_pool;
-				break;
-			}
+			_elr_mpl_reset(child_pool);
 			child_pool = child_pool->next;
 		}
+		if (pool->sync != ELR_SYNC_NONE)
+			_elr_lock_release(&pool->multi_mutex);
 	}
-
-	if (alloc_pool == NULL)
-	{
-		size = ELR_OVERRANGE_UNIT_SIZE*((size + ELR_OVERRANGE_UNIT_SIZE - 1) / ELR_OVERRANGE_UNIT_SIZE);
-		alloc_mpl.pool = parent_pool;
-		alloc_mpl.tag = parent_pool->slice_tag;
-		alloc_mpl = elr_mpl_create(&alloc_mpl, size, parent_pool->on_slice_alloc, parent_pool->on_slice_free);
-		alloc_pool = (elr_mem_pool*)alloc_mpl.pool;
-	}
-	else
+    else
 	{
-		alloc_mpl.pool = alloc_pool;
-		alloc_mpl.tag = alloc_pool->slice_tag;
-	}
+		_elr_mpl_reset(pool);
+    }
+}
 
-	if (alloc_pool != NULL)
-	{
-		mem = elr_mpl_alloc(&alloc_mpl);
-	}
-#ifdef USE_THREADLOCK
-	if (pool->sync == 1)
-		pthread_mutex_unlock(&pool->pool_mutex);
-#endif
-	return mem;
+/*
+** Move memory blocks out of sparsely used memory nodes so those nodes can be given back, returns the bytes given back.
+*/
+ELR_MPL_API size_t elr_mpl_compact(elr_mpl_ht hpool, elr_mpl_relocate relocate, void* ctx)
+{
+    elr_mem_pool  *pool = NULL;
+    size_t         bytes = 0;
+    int            j = 0;
+
+    assert(hpool != NULL && hpool->pool != NULL && relocate != NULL);
+
+    pool = (elr_mem_pool*)hpool->pool;
+    if (pool->multi != NULL)
+    {
+        for (j = 0; j < pool->multi_count; j++)
+            bytes += _elr_mpl_compact(pool->multi[j], relocate, ctx);
+    }
+    else
+    {
+        bytes = _elr_mpl_compact(pool, relocate, ctx);
+    }
+
+    return bytes;
+}
+
+/*
+** Call visit for every allocated memory block of a memory pool, returns the number of memory blocks visited.
+*/
+ELR_MPL_API size_t elr_mpl_foreach(elr_mpl_ht hpool, elr_mpl_visit visit, void* ctx)
+{
+    elr_mem_pool  *pool = NULL;
+    size_t         count = 0;
+    int            j = 0;
+
+    assert(hpool != NULL && hpool->pool != NULL && visit != NULL);
+
+    pool = (elr_mem_pool*)hpool->pool;
+    if (pool->multi != NULL)
+    {
+        for (j = 0; j < pool->multi_count; j++)
+            count += _elr_mpl_foreach(pool->multi[j], visit, NULL, ctx);
+    }
+    else
+    {
+        count = _elr_mpl_foreach(pool, visit, NULL, ctx);
+    }
+
+    return count;
+}
+
+/*
+** Call visit with arrays of the allocated memory blocks of a memory pool, returns the number of memory blocks visited.
+*/
+ELR_MPL_API size_t elr_mpl_foreach_batch(elr_mpl_ht hpool, elr_mpl_visit_batch visit, void* ctx)
+{
+    elr_mem_pool  *pool = NULL;
+    size_t         count = 0;
+    int            j = 0;
+
+    assert(hpool != NULL && hpool->pool != NULL && visit != NULL);
+
+    pool = (elr_mem_pool*)hpool->pool;
+    if (pool->multi != NULL)
+    {
+        for (j = 0; j < pool->multi_count; j++)
+            count += _elr_mpl_foreach(pool->multi[j], NULL, visit, ctx);
+    }
+    else
+    {
+        count = _elr_mpl_foreach(pool, NULL, visit, ctx);
+    }
+
+    return count;
 }
 
 /*
-** Get the size of the memory block requested from the memory pool。
+** Write a JSON-lines dump of a memory pool, its memory nodes and its child memory pools to fd, the whole pool tree for NULL.
 */
-ELR_MPL_API size_t elr_mpl_size(void* mem)
+ELR_MPL_API int elr_mpl_dump(elr_mpl_ht hpool, int fd)
 {
-    if ( mem == NULL )
+    elr_mem_pool  *pool = NULL;
+    elr_dump_buf   buf = { NULL, 0, 0, 0 };
+    int            j = 0;
+
+    pool = (hpool == NULL) ? &g_mem_pool : (elr_mem_pool*)hpool->pool;
+    if (pool == NULL)
         return 0;
 
-    elr_mem_slice *slice = (elr_mem_slice*)((char*)mem
-        - ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int)));
-    return slice->node->owner->object_size;
+    _elr_dump_printf(&buf, "{\"elr_mpl_dump\":1,\"pid\":%d,\"time\":%ld,\"occupation\":%zu}\n",
+        (int)getpid(), (long)time(NULL), __atomic_load_n(&g_occupation_size, __ATOMIC_RELAXED));
+
+    /* the tree lock keeps every pool of the walk alive, like for the reclaimer. */
+    assert(g_in_limit_callback == 0);
+    _elr_lock_acquire(&g_tree_lock);
+    if (pool->multi != NULL)
+    {
+        for (j = 0; j < pool->multi_count; j++)
+            _elr_mpl_dump(pool->multi[j], &buf);
+    }
+    else
+    {
+        _elr_mpl_dump(pool, &buf);
+    }
+    _elr_lock_release(&g_tree_lock);
+
+    /* written once every lock is dropped, so a slow fd stalls neither pools nor the reclaimer. */
+    _elr_dump_flush(&buf, fd);
+
+    free(buf.data);
+    return buf.failed == 0;
 }
 
 /*
-** Return memory to the memory pool. Executing this method may also return memory to the system.
+** Start recording calls to the memory pool functions into a binary trace written to fd.
 */
-ELR_MPL_API void  elr_mpl_free(void* mem)
+ELR_MPL_API int elr_mpl_trace_start(int fd)
 {
-    if ( mem == NULL )
-        return;
-    
-    elr_mem_slice *slice = (elr_mem_slice*)((char*)mem 
-        - ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int)));
-    elr_mem_node*  node = slice->node;
-    elr_mem_pool*  pool = node->owner;
-
-#ifdef DEBUG
-	assert(_elr_mpl_avail(pool) != 0);
-#endif
-#ifdef USE_THREADLOCK
-	if (pool->sync == 1)
-		pthread_mutex_lock(&pool->pool_mutex);
-#endif
-	slice->tag++;
-	node->using_slice_count--;
+    elr_mpl_trace_header  header = { ELR_MPL_TRACE_MAGIC, ELR_MPL_TRACE_VERSION,
+                                     sizeof(elr_mpl_trace_record), 0 };
+    int                   ret = 0;
 
-    if (pool->on_slice_free != NULL)
+    pthread_mutex_lock(&g_trace_ctl_mtx);
+    if (__atomic_load_n(&g_trace_on, __ATOMIC_RELAXED) == 0
+        && write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header))
     {
-        pool->on_slice_free(mem);
+        pthread_mutex_lock(&g_trace_mtx);
+        g_trace_fd = fd;
+        g_trace_failed = 0;
+        g_trace_start = _elr_trace_now();
+        pthread_mutex_unlock(&g_trace_mtx);
+        __atomic_store_n(&g_trace_on, 1, __ATOMIC_RELEASE);
+        ret = 1;
     }
+    pthread_mutex_unlock(&g_trace_ctl_mtx);
 
-	if (slice->next != NULL)
-		slice->next->prev = slice->prev;
+    return ret;
+}
 
-	if (slice->prev != NULL)
-		slice->prev->next = slice->next;
-     else
-		pool->first_occupied_slice = slice->next;
+/*
+** Stop recording and write out the records still buffered by all threads.
+*/
+ELR_MPL_API int elr_mpl_trace_stop()
+{
+    elr_trace_buffer  *buf = NULL;
+    int                ret = 0;
 
-	if (node->using_slice_count == 0
-		&& g_occupation_size >= ELR_AUTO_FREE_NODE_THRESHOLD)
-    {
-		_elr_free_mem_node(node);
-    }
-    else
+    pthread_mutex_lock(&g_trace_ctl_mtx);
+    if (__atomic_load_n(&g_trace_on, __ATOMIC_RELAXED) != 0)
     {
-		if (node->free_slice_head == NULL)
+        /* every thread records under its buffer lock, taking it after the flag is cleared catches all records made. */
+        __atomic_store_n(&g_trace_on, 0, __ATOMIC_SEQ_CST);
+        for (buf = __atomic_load_n(&g_trace_buffers, __ATOMIC_ACQUIRE); buf != NULL; buf = buf->next)
         {
-			node->free_slice_head = slice;
-			node->free_slice_tail = slice;
-			slice->prev = NULL;
-			slice->next = pool->first_free_slice;
-			if (pool->first_free_slice != NULL)
-				pool->first_free_slice->prev = slice;
-			pool->first_free_slice = slice;
-		}
-		else
-		{
-			slice->next = node->free_slice_tail->next;
-			if (slice->next != NULL)
-				slice->next->prev = slice;
-			node->free_slice_tail->next = slice;
-			slice->prev = node->free_slice_tail;
-			node->free_slice_tail = slice;
+            _elr_lock_acquire(&buf->lock);
+            if (buf->count > 0)
+                _elr_trace_write(buf);
+            _elr_lock_release(&buf->lock);
         }
+        pthread_mutex_lock(&g_trace_mtx);
+        ret = (g_trace_failed == 0);
+        g_trace_fd = -1;
+        pthread_mutex_unlock(&g_trace_mtx);
     }
-#ifdef USE_THREADLOCK
-	if (pool->sync == 1)
-    {
-        pthread_mutex_unlock(&pool->pool_mutex);
-    }
-#endif
-    return;
+    pthread_mutex_unlock(&g_trace_ctl_mtx);
+
+    return ret;
 }
 
 /*
@@ -713,13 +3024,13 @@ ELR_MPL_API void elr_mpl_destroy(elr_mpl_ht hpool)
 #endif
     if ( pool == NULL )
         return;
-#ifdef USE_THREADLOCK
-    if (pool->sync == 1)
-        pthread_mutex_lock(&pool->pool_mutex);
-#endif 
+    if (_elr_tracing())
+        _elr_trace(ELR_MPL_TRACE_DESTROY, pool, NULL, 0, 0);
+    /* no self locking here, the pool`s mutex is destroyed with the pool. */
 	if (pool->multi != NULL)
     {
-		for (j = 0; j < pool->multi_count; j++)
+		/* multi[0] owns the class table, so it must be the last one destroyed. */
+		for (j = pool->multi_count - 1; j >= 0; j--)
 		{
 			_elr_mpl_destory(pool->multi[j], 0, 0);
 		}
@@ -731,10 +3042,346 @@ ELR_MPL_API void elr_mpl_destroy(elr_mpl_ht hpool)
 
     hpool->pool = NULL;
     hpool->tag = 0;
-#ifdef USE_THREADLOCK
-    if (pool->sync == 1)
-        pthread_mutex_unlock(&pool->pool_mutex);
-#endif
+}
+
+/*Hand the chunks of a finished thread over to the orphans and free its record*/
+static void _elr_ebr_thread_exit(void* arg)
+{
+    elr_ebr_record  *rec = (elr_ebr_record*)arg;
+    elr_ebr_chunk   *chunk = rec->retired;
+
+    if (chunk != NULL)
+    {
+        while (chunk->next != NULL)
+            chunk = chunk->next;
+        pthread_mutex_lock(&g_ebr_mtx);
+        chunk->next = g_ebr_orphans;
+        g_ebr_orphans = rec->retired;
+        pthread_mutex_unlock(&g_ebr_mtx);
+    }
+
+    rec->retired = NULL;
+    rec->since_advance = 0;
+    rec->nest = 0;
+    __atomic_store_n(&rec->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void _elr_ebr_key_create()
+{
+    pthread_key_create(&g_ebr_key, _elr_ebr_thread_exit);
+}
+
+/*Get the epoch record of the calling thread, NULL if none could be allocated*/
+static elr_ebr_record* _elr_ebr_self()
+{
+    elr_ebr_record  *rec = g_ebr_self;
+    int              expect = 0;
+
+    if (rec != NULL)
+        return rec;
+
+    pthread_once(&g_ebr_once, _elr_ebr_key_create);
+    for (rec = __atomic_load_n(&g_ebr_records, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next)
+    {
+        expect = 0;
+        if (__atomic_load_n(&rec->in_use, __ATOMIC_RELAXED) == 0
+            && __atomic_compare_exchange_n(&rec->in_use, &expect, 1, 0,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (rec == NULL)
+    {
+        rec = (elr_ebr_record*)calloc(1, sizeof(elr_ebr_record));
+        if (rec == NULL)
+            return NULL;
+        rec->in_use = 1;
+        rec->next = __atomic_load_n(&g_ebr_records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&g_ebr_records, &rec->next, rec, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    pthread_setspecific(g_ebr_key, rec);
+    g_ebr_self = rec;
+    return rec;
+}
+
+/*Move the global epoch on if every thread inside a critical section has seen it, returns the epoch*/
+static unsigned long _elr_ebr_try_advance()
+{
+    elr_ebr_record  *rec = NULL;
+    unsigned long    epoch = __atomic_load_n(&g_ebr_epoch, __ATOMIC_SEQ_CST);
+    unsigned long    seen = 0;
+
+    for (rec = __atomic_load_n(&g_ebr_records, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next)
+    {
+        seen = __atomic_load_n(&rec->epoch, __ATOMIC_SEQ_CST);
+        if (seen != 0 && seen != epoch)
+            return epoch;
+    }
+
+    if (__atomic_compare_exchange_n(&g_ebr_epoch, &epoch, epoch + 1, 0,
+            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        return epoch + 1;
+    return epoch;
+}
+
+/*Give back the memory blocks of the chunks retired two epochs ago or earlier, returns the chunks kept*/
+static elr_ebr_chunk* _elr_ebr_collect(elr_ebr_chunk* list, unsigned long epoch)
+{
+    elr_ebr_chunk   *keep = NULL;
+    elr_ebr_chunk   *chunk = NULL;
+    elr_mem_pool    *pool = NULL;
+    int              i = 0;
+
+    while ((chunk = list) != NULL)
+    {
+        list = chunk->next;
+        if (chunk->epoch + 2 <= epoch)
+        {
+            for (i = 0; i < chunk->count; i++)
+            {
+                /* counted down only once the block is back, compaction must not move it before. */
+                pool = ((elr_mem_slice*)((char*)chunk->mem[i]
+                    - ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int))))->node->owner;
+                elr_mpl_free(chunk->mem[i]);
+                __atomic_sub_fetch(&pool->retired_count, 1, __ATOMIC_RELEASE);
+            }
+            free(chunk);
+        }
+        else
+        {
+            chunk->next = keep;
+            keep = chunk;
+        }
+    }
+
+    /* keep the newest chunk first again. */
+    list = NULL;
+    while ((chunk = keep) != NULL)
+    {
+        keep = chunk->next;
+        chunk->next = list;
+        list = chunk;
+    }
+    return list;
+}
+
+/*Try to advance the epoch and give back what the calling thread and finished threads retired*/
+static void _elr_ebr_poll(elr_ebr_record* rec)
+{
+    unsigned long    epoch = _elr_ebr_try_advance();
+
+    rec->since_advance = 0;
+    rec->retired = _elr_ebr_collect(rec->retired, epoch);
+
+    if (__atomic_load_n(&g_ebr_orphans, __ATOMIC_RELAXED) != NULL)
+    {
+        pthread_mutex_lock(&g_ebr_mtx);
+        g_ebr_orphans = _elr_ebr_collect(g_ebr_orphans, epoch);
+        pthread_mutex_unlock(&g_ebr_mtx);
+    }
+}
+
+/*
+** Enter a read-side critical section, blocks retired from now on are not given back until it is left.
+*/
+ELR_MPL_API void elr_mpl_enter()
+{
+    elr_ebr_record  *rec = _elr_ebr_self();
+
+    assert(rec != NULL);
+    if (rec->nest++ == 0)
+    {
+        __atomic_store_n(&rec->epoch, __atomic_load_n(&g_ebr_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+        /* the reads of the critical section must not move above the announcement. */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+/*
+** Leave a read-side critical section.
+*/
+ELR_MPL_API void elr_mpl_exit()
+{
+    elr_ebr_record  *rec = g_ebr_self;
+
+    assert(rec != NULL && rec->nest > 0);
+    if (--rec->nest == 0)
+        __atomic_store_n(&rec->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+** Give back a memory block once no thread inside a critical section can still see it.
+*/
+ELR_MPL_API int elr_mpl_retire(void* mem)
+{
+    elr_ebr_record  *rec = _elr_ebr_self();
+    elr_ebr_chunk   *chunk = NULL;
+    unsigned long    epoch = 0;
+
+    if (mem == NULL)
+        return 1;
+    if (rec == NULL)
+        return 0;
+
+    epoch = __atomic_load_n(&g_ebr_epoch, __ATOMIC_SEQ_CST);
+    chunk = rec->retired;
+    if (chunk == NULL || chunk->epoch != epoch || chunk->count == ELR_EBR_CHUNK)
+    {
+        chunk = (elr_ebr_chunk*)malloc(sizeof(elr_ebr_chunk));
+        if (chunk == NULL)
+            return 0;
+        chunk->epoch = epoch;
+        chunk->count = 0;
+        chunk->next = rec->retired;
+        rec->retired = chunk;
+    }
+    chunk->mem[chunk->count++] = mem;
+    __atomic_add_fetch(&((elr_mem_slice*)((char*)mem
+        - ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int))))->node->owner->retired_count, 1, __ATOMIC_RELAXED);
+
+    if (++rec->since_advance >= ELR_EBR_BATCH)
+        _elr_ebr_poll(rec);
+    return 1;
+}
+
+/*
+** Give back whatever retired memory blocks are already safe, returns the number the calling thread still holds.
+*/
+ELR_MPL_API size_t elr_mpl_retire_flush()
+{
+    elr_ebr_record  *rec = _elr_ebr_self();
+    elr_ebr_chunk   *chunk = NULL;
+    size_t           pending = 0;
+
+    if (rec == NULL)
+        return 0;
+
+    _elr_ebr_poll(rec);
+    for (chunk = rec->retired; chunk != NULL; chunk = chunk->next)
+        pending += chunk->count;
+    return pending;
+}
+
+/*Forget every retired memory block, the pools they belong to are going away*/
+static void _elr_ebr_drop()
+{
+    elr_ebr_record  *rec = NULL;
+    elr_ebr_chunk   *chunk = NULL;
+
+    for (rec = __atomic_load_n(&g_ebr_records, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next)
+    {
+        while ((chunk = rec->retired) != NULL)
+        {
+            rec->retired = chunk->next;
+            free(chunk);
+        }
+        rec->since_advance = 0;
+    }
+
+    pthread_mutex_lock(&g_ebr_mtx);
+    while ((chunk = g_ebr_orphans) != NULL)
+    {
+        g_ebr_orphans = chunk->next;
+        free(chunk);
+    }
+    pthread_mutex_unlock(&g_ebr_mtx);
+}
+
+static void* _elr_reclaim_main(void* arg)
+{
+    struct timespec  ts;
+    size_t           bytes = 0;
+
+    (void)arg;
+    pthread_mutex_lock(&g_reclaim_mtx);
+    while (g_reclaim_stop == 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += g_reclaim_interval / 1000;
+        ts.tv_nsec += (long)(g_reclaim_interval % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        while (g_reclaim_stop == 0
+            && pthread_cond_timedwait(&g_reclaim_cond, &g_reclaim_mtx, &ts) != ETIMEDOUT);
+        if (g_reclaim_stop != 0)
+            break;
+        pthread_mutex_unlock(&g_reclaim_mtx);
+
+        /* the tree lock keeps every pool of the walk alive, pool locks are taken per batch. */
+        __atomic_fetch_add(&g_reclaim_tick, 1, __ATOMIC_RELAXED);
+        _elr_lock_acquire(&g_tree_lock);
+        bytes = _elr_mpl_reclaim(&g_mem_pool);
+        _elr_lock_release(&g_tree_lock);
+        bytes += _elr_node_cache_trim(g_reclaim_decay);
+
+        pthread_mutex_lock(&g_reclaim_mtx);
+        g_reclaim_released += bytes;
+    }
+    pthread_mutex_unlock(&g_reclaim_mtx);
+
+    return NULL;
+}
+
+/*
+** Start a thread giving back memory nodes that stay unused for decay_ms milliseconds.
+*/
+ELR_MPL_API int elr_mpl_start_reclaimer(unsigned int decay_ms, unsigned int interval_ms)
+{
+    int    ret = 0;
+
+    if (interval_ms == 0)
+        interval_ms = 1;
+
+    pthread_mutex_lock(&g_reclaim_mtx);
+    if (g_reclaim_running == 0 && __atomic_load_n(&g_mpl_refs, __ATOMIC_ACQUIRE) > 0)
+    {
+        g_reclaim_interval = interval_ms;
+        g_reclaim_decay = (decay_ms + interval_ms - 1) / interval_ms;
+        g_reclaim_stop = 0;
+        g_reclaim_released = 0;
+        if (pthread_create(&g_reclaim_thread, NULL, _elr_reclaim_main, NULL) == 0)
+        {
+            g_reclaim_running = 1;
+            ret = 1;
+        }
+    }
+    pthread_mutex_unlock(&g_reclaim_mtx);
+
+    return ret;
+}
+
+/*
+** Stop the reclaimer thread, returns the bytes it gave back.
+*/
+ELR_MPL_API size_t elr_mpl_stop_reclaimer()
+{
+    size_t  released = 0;
+
+    pthread_mutex_lock(&g_reclaim_mtx);
+    if (g_reclaim_running == 0 || g_reclaim_stop != 0)
+    {
+        released = g_reclaim_released;
+        pthread_mutex_unlock(&g_reclaim_mtx);
+        return released;
+    }
+    g_reclaim_stop = 1;
+    pthread_cond_signal(&g_reclaim_cond);
+    pthread_mutex_unlock(&g_reclaim_mtx);
+
+    pthread_join(g_reclaim_thread, NULL);
+
+    pthread_mutex_lock(&g_reclaim_mtx);
+    g_reclaim_running = 0;
+    released = g_reclaim_released;
+    pthread_mutex_unlock(&g_reclaim_mtx);
+
+    return released;
 }
 
 /*
@@ -744,45 +3391,89 @@ ELR_MPL_API void elr_mpl_destroy(elr_mpl_ht hpool)
 ELR_MPL_API void elr_mpl_finalize()
 {
     long   refs = 1;
-#ifdef USE_THREADLOCK
-    pthread_mutex_lock(&g_mem_pool.pool_mutex);
-#endif
+
+    /* the reference count has its own mutex, g_mem_pool is locked by destory. */
     refs = elr_atomic_dec(&g_mpl_refs);
     if(refs == 0)
     {
-#ifdef USE_THREADLOCK
-        // bug fix, don't lock g_mem_pool.pool_mutex when it going finalize.
-        pthread_mutex_unlock(&g_mem_pool.pool_mutex);
-#endif
+        elr_mpl_stop_reclaimer();
+        _elr_ebr_drop();
         _elr_mpl_destory(&g_mem_pool, 0, 1);
+        _elr_node_cache_trim(0);
+        /* let a later elr_mpl_init create the global multi-size pool again. */
+        g_multi_mem_pool = ELR_MPL_INITIALIZER;
     }
     else
     {
         fprintf( stderr, "refs = elr_atomic_dec(&g_mpl_refs) == %d?\n", refs );
     }
-#ifdef USE_THREADLOCK
-    pthread_mutex_unlock(&g_mem_pool.pool_mutex);
-#endif
 }
 
 void _elr_alloc_mem_node(elr_mem_pool *pool)
 {
-    elr_mem_node* pnode = (elr_mem_node*)malloc(pool->node_size);
-    if(pnode == NULL)
+    elr_mem_node* pnode = NULL;
+
+    /* nodes kept by elr_mpl_reset are used up before asking for memory. */
+    if (pool->fresh_node != NULL)
+    {
+        pool->newly_alloc_node = pool->fresh_node;
+        pool->fresh_node = pool->fresh_node->next;
         return;
+    }
+
+    if (pool->flags & ELR_MPL_BUFFER_POOL)
+    {
+        /* the caller`s buffer is all the memory there is, a used up buffer fails the allocation. */
+        if ((size_t)(pool->buffer_end - pool->buffer_avail) < pool->node_size)
+            return;
+        pnode = (elr_mem_node*)pool->buffer_avail;
+        pool->buffer_avail += pool->node_size;
+    }
+    else
+    {
+        if (_elr_charge(pool, pool->node_size) == 0)
+            return;
+        /* a node left by a destroyed pool is likely still mapped and in cache. */
+        pnode = _elr_node_cache_get(pool->node_size);
+        if (pnode == NULL)
+            pnode = (elr_mem_node*)malloc(pool->node_size);
+        if(pnode == NULL)
+        {
+            _elr_uncharge(pool, pool->node_size);
+            return;
+        }
+    }
 
-	g_occupation_size += pool->node_size;
     pool->newly_alloc_node = pnode;
     pnode->owner = pool;
-    pnode->first_avail = (char*)pnode
-        + ELR_ALIGN(sizeof(elr_mem_node),sizeof(int));
+    pnode->size = pool->node_size;
+    pnode->first_slice = (char*)pnode
+        + ELR_ALIGN(sizeof(elr_mem_node),sizeof(int))
+        + pool->next_color * ELR_CACHE_LINE;
+    if (pool->flags & ELR_MPL_CACHELINE)
+        pnode->first_slice = (char*)(ELR_ALIGN((size_t)pnode->first_slice
+            + ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int)), ELR_CACHE_LINE))
+            - ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int));
+    pnode->first_avail = pnode->first_slice;
+    if (++pool->next_color == pool->color_count)
+        pool->next_color = 0;
 
     pnode->free_slice_head = NULL;
     pnode->free_slice_tail = NULL;
     pnode->used_slice_count = 0;
     pnode->using_slice_count = 0;
+    pnode->idle_since = __atomic_load_n(&g_reclaim_tick, __ATOMIC_RELAXED);
+    pnode->avail_prev = NULL;
+    pnode->avail_next = NULL;
+    pnode->bucket = -1;
+    pnode->index = 0;
+    pnode->first_tag = 0;
+    pnode->carved_slice_count = 0;
     pnode->prev = NULL;
 
+    if (pool->flags & ELR_MPL_HANDLES)
+        _elr_node_table_add(pool, pnode);
+
     if(pool->first_node == NULL)
     {
         pool->first_node = pnode;
@@ -796,9 +3487,98 @@ void _elr_alloc_mem_node(elr_mem_pool *pool)
     }
 }
 
+elr_mem_pool* _elr_multi_refine(elr_mem_pool *pool, size_t bin)
+{
+    elr_mem_pool  *parent_pool = pool->multi[pool->multi_count - 1];
+    elr_mem_pool  *refined = NULL;
+
+    /* refined classes live with the over-range ones, so reset and destroy find them. */
+    if (pool->sync != ELR_SYNC_NONE)
+        _elr_lock_acquire(&pool->multi_mutex);
+    refined = pool->refined_class[bin];
+    if (refined == NULL)
+    {
+        refined = _elr_mpl_create(parent_pool, bin*ELR_HISTOGRAM_UNIT,
+            parent_pool->on_slice_alloc, parent_pool->on_slice_free, pool->flags);
+        if (refined != NULL)
+        {
+            refined->bias_owner = pool->bias_owner;
+            __atomic_store_n(&pool->refined_class[bin], refined, __ATOMIC_RELEASE);
+        }
+    }
+    if (pool->sync != ELR_SYNC_NONE)
+        _elr_lock_release(&pool->multi_mutex);
+
+    return refined;
+}
+
+void _elr_node_destruct(elr_mem_pool *pool, elr_mem_node* pnode)
+{
+    char    *mem = pnode->first_slice + ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int));
+    size_t   i = 0;
+
+    for (i = 0; i < pnode->used_slice_count; i++)
+    {
+        pool->obj_dtor(mem, pool->obj_ctx);
+        mem += pool->slice_size;
+    }
+}
+
+void _elr_node_table_add(elr_mem_pool *pool, elr_mem_node* pnode)
+{
+    elr_mem_node  **table = NULL;
+    int            *tags = NULL;
+    size_t          size = 0;
+    size_t          i = pool->node_table_hint;
+
+    /* reuse the entry of a freed node first. */
+    while (i < pool->node_table_count && pool->node_table[i] != NULL)
+        i++;
+
+    if (i >= (1 << ELR_HANDLE_NODE_BITS))
+        return;
+
+    if (i >= pool->node_table_size)
+    {
+        size = pool->node_table_size == 0 ? ELR_NODE_TABLE_INIT : pool->node_table_size*2;
+        table = (elr_mem_node**)realloc(pool->node_table, size*sizeof(elr_mem_node*));
+        if (table == NULL)
+            return;
+        pool->node_table = table;
+        tags = (int*)realloc(pool->node_table_tag, size*sizeof(int));
+        if (tags == NULL)
+            return;
+        pool->node_table_tag = tags;
+        pool->node_table_size = size;
+    }
+    if (i == pool->node_table_count)
+    {
+        pool->node_table_count++;
+        pool->node_table_tag[i] = 0;
+    }
+
+    pool->node_table[i] = pnode;
+    pool->node_table_hint = i + 1;
+    pnode->index = (unsigned int)i;
+    pnode->first_tag = pool->node_table_tag[i];
+}
+
 /* remove an unused NODE, return 0 for no removal */
 void _elr_free_mem_node(elr_mem_node* pnode)
 {
+    _elr_unlink_mem_node(pnode);
+    if (pnode->owner->obj_dtor != NULL)
+        _elr_node_destruct(pnode->owner, pnode);
+    free(pnode);
+}
+
+/* detach an unused node and its free slices from its pool, the memory is left to the caller */
+void _elr_unlink_mem_node(elr_mem_node* pnode)
+{
+	elr_mem_slice  *slice = NULL;
+	size_t          i = 0;
+	int             tag = pnode->first_tag;
+
 	assert(pnode->using_slice_count == 0);
 
 	if (pnode->free_slice_head != NULL)
@@ -813,9 +3593,33 @@ void _elr_free_mem_node(elr_mem_node* pnode)
                 pnode->owner->first_free_slice = pnode->free_slice_tail->next;
         }
 
+	if (pnode->bucket >= 0)
+		_elr_bucket_remove(pnode->owner, pnode);
+
+	if (pnode->index != 0)
+	{
+		/* the next node of the entry starts above every generation handed out for it, so old handles stay stale. */
+		for (i = 0; i < pnode->carved_slice_count; i++)
+		{
+			slice = (elr_mem_slice*)(pnode->first_slice + i*pnode->owner->slice_size);
+			if (slice->tag > tag)
+				tag = slice->tag;
+		}
+		pnode->owner->node_table_tag[pnode->index] = (tag + 1) & ~1;
+		pnode->owner->node_table[pnode->index] = NULL;
+		if (pnode->index < pnode->owner->node_table_hint)
+			pnode->owner->node_table_hint = pnode->index;
+	}
+
 	if (pnode->owner->newly_alloc_node == pnode)
 		pnode->owner->newly_alloc_node = NULL;
 
+	if (pnode->owner->fresh_node == pnode)
+		pnode->owner->fresh_node = pnode->next;
+
+	if (pnode->owner->reclaim_cursor == pnode)
+		pnode->owner->reclaim_cursor = pnode->next;
+
     if(pnode->next != NULL)
         pnode->next->prev = pnode->prev;
 
@@ -824,25 +3628,36 @@ void _elr_free_mem_node(elr_mem_node* pnode)
     else
                 pnode->owner->first_node = pnode->next;
 
-	g_occupation_size -= pnode->owner->node_size;
-    free(pnode);
+	_elr_uncharge(pnode->owner, pnode->size);
 }
 
 elr_mem_slice* _elr_slice_from_node(elr_mem_pool *pool)
 {
     elr_mem_slice *pslice = NULL;
+    elr_mem_node  *pnode = pool->newly_alloc_node;
+    int            tag = 0;
 
-    if(pool->newly_alloc_node != NULL)
+    if(pnode != NULL)
     {
-        pool->newly_alloc_node->used_slice_count++;
-        pool->newly_alloc_node->using_slice_count++;
-        pslice = (elr_mem_slice*)pool->newly_alloc_node->first_avail;
+        pslice = (elr_mem_slice*)pnode->first_avail;
+        /* a slice carved before a reset keeps counting, its old handles must not match the new block. */
+        if (pnode->used_slice_count < pnode->carved_slice_count)
+            tag = pslice->tag;
+        else
+        {
+            tag = pnode->first_tag;
+            pnode->carved_slice_count++;
+        }
+        pnode->used_slice_count++;
+        pnode->using_slice_count++;
         memset(pslice,0,pool->slice_size);
         pslice->next = NULL;
         pslice->prev = NULL;
-		pslice->tag++;
+		pslice->tag = (tag + 1) | 1;
         pool->newly_alloc_node->first_avail += pool->slice_size;
         pslice->node = pool->newly_alloc_node;
+        if (pool->obj_ctor != NULL)
+            pool->obj_ctor((char*)pslice + ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int)), pool->obj_ctx);
         
         if(pool->newly_alloc_node->used_slice_count == pool->slice_count)
             pool->newly_alloc_node = NULL;
@@ -851,25 +3666,37 @@ elr_mem_slice* _elr_slice_from_node(elr_mem_pool *pool)
     return pslice;
 }
 
-/*
-** Allocate memory from the memory pool.
-*/
-elr_mem_slice* _elr_slice_from_pool(elr_mem_pool* pool)
-
+/*Take a slice from the pool, the caller holds the pool*/
+static inline elr_mem_slice* _elr_slice_take(elr_mem_pool* pool)
 {
     elr_mem_slice *slice = NULL;
+    elr_mem_node  *node = NULL;
+    int            b = 0;
 
-    if ( pool == NULL )
+    if (pool->capacity != 0 && pool->using_count >= pool->capacity)
         return NULL;
 
-#ifdef DEBUG
-    assert(pool != NULL);
-#endif
-#ifdef USE_THREADLOCK
-    if (pool->sync == 1)
-        pthread_mutex_lock(&pool->pool_mutex);
-#endif
-    if(pool->first_free_slice != NULL)
+    if (pool->flags & ELR_MPL_FULLEST_FIRST)
+    {
+        /* the fullest node with a free slice, emptier nodes get the chance to drain. */
+        for (b = ELR_OCCUPANCY_BUCKETS - 1; b >= 0 && node == NULL; b--)
+            node = pool->avail_bucket[b];
+        if (node != NULL)
+        {
+            slice = node->free_slice_head;
+            node->free_slice_head = slice->next;
+            if (node->free_slice_head != NULL)
+                node->free_slice_head->prev = NULL;
+            else
+                node->free_slice_tail = NULL;
+            slice->next = NULL;
+            slice->prev = NULL;
+            slice->tag++;
+            node->using_slice_count++;
+            _elr_bucket_place(pool, node);
+        }
+    }
+    else if(pool->first_free_slice != NULL)
     {
         slice = pool->first_free_slice;
 		pool->first_free_slice = slice->next;
@@ -889,7 +3716,8 @@ elr_mem_slice* _elr_slice_from_pool(elr_mem_pool* pool)
 		slice->tag++;
 		slice->node->using_slice_count++;
     }
-    else
+
+    if (slice == NULL)
     {
         if(pool->newly_alloc_node == NULL)
             _elr_alloc_mem_node(pool);
@@ -898,32 +3726,591 @@ elr_mem_slice* _elr_slice_from_pool(elr_mem_pool* pool)
 
 	if (slice != NULL)
     {
+		pool->using_count++;
 		slice->prev = NULL;
 		slice->next = pool->first_occupied_slice;
         if (pool->first_occupied_slice != NULL)
 			pool->first_occupied_slice->prev = slice;
 		pool->first_occupied_slice = slice;
     }
-#ifdef USE_THREADLOCK
-    if (pool->sync == 1)
-        pthread_mutex_unlock(&pool->pool_mutex);
-#endif
+
+	return slice;
+}
+
+/*
+** Allocate memory from the memory pool.
+*/
+elr_mem_slice* _elr_slice_from_pool(elr_mem_pool* pool)
+{
+    elr_mem_slice *slice = NULL;
+    int            entered = 0;
+
+    if ( pool == NULL )
+        return NULL;
+
+    /* an unsynchronized pool goes straight to the list work. */
+    if (pool->sync == ELR_SYNC_NONE)
+        return _elr_slice_take(pool);
+
+    entered = _elr_pool_lock(pool);
+    slice = _elr_slice_take(pool);
+    _elr_pool_unlock(pool, entered);
 	return slice;
 }
 
 
+elr_mem_node* _elr_arena_grow(elr_mem_pool *pool, size_t size)
+{
+    elr_mem_node  *pnode = NULL;
+    size_t         need = ELR_ALIGN(sizeof(elr_mem_node),ELR_ARENA_ALIGN) + size;
+
+    /* a block larger than a node gets a node of its own. */
+    if (need <= pool->node_size && pool->spare_node != NULL)
+    {
+        pnode = pool->spare_node;
+        pool->spare_node = pnode->next;
+    }
+    else
+    {
+        need = need > pool->node_size ? need : pool->node_size;
+        if (_elr_charge(pool, need) == 0)
+            return NULL;
+        pnode = _elr_node_cache_get(need);
+        if (pnode == NULL)
+            pnode = (elr_mem_node*)malloc(need);
+        if (pnode == NULL)
+        {
+            _elr_uncharge(pool, need);
+            return NULL;
+        }
+        pnode->size = need;
+    }
+
+    pnode->owner = pool;
+    pnode->first_avail = (char*)pnode
+        + ELR_ALIGN(sizeof(elr_mem_node),ELR_ARENA_ALIGN);
+    pnode->first_slice = pnode->first_avail;
+    pnode->free_slice_head = NULL;
+    pnode->free_slice_tail = NULL;
+    pnode->used_slice_count = 0;
+    pnode->using_slice_count = 0;
+    pnode->index = 0;
+    pnode->carved_slice_count = 0;
+
+    /* newest node is always the head, so rollback pops nodes from the head. */
+    pnode->prev = NULL;
+    pnode->next = pool->first_node;
+    if (pool->first_node != NULL)
+        pool->first_node->prev = pnode;
+    pool->first_node = pnode;
+    pool->newly_alloc_node = pnode;
+
+    return pnode;
+}
+
+void _elr_arena_rollback(elr_mem_pool *pool, elr_mem_node *node, char *avail)
+{
+    elr_mem_node  *temp_node = NULL;
+
+    while ((temp_node = pool->first_node) != NULL && temp_node != node)
+    {
+        pool->first_node = temp_node->next;
+        if (temp_node->size == pool->node_size)
+        {
+            temp_node->idle_since = __atomic_load_n(&g_reclaim_tick, __ATOMIC_RELAXED);
+            temp_node->next = pool->spare_node;
+            pool->spare_node = temp_node;
+        }
+        else
+        {
+            _elr_uncharge(pool, temp_node->size);
+            free(temp_node);
+        }
+    }
+
+    if (pool->first_node != NULL)
+        pool->first_node->prev = NULL;
+
+    pool->newly_alloc_node = node;
+    if (node != NULL)
+        node->first_avail = avail;
+}
+
+void _elr_mpl_reset(elr_mem_pool *pool)
+{
+    elr_mem_slice  *temp_slice = NULL;
+    elr_mem_node   *temp_node = NULL;
+    int             entered = 0;
+
+    entered = _elr_pool_lock(pool);
+    if (pool->on_slice_free != NULL)
+    {
+        temp_slice = pool->first_occupied_slice;
+        while(temp_slice != NULL)
+        {
+            pool->on_slice_free((char*)temp_slice 
+                + ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int)));
+            temp_slice = temp_slice->next;
+        }
+    }
+
+    /* slices are carved again from the rewound nodes, nothing is touched per slice. */
+    temp_node = pool->first_node;
+    while(temp_node != NULL)
+    {
+        /* carving constructs again, so cached objects are destructed first. */
+        if (pool->obj_dtor != NULL)
+            _elr_node_destruct(pool, temp_node);
+        temp_node->first_avail = temp_node->first_slice;
+        temp_node->free_slice_head = NULL;
+        temp_node->free_slice_tail = NULL;
+        temp_node->used_slice_count = 0;
+        temp_node->using_slice_count = 0;
+        temp_node->idle_since = __atomic_load_n(&g_reclaim_tick, __ATOMIC_RELAXED);
+        temp_node->avail_prev = NULL;
+        temp_node->avail_next = NULL;
+        temp_node->bucket = -1;
+        temp_node = temp_node->next;
+    }
+
+    pool->first_free_slice = NULL;
+    memset(pool->avail_bucket, 0, sizeof(pool->avail_bucket));
+    pool->first_occupied_slice = NULL;
+    pool->using_count = 0;
+    pool->newly_alloc_node = NULL;
+    pool->fresh_node = pool->first_node;
+    _elr_pool_unlock(pool, entered);
+
+    if (__atomic_load_n(&pool->capacity, __ATOMIC_RELAXED) != 0)
+        _elr_wake_waiters(pool, 0x7fffffff);
+}
+
+size_t _elr_mpl_reclaim(elr_mem_pool *pool)
+{
+    elr_mem_pool   *child_pool = NULL;
+    elr_mem_node   *temp_node = NULL;
+    elr_mem_node   *next_node = NULL;
+    elr_mem_node   *released = NULL;
+    elr_mem_node  **link = NULL;
+    unsigned long   tick = __atomic_load_n(&g_reclaim_tick, __ATOMIC_RELAXED);
+    size_t          bytes = 0;
+    size_t          batch = 0;
+    size_t          i = 0;
+    int             more = 1;
+    int             entered = 0;
+
+    /* an unsynchronized pool can not be touched from here, neither can a biased one its owner still runs unlocked.
+       the nodes of a buffer pool belong to the caller. */
+    if ((pool->flags & ELR_MPL_BUFFER_POOL) == 0
+        && (pool->sync == ELR_SYNC_LOCK
+        || (pool->sync == ELR_SYNC_BIASED && __atomic_load_n(&pool->bias_revoked, __ATOMIC_ACQUIRE) != 0)))
+    {
+        while (more != 0)
+        {
+            entered = _elr_pool_lock(pool);
+            if (pool->flags & ELR_MPL_ARENA_POOL)
+            {
+                /* an arena hands out its nodes as a whole, only the spare ones can go. */
+                link = &pool->spare_node;
+                while ((temp_node = *link) != NULL)
+                {
+                    if (tick - temp_node->idle_since >= g_reclaim_decay)
+                    {
+                        *link = temp_node->next;
+                        _elr_uncharge(pool, temp_node->size);
+                        temp_node->next = released;
+                        released = temp_node;
+                    }
+                    else
+                        link = &temp_node->next;
+                }
+                more = 0;
+            }
+            else
+            {
+                /* resume where the previous batch stopped, nodes unlinked in between move the cursor on. */
+                temp_node = (batch++ == 0) ? pool->first_node : pool->reclaim_cursor;
+                for (i = 0; i < ELR_RECLAIM_BATCH && temp_node != NULL; i++)
+                {
+                    next_node = temp_node->next;
+                    if (temp_node->using_slice_count == 0
+                        && tick - temp_node->idle_since >= g_reclaim_decay)
+                    {
+                        _elr_unlink_mem_node(temp_node);
+                        temp_node->next = released;
+                        released = temp_node;
+                    }
+                    temp_node = next_node;
+                }
+                pool->reclaim_cursor = temp_node;
+                more = (temp_node != NULL);
+            }
+            _elr_pool_unlock(pool, entered);
+
+            /* free outside the lock. */
+            while ((temp_node = released) != NULL)
+            {
+                released = temp_node->next;
+                bytes += temp_node->size;
+                if (pool->obj_dtor != NULL)
+                    _elr_node_destruct(pool, temp_node);
+                free(temp_node);
+            }
+        }
+    }
+
+    child_pool = pool->first_child;
+    while (child_pool != NULL)
+    {
+        bytes += _elr_mpl_reclaim(child_pool);
+        child_pool = child_pool->next;
+    }
+
+    return bytes;
+}
+
+/*Order nodes from the emptiest to the fullest*/
+static int _elr_node_using_cmp(const void* a, const void* b)
+{
+    size_t  using_a = (*(elr_mem_node* const*)a)->using_slice_count;
+    size_t  using_b = (*(elr_mem_node* const*)b)->using_slice_count;
+
+    return using_a < using_b ? -1 : (using_a > using_b ? 1 : 0);
+}
+
+/*Take a free slice of a given node of the pool, the caller holds the pool and knows the node has one*/
+static elr_mem_slice* _elr_node_take_free(elr_mem_pool* pool, elr_mem_node* node)
+{
+    elr_mem_slice  *slice = node->free_slice_head;
+
+    if (pool->flags & ELR_MPL_FULLEST_FIRST)
+    {
+        node->free_slice_head = slice->next;
+        if (node->free_slice_head != NULL)
+            node->free_slice_head->prev = NULL;
+    }
+    else
+    {
+        /* the slices of a node are a run of the pool`s free list. */
+        node->free_slice_head = (slice == node->free_slice_tail) ? NULL : slice->next;
+        if (slice->prev != NULL)
+            slice->prev->next = slice->next;
+        else
+            pool->first_free_slice = slice->next;
+        if (slice->next != NULL)
+            slice->next->prev = slice->prev;
+    }
+    if (node->free_slice_head == NULL)
+        node->free_slice_tail = NULL;
+
+    slice->tag++;
+    node->using_slice_count++;
+    pool->using_count++;
+    if (pool->flags & ELR_MPL_FULLEST_FIRST)
+        _elr_bucket_place(pool, node);
+
+    slice->prev = NULL;
+    slice->next = pool->first_occupied_slice;
+    if (pool->first_occupied_slice != NULL)
+        pool->first_occupied_slice->prev = slice;
+    pool->first_occupied_slice = slice;
+
+    return slice;
+}
+
+size_t _elr_mpl_compact(elr_mem_pool *pool, elr_mpl_relocate relocate, void *ctx)
+{
+    elr_mem_node  **nodes = NULL;
+    elr_mem_node   *temp_node = NULL;
+    elr_mem_node   *target = NULL;
+    elr_mem_slice  *from = NULL;
+    elr_mem_slice  *to = NULL;
+    size_t          head = ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int));
+    size_t          count = 0;
+    size_t          room = 0;
+    size_t          bytes = 0;
+    size_t          i = 0;
+    size_t          j = 0;
+    size_t          k = 0;
+    int             entered = 0;
+
+    /* arena blocks have no slices, buffer nodes are never given back, cached objects can`t be moved by a copy. */
+    if ((pool->flags & (ELR_MPL_ARENA_POOL | ELR_MPL_BUFFER_POOL))
+        || pool->obj_ctor != NULL || pool->obj_dtor != NULL)
+        return 0;
+
+    entered = _elr_pool_lock(pool);
+    /* retired blocks are still referenced by the retire lists, moving them would free them twice. */
+    if (__atomic_load_n(&pool->retired_count, __ATOMIC_ACQUIRE) != 0)
+    {
+        _elr_pool_unlock(pool, entered);
+        return 0;
+    }
+    for (temp_node = pool->first_node; temp_node != NULL; temp_node = temp_node->next)
+        count++;
+    if (count == 0)
+    {
+        _elr_pool_unlock(pool, entered);
+        return 0;
+    }
+    nodes = (elr_mem_node**)malloc(count*sizeof(elr_mem_node*));
+    if (nodes == NULL)
+    {
+        _elr_pool_unlock(pool, entered);
+        return 0;
+    }
+    for (temp_node = pool->first_node; temp_node != NULL; temp_node = temp_node->next)
+    {
+        nodes[i++] = temp_node;
+        room += temp_node->used_slice_count - temp_node->using_slice_count;
+    }
+    qsort(nodes, count, sizeof(elr_mem_node*), _elr_node_using_cmp);
+
+    /* room counts the free slices of the nodes fuller than the one being emptied, filled from the fullest down. */
+    j = count;
+    for (i = 0; i < count; i++)
+    {
+        temp_node = nodes[i];
+        room -= temp_node->used_slice_count - temp_node->using_slice_count;
+        if (temp_node->using_slice_count > room)
+            break;
+
+        for (k = 0; k < temp_node->used_slice_count && temp_node->using_slice_count > 0; k++)
+        {
+            from = (elr_mem_slice*)(temp_node->first_slice + k*pool->slice_size);
+            if ((from->tag & 1) == 0)
+                continue;
+
+            while (nodes[j - 1]->free_slice_head == NULL)
+                j--;
+            target = nodes[j - 1];
+            to = _elr_node_take_free(pool, target);
+            memcpy((char*)to + head, (char*)from + head, pool->object_size);
+            to->refs = from->refs;
+            relocate((char*)from + head, (char*)to + head, ctx);
+            room--;
+
+            /* the old slice goes with its node, it needs no place in a free list. */
+            from->tag++;
+            from->refs = 0;
+            temp_node->using_slice_count--;
+            pool->using_count--;
+            if (from->next != NULL)
+                from->next->prev = from->prev;
+            if (from->prev != NULL)
+                from->prev->next = from->next;
+            else
+                pool->first_occupied_slice = from->next;
+        }
+
+        bytes += temp_node->size;
+        _elr_free_mem_node(temp_node);
+    }
+    _elr_pool_unlock(pool, entered);
+    free(nodes);
+
+    return bytes;
+}
+
+/*Order nodes by address*/
+static int _elr_node_addr_cmp(const void* a, const void* b)
+{
+    const elr_mem_node  *node_a = *(elr_mem_node* const*)a;
+    const elr_mem_node  *node_b = *(elr_mem_node* const*)b;
+
+    return node_a < node_b ? -1 : (node_a > node_b ? 1 : 0);
+}
+
+/*Visit the allocated slices of one node in address order, prefetching the slices ahead*/
+static size_t _elr_node_foreach(elr_mem_pool* pool, elr_mem_node* node,
+    elr_mpl_visit visit, elr_mpl_visit_batch visit_batch, void* ctx)
+{
+    elr_mem_slice  *slice = NULL;
+    void*           batch[ELR_VISIT_BATCH];
+    size_t          head = ELR_ALIGN(sizeof(elr_mem_slice),sizeof(int));
+    size_t          used = node->used_slice_count;
+    size_t          count = 0;
+    size_t          filled = 0;
+    size_t          i = 0;
+
+    for (i = 0; i < ELR_PREFETCH_SLICES && i < used; i++)
+        __builtin_prefetch(node->first_slice + i*pool->slice_size);
+
+    for (i = 0; i < used && count < node->using_slice_count; i++)
+    {
+        if (i + ELR_PREFETCH_SLICES < used)
+            __builtin_prefetch(node->first_slice + (i + ELR_PREFETCH_SLICES)*pool->slice_size);
+
+        slice = (elr_mem_slice*)(node->first_slice + i*pool->slice_size);
+        if ((slice->tag & 1) == 0)
+            continue;
+        count++;
+
+        if (visit != NULL)
+        {
+            visit((char*)slice + head, ctx);
+            continue;
+        }
+        batch[filled++] = (char*)slice + head;
+        if (filled == ELR_VISIT_BATCH)
+        {
+            visit_batch(batch, filled, ctx);
+            filled = 0;
+        }
+    }
+    if (filled > 0)
+        visit_batch(batch, filled, ctx);
+
+    return count;
+}
+
+size_t _elr_mpl_foreach(elr_mem_pool *pool, elr_mpl_visit visit, elr_mpl_visit_batch visit_batch, void *ctx)
+{
+    elr_mem_node  **nodes = NULL;
+    elr_mem_node   *temp_node = NULL;
+    size_t          node_count = 0;
+    size_t          count = 0;
+    size_t          i = 0;
+    int             entered = 0;
+
+    /* arena blocks are not tracked one by one. */
+    if (pool->flags & ELR_MPL_ARENA_POOL)
+        return 0;
+
+    entered = _elr_pool_lock(pool);
+    for (temp_node = pool->first_node; temp_node != NULL; temp_node = temp_node->next)
+        node_count++;
+    if (node_count == 0)
+    {
+        _elr_pool_unlock(pool, entered);
+        return 0;
+    }
+
+    /* without room for sorting the nodes are swept in list order. */
+    nodes = (elr_mem_node**)malloc(node_count*sizeof(elr_mem_node*));
+    if (nodes == NULL)
+    {
+        for (temp_node = pool->first_node; temp_node != NULL; temp_node = temp_node->next)
+            count += _elr_node_foreach(pool, temp_node, visit, visit_batch, ctx);
+    }
+    else
+    {
+        for (temp_node = pool->first_node; temp_node != NULL; temp_node = temp_node->next)
+            nodes[i++] = temp_node;
+        qsort(nodes, node_count, sizeof(elr_mem_node*), _elr_node_addr_cmp);
+        for (i = 0; i < node_count; i++)
+        {
+            if (nodes[i]->using_slice_count > 0)
+                count += _elr_node_foreach(pool, nodes[i], visit, visit_batch, ctx);
+        }
+        free(nodes);
+    }
+    _elr_pool_unlock(pool, entered);
+
+    return count;
+}
+
+void _elr_mpl_dump(elr_mem_pool *pool, elr_dump_buf *buf)
+{
+    elr_mem_pool   *child_pool = NULL;
+    elr_mem_node   *temp_node = NULL;
+    elr_mem_slice  *temp_slice = NULL;
+    size_t          nodes = 0;
+    size_t          free_count = 0;
+    size_t          i = 0;
+    int             digit = 0;
+    int             entered = 0;
+    int             walk = 1;
+
+    /* locking a biased pool from another thread revokes its bias for good, only its owner walks it. */
+    if (pool->sync == ELR_SYNC_BIASED && __atomic_load_n(&pool->bias_revoked, __ATOMIC_ACQUIRE) == 0)
+    {
+        entered = ELR_SYNC_BIASED;
+        walk = _elr_bias_enter(pool);
+    }
+    else
+    {
+        entered = _elr_pool_lock(pool);
+    }
+
+    if (walk == 0)
+    {
+        _elr_dump_printf(buf, "{\"pool\":\"%p\",\"parent\":\"%p\",\"flags\":%d,\"object_size\":%zu,"
+            "\"slice_size\":%zu,\"slice_count\":%zu,\"node_size\":%zu,\"biased\":1,\"charged\":%zu}\n",
+            (void*)pool, (void*)pool->parent, pool->flags, pool->object_size, pool->slice_size,
+            pool->slice_count, pool->node_size, __atomic_load_n(&pool->charged, __ATOMIC_RELAXED));
+    }
+    else
+    {
+        for (temp_node = pool->first_node; temp_node != NULL; temp_node = temp_node->next)
+            nodes++;
+        _elr_dump_printf(buf, "{\"pool\":\"%p\",\"parent\":\"%p\",\"flags\":%d,\"object_size\":%zu,"
+            "\"slice_size\":%zu,\"slice_count\":%zu,\"node_size\":%zu,\"nodes\":%zu,\"using\":%zu,\"charged\":%zu}\n",
+            (void*)pool, (void*)pool->parent, pool->flags, pool->object_size, pool->slice_size,
+            pool->slice_count, pool->node_size, nodes, pool->using_count,
+            __atomic_load_n(&pool->charged, __ATOMIC_RELAXED));
+
+        for (temp_node = pool->first_node; temp_node != NULL; temp_node = temp_node->next)
+        {
+            /* arena nodes have no slices, the bytes cut so far tell their occupancy. */
+            if (pool->flags & ELR_MPL_ARENA_POOL)
+            {
+                _elr_dump_printf(buf, "{\"node\":\"%p\",\"pool\":\"%p\",\"size\":%zu,\"bytes\":%zu}\n",
+                    (void*)temp_node, (void*)pool, temp_node->size,
+                    (size_t)(temp_node->first_avail - temp_node->first_slice));
+                continue;
+            }
+
+            free_count = 0;
+            for (temp_slice = temp_node->free_slice_head; temp_slice != NULL; temp_slice = temp_slice->next)
+            {
+                free_count++;
+                if (temp_slice == temp_node->free_slice_tail)
+                    break;
+            }
+
+            /* one hex digit per four slices, slice 0 in the highest bit of the first digit. */
+            _elr_dump_printf(buf, "{\"node\":\"%p\",\"pool\":\"%p\",\"size\":%zu,\"used\":%zu,"
+                "\"using\":%zu,\"free\":%zu,\"map\":\"",
+                (void*)temp_node, (void*)pool, temp_node->size, temp_node->used_slice_count,
+                temp_node->using_slice_count, free_count);
+            digit = 0;
+            for (i = 0; i < temp_node->used_slice_count; i++)
+            {
+                temp_slice = (elr_mem_slice*)(temp_node->first_slice + i*pool->slice_size);
+                digit = (digit << 1) | (temp_slice->tag & 1);
+                if ((i & 3) == 3 || i + 1 == temp_node->used_slice_count)
+                {
+                    _elr_dump_printf(buf, "%x", digit << (3 - (i & 3)));
+                    digit = 0;
+                }
+            }
+            _elr_dump_printf(buf, "\"}\n");
+        }
+        _elr_pool_unlock(pool, entered);
+    }
+
+    child_pool = pool->first_child;
+    while (child_pool != NULL)
+    {
+        _elr_mpl_dump(child_pool, buf);
+        child_pool = child_pool->next;
+    }
+}
+
 void _elr_mpl_destory(elr_mem_pool *pool, int inner, int lock_this)
 {
     elr_mem_pool   *temp_pool = NULL;
     elr_mem_node  *temp_node = NULL;
-    size_t                  index = 0;
-#ifdef USE_THREADLOCK
-	if (inner == 1 && lock_this == 1 && pool->sync == 1)
-        pthread_mutex_lock(&(pool->pool_mutex));
-        
-	if (inner == 0 && pool->parent != NULL && pool->parent->sync == 1)
-		pthread_mutex_lock(&(pool->parent->pool_mutex));
-#endif
+    int                     entered = ELR_SYNC_NONE;
+    int                     parent_entered = ELR_SYNC_NONE;
+
+    /* the reclaimer walks the tree with g_tree_lock held, it never sees a pool being destroyed. */
+    assert(g_in_limit_callback == 0);
+    _elr_lock_acquire(&g_tree_lock);
+	if (inner == 0 && pool->parent != NULL)
+		parent_entered = _elr_pool_lock(pool->parent);
+
 	if (pool->next != NULL)
 		pool->next->prev = pool->prev;
     
@@ -932,23 +4319,23 @@ void _elr_mpl_destory(elr_mem_pool *pool, int inner, int lock_this)
 
 	if (pool->prev == NULL && pool->parent != NULL)
 		pool->parent->first_child = pool->next;
-#ifdef USE_THREADLOCK
-	if (inner == 0 && pool->parent != NULL && pool->parent->sync == 1)
-	    pthread_mutex_unlock(&(pool->parent->pool_mutex));
-#endif
+	if (inner == 0 && pool->parent != NULL)
+	    _elr_pool_unlock(pool->parent, parent_entered);
+    _elr_lock_release(&g_tree_lock);
+
     while((temp_pool = pool->first_child) != NULL)
     {
 		_elr_mpl_destory(temp_pool, 1, lock_this);
 	}
-#ifdef USE_THREADLOCK
-	if (pool->sync == 1)
-	{
-		if (inner == 1 && lock_this == 1)
-			pthread_mutex_unlock(&(pool->pool_mutex));
-		pthread_mutex_destroy(&pool->pool_mutex);
-        pool->sync = 0;
+
+    /* wait for an operation still running on the pool. */
+	if (inner == 1 && lock_this == 1)
+    {
+        entered = _elr_pool_lock(pool);
+	    _elr_pool_unlock(pool, entered);
     }
-#endif
+    pool->sync = ELR_SYNC_NONE;
+
     if (pool->on_slice_free != NULL)
     {
         elr_mem_slice* temp_slice = pool->first_occupied_slice;
@@ -961,26 +4348,112 @@ void _elr_mpl_destory(elr_mem_pool *pool, int inner, int lock_this)
         }       
     }
     
+    /* the buffer of a buffer pool is left to the caller. */
+    if (pool->flags & ELR_MPL_BUFFER_POOL)
+        pool->first_node = NULL;
+
     temp_node = pool->first_node;
     while(temp_node != NULL)
     {       
         pool->first_node = temp_node->next;
-        free(temp_node);
+        _elr_uncharge(pool, temp_node->size);
+        if (pool->obj_dtor != NULL)
+            _elr_node_destruct(pool, temp_node);
+        if (_elr_node_cache_put(temp_node) == 0)
+            free(temp_node);
         temp_node = pool->first_node ;
     }
 
+    temp_node = pool->spare_node;
+    while(temp_node != NULL)
+    {
+        pool->spare_node = temp_node->next;
+        _elr_uncharge(pool, temp_node->size);
+        if (_elr_node_cache_put(temp_node) == 0)
+            free(temp_node);
+        temp_node = pool->spare_node;
+    }
+
+    free(pool->node_table);
+    pool->node_table = NULL;
+    free(pool->node_table_tag);
+    pool->node_table_tag = NULL;
+    free(pool->size_histogram);
+    pool->size_histogram = NULL;
+    free(pool->refined_class);
+    pool->refined_class = NULL;
+
 	pool->parent = NULL;
 	pool->slice_tag = -1;
-#ifdef USE_THREADLOCK
-    if (inner == 1 && lock_this == 1 && pool->sync == 1)
-        pthread_mutex_unlock(&pool->pool_mutex);
-#endif
+
 	if(pool != g_multi_mem_pool.pool && pool->multi != NULL)
-		elr_mpl_free(pool->multi);
+		_elr_mpl_free(pool->multi);
     
 	/* free if not the root node */
     if(pool != &g_mem_pool)
     {
-        elr_mpl_free(pool);
+        _elr_mpl_free(pool);
     }
 }
+
+void* _elr_mapped_create(int fd, size_t obj_size, size_t obj_count)
+{
+	elr_mapped_header  *hdr = NULL;
+	size_t              slice_size = 0;
+	size_t              first_slice = 0;
+	size_t              map_size = 0;
+
+	slice_size = ELR_ALIGN(sizeof(elr_mapped_slice),ELR_MAPPED_ALIGN)
+		+ ELR_ALIGN(obj_size,ELR_MAPPED_ALIGN);
+	first_slice = ELR_ALIGN(sizeof(elr_mapped_header),ELR_MAPPED_ALIGN);
+	/* the file size must not wrap, nor pass what off_t holds. */
+	if (obj_size > (size_t)SSIZE_MAX
+		|| obj_count > ((size_t)SSIZE_MAX - first_slice) / slice_size)
+		return NULL;
+	map_size = first_slice + slice_size*obj_count;
+
+	if (ftruncate(fd, (off_t)map_size) != 0)
+		return NULL;
+	hdr = (elr_mapped_header*)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == (elr_mapped_header*)MAP_FAILED)
+		return NULL;
+
+	/* a fresh file reads as zeros, so the slices need no touching. */
+	hdr->version = ELR_MAPPED_VERSION;
+	hdr->map_size = map_size;
+	hdr->object_size = obj_size;
+	hdr->slice_size = slice_size;
+	hdr->first_slice = first_slice;
+	hdr->first_free = 0;
+	hdr->first_avail = first_slice;
+	hdr->using_count = 0;
+	hdr->root = 0;
+	_elr_lock_init(&hdr->lock, 1);
+	hdr->lock.shared = 1;
+	/* attachers check the magic, it is set when the rest is in place. */
+	__atomic_store_n(&hdr->magic, ELR_MAPPED_MAGIC, __ATOMIC_RELEASE);
+
+	return hdr;
+}
+
+void* _elr_mapped_attach(int fd)
+{
+	elr_mapped_header  *hdr = NULL;
+	struct stat         st;
+
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(elr_mapped_header))
+		return NULL;
+	hdr = (elr_mapped_header*)mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == (elr_mapped_header*)MAP_FAILED)
+		return NULL;
+
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != ELR_MAPPED_MAGIC
+		|| hdr->version != ELR_MAPPED_VERSION
+		|| hdr->map_size != (size_t)st.st_size)
+	{
+		munmap(hdr, (size_t)st.st_size);
+		return NULL;
+	}
+
+	return hdr;
+}
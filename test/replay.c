@@ -0,0 +1,553 @@
+/*! \file replay.c.
+ *  \brief plays back an allocation trace recorded by elr_mpl_trace_start.
+ *
+ *  replay [-f flags] [-c size,size,...] trace
+ *      -f  creation flags of every replayed pool instead of the recorded ones.
+ *      -c  object sizes of the classes of every replayed multi-size pool
+ *          instead of the recorded ones. multi-size pools with no class
+ *          records, like those of version 1 traces, get these or the
+ *          classes of the global multi-size pool.
+ *
+ *  the records are sorted by time and played back in one thread, every
+ *  replayed pool is a child of one root pool. pools the trace uses but
+ *  did not create are created when first used, recorded arena pools are
+ *  created as arena pools to keep their children. reports the calls per
+ *  second, the peak resident set size and the fragmentation, the share
+ *  of the bytes of memory nodes not holding requested bytes, at the
+ *  peak of the charged bytes sampled after every call and at the end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <elr_mpl_posix.h>
+
+#define MAX_CLASSES      64
+
+/*! \brief a pool or memory block of the trace and what replays it.
+ *
+ *  for a pool mem is its elr_mpl_t and owner the parent pool, for a
+ *  memory block mem is the replayed block and owner its pool.
+ */
+typedef struct __replay_entry
+{
+    unsigned long long  key;
+    void*               mem;
+    unsigned long long  owner;
+    size_t              size;
+}
+replay_entry;
+
+/*! \brief open addressing table of entries keyed by recorded address.
+ */
+typedef struct __replay_table
+{
+    replay_entry*  slots;
+    size_t         size;
+    size_t         used;
+}
+replay_table;
+
+/*! \brief record of version 1 and 2 traces, flags had 8 bits then.
+ */
+typedef struct __replay_record_v2
+{
+    unsigned long long  time;
+    unsigned long long  object;
+    unsigned long long  pool;
+    unsigned int        size;
+    unsigned short      thread;
+    unsigned char       op;
+    unsigned char       flags;
+}
+replay_record_v2;
+
+#define EMPTY_KEY    0ULL
+#define DELETED_KEY  (~0ULL)
+
+static size_t          g_class_count = 0;
+static size_t          g_class_size[MAX_CLASSES];
+/*Set by -c, the recorded classes are ignored then*/
+static int             g_class_forced = 0;
+static int             g_flags = -1;
+static elr_mpl_t       g_root;
+static replay_table    g_pools;
+static replay_table    g_objects;
+static size_t          g_live = 0;
+
+static size_t hash_key(unsigned long long key, size_t size)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (size_t)key & (size - 1);
+}
+
+static replay_entry* table_find(replay_table* table, unsigned long long key)
+{
+    size_t  i = 0;
+
+    if (table->size == 0)
+        return NULL;
+    for (i = hash_key(key, table->size); table->slots[i].key != EMPTY_KEY; i = (i + 1) & (table->size - 1))
+    {
+        if (table->slots[i].key == key)
+            return &table->slots[i];
+    }
+    return NULL;
+}
+
+static replay_entry* table_insert(replay_table* table, unsigned long long key);
+
+/*Rebuild the table without its deleted slots, twice as large unless most slots were deleted*/
+static void table_grow(replay_table* table)
+{
+    replay_table  old = *table;
+    size_t        live = 0;
+    size_t        i = 0;
+
+    for (i = 0; i < old.size; i++)
+    {
+        if (old.slots[i].key != EMPTY_KEY && old.slots[i].key != DELETED_KEY)
+            live++;
+    }
+    table->size = old.size == 0 ? 1024 : (live*10 < old.size*3 ? old.size : old.size*2);
+    table->used = 0;
+    table->slots = (replay_entry*)calloc(table->size, sizeof(replay_entry));
+    if (table->slots == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < old.size; i++)
+    {
+        if (old.slots[i].key != EMPTY_KEY && old.slots[i].key != DELETED_KEY)
+            *table_insert(table, old.slots[i].key) = old.slots[i];
+    }
+    free(old.slots);
+}
+
+/*Find or add the entry of key, used counts deleted slots too so a table full of them grows*/
+static replay_entry* table_insert(replay_table* table, unsigned long long key)
+{
+    replay_entry*  found = table_find(table, key);
+    size_t         i = 0;
+
+    if (found != NULL)
+        return found;
+    if ((table->used + 1)*10 > table->size*7)
+        table_grow(table);
+    for (i = hash_key(key, table->size); table->slots[i].key != EMPTY_KEY; i = (i + 1) & (table->size - 1));
+    table->used++;
+    memset(&table->slots[i], 0, sizeof(replay_entry));
+    table->slots[i].key = key;
+    return &table->slots[i];
+}
+
+static void table_remove(replay_entry* entry)
+{
+    entry->key = DELETED_KEY;
+}
+
+static int parse_classes(const char* text)
+{
+    char*  end = NULL;
+
+    while (*text != '\0' && g_class_count < MAX_CLASSES)
+    {
+        g_class_size[g_class_count] = (size_t)strtoul(text, &end, 10);
+        if (end == text || g_class_size[g_class_count] == 0)
+            return 0;
+        g_class_count++;
+        text = (*end == ',') ? end + 1 : end;
+    }
+    return g_class_count > 0 && *text == '\0';
+}
+
+/*Collect the class records a thread wrote right after the create_multi at records[i], 0 if there are none*/
+static size_t recorded_classes(const elr_mpl_trace_record* records, size_t count, size_t i, size_t* class_size)
+{
+    size_t  n = 0;
+    size_t  j = 0;
+
+    for (j = i + 1; j < count && n < records[i].size && n < MAX_CLASSES; j++)
+    {
+        if (records[j].thread != records[i].thread)
+            continue;
+        if (records[j].op != ELR_MPL_TRACE_CLASS || records[j].pool != records[i].pool)
+            break;
+        class_size[n++] = records[j].size;
+    }
+    return n;
+}
+
+/*Create the replayed pool of a recorded create, or of a pool used before the trace started*/
+static elr_mpl_ht create_pool(unsigned long long id, unsigned long long parent_id, int multi, size_t size, int flags,
+    const size_t* class_size, size_t class_count)
+{
+    replay_entry*  parent = table_find(&g_pools, parent_id);
+    replay_entry*  entry = NULL;
+    elr_mpl_ht     pool = (elr_mpl_ht)malloc(sizeof(elr_mpl_t));
+
+    if (pool == NULL)
+        return NULL;
+    flags = (g_flags >= 0) ? g_flags : flags;
+    if (multi)
+        *pool = elr_mpl_create_multi_ex(parent != NULL ? (elr_mpl_ht)parent->mem : &g_root,
+            (int)class_count, (size_t*)class_size, NULL, NULL, flags);
+    else if (size == 0)
+        *pool = elr_mpl_create_arena(parent != NULL ? (elr_mpl_ht)parent->mem : &g_root, 0, flags);
+    else
+        *pool = elr_mpl_create_ex(parent != NULL ? (elr_mpl_ht)parent->mem : &g_root,
+            size, NULL, NULL, flags);
+    if (pool->pool == NULL)
+    {
+        free(pool);
+        return NULL;
+    }
+
+    entry = table_insert(&g_pools, id);
+    entry->mem = pool;
+    entry->owner = parent != NULL ? parent_id : 0;
+    entry->size = multi ? 0 : size;
+    return pool;
+}
+
+/*Whether a pool is id or one of its descendants*/
+static int descends(unsigned long long pool_id, unsigned long long id)
+{
+    replay_entry*  entry = NULL;
+
+    while (pool_id != 0)
+    {
+        if (pool_id == id)
+            return 1;
+        entry = table_find(&g_pools, pool_id);
+        pool_id = (entry != NULL) ? entry->owner : 0;
+    }
+    return 0;
+}
+
+/*Destroy a replayed pool and forget it, its children and their memory blocks*/
+static void destroy_pool(unsigned long long id)
+{
+    replay_entry*  entry = table_find(&g_pools, id);
+    size_t*        gone = NULL;
+    size_t         gone_count = 0;
+    size_t         i = 0;
+
+    if (entry == NULL)
+        return;
+    elr_mpl_destroy((elr_mpl_ht)entry->mem);
+
+    for (i = 0; i < g_objects.size; i++)
+    {
+        if (g_objects.slots[i].key != EMPTY_KEY && g_objects.slots[i].key != DELETED_KEY
+            && descends(g_objects.slots[i].owner, id))
+        {
+            g_live -= g_objects.slots[i].size;
+            table_remove(&g_objects.slots[i]);
+        }
+    }
+    /* collected before any is removed, removing a pool cuts the parent chains through it. */
+    gone = (size_t*)malloc(g_pools.size*sizeof(size_t));
+    if (gone == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < g_pools.size; i++)
+    {
+        if (g_pools.slots[i].key != EMPTY_KEY && g_pools.slots[i].key != DELETED_KEY
+            && descends(g_pools.slots[i].key, id))
+            gone[gone_count++] = i;
+    }
+    for (i = 0; i < gone_count; i++)
+    {
+        free(g_pools.slots[gone[i]].mem);
+        table_remove(&g_pools.slots[gone[i]]);
+    }
+    free(gone);
+}
+
+/*The records cmp_time orders the indexes of*/
+static const elr_mpl_trace_record*  g_sort_records = NULL;
+
+static int cmp_time(const void* a, const void* b)
+{
+    size_t  ia = *(const size_t*)a;
+    size_t  ib = *(const size_t*)b;
+
+    if (g_sort_records[ia].time != g_sort_records[ib].time)
+        return g_sort_records[ia].time < g_sort_records[ib].time ? -1 : 1;
+    /* qsort is not stable, records of one thread keep the order they were loaded in. */
+    return ia < ib ? -1 : (ia > ib ? 1 : 0);
+}
+
+/*Sort the records by time through an array of their indexes, returns the sorted copy or NULL*/
+static elr_mpl_trace_record* sort_records(const elr_mpl_trace_record* records, size_t count)
+{
+    elr_mpl_trace_record*  sorted = (elr_mpl_trace_record*)malloc(count*sizeof(elr_mpl_trace_record));
+    size_t*                order = (size_t*)malloc(count*sizeof(size_t));
+    size_t                 i = 0;
+
+    if (sorted == NULL || order == NULL)
+    {
+        free(sorted);
+        free(order);
+        return NULL;
+    }
+    for (i = 0; i < count; i++)
+        order[i] = i;
+    g_sort_records = records;
+    qsort(order, count, sizeof(size_t), cmp_time);
+    for (i = 0; i < count; i++)
+        sorted[i] = records[order[i]];
+    free(order);
+    return sorted;
+}
+
+/*Read count records of record_size bytes, records of older versions are widened*/
+static int read_records(FILE* fp, elr_mpl_trace_record* records, size_t count, size_t record_size)
+{
+    replay_record_v2*  old = NULL;
+    size_t             i = 0;
+
+    if (record_size == sizeof(elr_mpl_trace_record))
+        return fread(records, sizeof(elr_mpl_trace_record), count, fp) == count;
+
+    old = (replay_record_v2*)malloc(count*sizeof(replay_record_v2));
+    if (old == NULL || fread(old, sizeof(replay_record_v2), count, fp) != count)
+    {
+        free(old);
+        return 0;
+    }
+    for (i = 0; i < count; i++)
+    {
+        records[i].time = old[i].time;
+        records[i].object = old[i].object;
+        records[i].pool = old[i].pool;
+        records[i].size = old[i].size;
+        records[i].thread = old[i].thread;
+        records[i].flags = old[i].flags;
+        records[i].op = old[i].op;
+    }
+    free(old);
+    return 1;
+}
+
+static elr_mpl_trace_record* load_trace(const char* path, size_t* count)
+{
+    FILE*                   fp = fopen(path, "rb");
+    elr_mpl_trace_header    header;
+    elr_mpl_trace_record*   records = NULL;
+    elr_mpl_trace_record*   sorted = NULL;
+    size_t                  record_size = 0;
+    long                    bytes = 0;
+
+    if (fp == NULL)
+    {
+        perror(path);
+        return NULL;
+    }
+    if (fread(&header, sizeof(header), 1, fp) == 1)
+        record_size = (header.version < 3) ? sizeof(replay_record_v2) : sizeof(elr_mpl_trace_record);
+    if (record_size == 0 || header.magic != ELR_MPL_TRACE_MAGIC
+        || header.version == 0 || header.version > ELR_MPL_TRACE_VERSION
+        || header.record_size != record_size)
+    {
+        fprintf(stderr, "%s: not a trace of this version\n", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    bytes = ftell(fp) - (long)sizeof(header);
+    fseek(fp, sizeof(header), SEEK_SET);
+    *count = (size_t)bytes / record_size;
+    if (*count == 0)
+    {
+        fprintf(stderr, "%s: no records\n", path);
+        fclose(fp);
+        return NULL;
+    }
+    records = (elr_mpl_trace_record*)calloc(*count, sizeof(elr_mpl_trace_record));
+    if (records == NULL || read_records(fp, records, *count, record_size) == 0)
+    {
+        fprintf(stderr, "%s: can not read %zu records\n", path, *count);
+        free(records);
+        records = NULL;
+    }
+    fclose(fp);
+
+    if (records != NULL)
+    {
+        sorted = sort_records(records, *count);
+        if (sorted == NULL)
+            fprintf(stderr, "%s: can not sort %zu records\n", path, *count);
+        free(records);
+        records = sorted;
+    }
+    return records;
+}
+
+int main(int argc, char** argv)
+{
+    elr_mpl_trace_record*  records = NULL;
+    elr_mpl_trace_record*  rec = NULL;
+    replay_entry*          entry = NULL;
+    elr_mpl_ht             pool = NULL;
+    struct timespec        begin;
+    struct timespec        end;
+    struct rusage          usage;
+    size_t                 default_classes[13] = { 64, 98, 128, 192, 256, 384, 512, 768, 1024, 1280, 1536, 1792, 2048 };
+    size_t                 class_size[MAX_CLASSES];
+    size_t                 class_count = 0;
+    size_t                 count = 0;
+    size_t                 calls = 0;
+    size_t                 unmatched = 0;
+    size_t                 failed = 0;
+    size_t                 charged = 0;
+    size_t                 peak_charged = 0;
+    size_t                 peak_live = 0;
+    size_t                 i = 0;
+    long                   loaded_rss = 0;
+    double                 seconds = 0;
+    void*                  mem = NULL;
+    int                    arg = 1;
+
+    for (arg = 1; arg + 1 < argc && argv[arg][0] == '-'; arg += 2)
+    {
+        if (strcmp(argv[arg], "-f") == 0)
+            g_flags = (int)strtol(argv[arg + 1], NULL, 0);
+        else if (strcmp(argv[arg], "-c") != 0 || parse_classes(argv[arg + 1]) == 0)
+            break;
+        else
+            g_class_forced = 1;
+    }
+    if (arg + 1 != argc)
+    {
+        fprintf(stderr, "usage: %s [-f flags] [-c size,size,...] trace\n", argv[0]);
+        return 2;
+    }
+    if (g_class_count == 0)
+    {
+        memcpy(g_class_size, default_classes, sizeof(default_classes));
+        g_class_count = 13;
+    }
+
+    records = load_trace(argv[arg], &count);
+    if (records == NULL)
+        return 1;
+    getrusage(RUSAGE_SELF, &usage);
+    loaded_rss = usage.ru_maxrss;
+
+    elr_mpl_init();
+    g_root = elr_mpl_create(NULL, 16, NULL, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (i = 0; i < count; i++)
+    {
+        rec = &records[i];
+        switch (rec->op)
+        {
+        case ELR_MPL_TRACE_CREATE:
+        case ELR_MPL_TRACE_CREATE_MULTI:
+            /* an address reused by a new pool means the old one was destroyed with its parent. */
+            if (table_find(&g_pools, rec->pool) != NULL)
+                destroy_pool(rec->pool);
+            class_count = 0;
+            if (rec->op == ELR_MPL_TRACE_CREATE_MULTI && g_class_forced == 0)
+                class_count = recorded_classes(records, count, i, class_size);
+            if (create_pool(rec->pool, rec->object, rec->op == ELR_MPL_TRACE_CREATE_MULTI, rec->size, rec->flags,
+                    class_count > 0 ? class_size : g_class_size, class_count > 0 ? class_count : g_class_count) == NULL)
+                failed++;
+            break;
+
+        case ELR_MPL_TRACE_CLASS:
+            /* taken by the create_multi before it. */
+            continue;
+
+        case ELR_MPL_TRACE_DESTROY:
+            destroy_pool(rec->pool);
+            break;
+
+        case ELR_MPL_TRACE_ALLOC:
+        case ELR_MPL_TRACE_ALLOC_MULTI:
+            entry = table_find(&g_pools, rec->pool);
+            pool = (entry != NULL) ? (elr_mpl_ht)entry->mem
+                : create_pool(rec->pool, 0, rec->op == ELR_MPL_TRACE_ALLOC_MULTI, rec->size, 0,
+                    g_class_size, g_class_count);
+            if (pool == NULL)
+            {
+                failed++;
+                break;
+            }
+            mem = (rec->op == ELR_MPL_TRACE_ALLOC) ? elr_mpl_alloc(pool) : elr_mpl_alloc_multi(pool, rec->size);
+            if (mem == NULL)
+            {
+                failed++;
+                break;
+            }
+            /* a block the program never freed before its address came back was lost with a destroyed pool. */
+            entry = table_find(&g_objects, rec->object);
+            if (entry != NULL)
+            {
+                g_live -= entry->size;
+                table_remove(entry);
+            }
+            entry = table_insert(&g_objects, rec->object);
+            entry->mem = mem;
+            entry->owner = rec->pool;
+            entry->size = rec->size;
+            g_live += rec->size;
+            break;
+
+        case ELR_MPL_TRACE_FREE:
+            entry = table_find(&g_objects, rec->object);
+            if (entry == NULL)
+            {
+                /* allocated before the trace started. */
+                unmatched++;
+                break;
+            }
+            elr_mpl_free(entry->mem);
+            g_live -= entry->size;
+            table_remove(entry);
+            break;
+
+        default:
+            unmatched++;
+            continue;
+        }
+
+        /* charged only moves when a node comes or goes, a cheap load, so every call is sampled. */
+        calls++;
+        charged = elr_mpl_charged(&g_root);
+        if (charged > peak_charged)
+        {
+            peak_charged = charged;
+            peak_live = g_live;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    charged = elr_mpl_charged(&g_root);
+    getrusage(RUSAGE_SELF, &usage);
+
+    seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec)/1e9;
+    printf("records        %zu, replayed %zu, unmatched %zu, failed %zu\n", count, calls, unmatched, failed);
+    printf("throughput     %.0f calls/s (%.3f s)\n", seconds > 0 ? calls/seconds : 0.0, seconds);
+    printf("peak rss       %ld KB (%ld KB after loading the trace)\n", usage.ru_maxrss, loaded_rss);
+    printf("peak charged   %zu bytes, %zu requested, fragmentation %.1f%%\n", peak_charged, peak_live,
+        peak_charged > 0 ? 100.0*(peak_charged - peak_live)/peak_charged : 0.0);
+    printf("final charged  %zu bytes, %zu requested, fragmentation %.1f%%\n", charged, g_live,
+        charged > 0 ? 100.0*(charged - g_live)/charged : 0.0);
+
+    elr_mpl_destroy(&g_root);
+    elr_mpl_finalize();
+    free(records);
+    return 0;
+}
@@ -1,8 +1,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include <elr_mpl_posix.h>
+#include <elr_mpl_inline.h>
 
 #include "cunit.h"
 
@@ -22,6 +26,32 @@ int  test_alloc_callback();
 
 int  test_free_callback();
 
+int  test_multi_sync_threads();
+int  test_adaptive_lock();
+int  test_biased_pool();
+int  test_reset();
+int  test_arena();
+int  test_reclaimer();
+int  test_fullest_first();
+int  test_shm_pool();
+int  test_file_pool();
+int  test_handles();
+int  test_size_classes();
+int  test_object_cache();
+int  test_retire();
+int  test_refcount();
+int  test_limit();
+int  test_alloc_wait();
+int  test_from_buffer();
+int  test_node_cache();
+int  test_tcache();
+int  test_coloring();
+int  test_cacheline();
+int  test_dump();
+int  test_compact();
+int  test_foreach();
+int  test_trace();
+
 /* generate memory fragments */
 char *fragment_stack[100000];
 void make_fragments(int mem_size);
@@ -30,6 +60,9 @@ void clear_fragments();
 /* test memory allocation, freeing, access speed */
 void bench();
 
+/* test threads updating neighbouring memory blocks with and without ELR_MPL_CACHELINE */
+void bench_false_sharing();
+
 /* test memory allocation, freeing, access speed of elr_memory_pool */
 void mpl_alloc_free_access(size_t alloc_size,
                            int *alloc_times,
@@ -60,8 +93,34 @@ int main()
     RUN_TEST_BOOLEAN(test_mem_alloc,"Allocate memory of the same size be declared.");
     RUN_TEST_BOOLEAN(test_alloc_callback,"The memory is correctly changed by alloc callback.");
     RUN_TEST_BOOLEAN(test_free_callback,"The memory is correctly changed by free callback.");
+    RUN_TEST_BOOLEAN(test_multi_sync_threads,"Size classes of a sync multi pool can be used from many threads.");
+    RUN_TEST_BOOLEAN(test_adaptive_lock,"Adaptive pool lock counts every acquisition.");
+    RUN_TEST_BOOLEAN(test_biased_pool,"Biased pool skips its lock until another thread touches it.");
+    RUN_TEST_BOOLEAN(test_reset,"A reset pool reuses its nodes and calls free callback for live blocks.");
+    RUN_TEST_BOOLEAN(test_arena,"Arena pool rolls back to a mark and is destroyed with its parent.");
+    RUN_TEST_BOOLEAN(test_reclaimer,"Reclaimer gives back idle nodes while a pool is in use.");
+    RUN_TEST_BOOLEAN(test_fullest_first,"Fullest-first pool allocates from its most occupied node.");
+    RUN_TEST_BOOLEAN(test_shm_pool,"Shared memory pool passes blocks between processes by offset.");
+    RUN_TEST_BOOLEAN(test_file_pool,"File memory pool comes back with its blocks after a reopen.");
+    RUN_TEST_BOOLEAN(test_handles,"32 bits handles resolve to their blocks and stale ones are caught.");
+    RUN_TEST_BOOLEAN(test_size_classes,"Size histogram suggests classes and refines frequent sizes.");
+    RUN_TEST_BOOLEAN(test_object_cache,"Object cache constructs once per slice and destructs with the node.");
+    RUN_TEST_BOOLEAN(test_retire,"Retired blocks wait for readers to leave their critical sections.");
+    RUN_TEST_BOOLEAN(test_refcount,"Reference counted blocks are freed by the last release.");
+    RUN_TEST_BOOLEAN(test_limit,"Pool subtree limit refuses nodes and calls its callback.");
+    RUN_TEST_BOOLEAN(test_alloc_wait,"Bounded pool makes producers wait for the consumer.");
+    RUN_TEST_BOOLEAN(test_from_buffer,"Buffer pool cuts every memory block from the caller`s buffer.");
+    RUN_TEST_BOOLEAN(test_node_cache,"Nodes of a destroyed pool are reused by the next pool of the same node size.");
+    RUN_TEST_BOOLEAN(test_tcache,"Inline thread caches move memory blocks in batches.");
+    RUN_TEST_BOOLEAN(test_coloring,"Colored nodes keep every slice inside the node.");
+    RUN_TEST_BOOLEAN(test_cacheline,"Cache line pools start every memory block on its own cache line.");
+    RUN_TEST_BOOLEAN(test_dump,"Pool dump lists nodes with their occupancy maps.");
+    RUN_TEST_BOOLEAN(test_compact,"Compaction moves live blocks out of sparse nodes and gives the nodes back.");
+    RUN_TEST_BOOLEAN(test_foreach,"Sweeps visit every allocated block once, in address order within a node.");
+    RUN_TEST_BOOLEAN(test_trace,"Trace records the calls of all threads, including threads that finished.");
 
     bench();
+    bench_false_sharing();
 
     printf( "finalizing.\n" );
     fflush( stdout );
@@ -162,6 +221,1294 @@ int test_free_callback()
 }
 
 
+static elr_mpl_t multi_sync_pool;
+
+static void* multi_sync_worker(void* arg)
+{
+    size_t size = (size_t)arg;
+    void*  mem[64];
+    int    i = 0, j = 0;
+    long   bad = 0;
+
+    for (j = 0; j < 200; j++)
+    {
+        for (i = 0; i < 64; i++)
+        {
+            mem[i] = elr_mpl_alloc_multi(&multi_sync_pool, size + i);
+            if (mem[i] == NULL || elr_mpl_size(mem[i]) < size + i)
+                bad++;
+            else
+                memset(mem[i], i, size + i);
+        }
+
+        for (i = 0; i < 64; i++)
+            elr_mpl_free(mem[i]);
+    }
+
+    return (void*)bad;
+}
+
+int test_multi_sync_threads()
+{
+    size_t    sizes[4] = { 64, 512, 2048, 5000 };
+    size_t    obj_size[3] = { 128, 1024, 2048 };
+    pthread_t threads[4];
+    elr_mpl_lock_stat stat;
+    void*     bad = NULL;
+    int       ret = 1;
+    int       i = 0;
+
+    multi_sync_pool = elr_mpl_create_multi_sync(NULL, 3, obj_size, NULL, NULL);
+    if (elr_mpl_avail(&multi_sync_pool) == 0)
+        return 0;
+
+    for (i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, multi_sync_worker, (void*)sizes[i]);
+
+    for (i = 0; i < 4; i++)
+    {
+        pthread_join(threads[i], &bad);
+        if (bad != NULL)
+            ret = 0;
+    }
+
+    /* the threads only share classes safely if the classes really lock. */
+    ret &= (elr_mpl_lock_stats(&multi_sync_pool, &stat) != 0 && stat.acquired > 0);
+
+    elr_mpl_destroy(&multi_sync_pool);
+    return ret && elr_mpl_avail(&multi_sync_pool) == 0;
+}
+static elr_mpl_t adaptive_pool;
+
+static void* adaptive_worker(void* arg)
+{
+    void* mem[16];
+    int   i = 0, j = 0;
+
+    for (j = 0; j < 1000; j++)
+    {
+        for (i = 0; i < 16; i++)
+            mem[i] = elr_mpl_alloc(&adaptive_pool);
+        for (i = 0; i < 16; i++)
+            elr_mpl_free(mem[i]);
+    }
+
+    return arg;
+}
+
+int test_adaptive_lock()
+{
+    pthread_t         threads[4];
+    elr_mpl_lock_stat stat;
+    int               ret = 1;
+    int               i = 0;
+
+    adaptive_pool = elr_mpl_create_ex(NULL, 64, NULL, NULL,
+        ELR_MPL_SYNC | ELR_MPL_ADAPTIVE_LOCK);
+
+    for (i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, adaptive_worker, NULL);
+    for (i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+
+    /* alloc and free take the lock once each. */
+    ret = elr_mpl_lock_stats(&adaptive_pool, &stat) != 0
+        && stat.acquired == 4 * 1000 * 16 * 2;
+
+    elr_mpl_destroy(&adaptive_pool);
+    return ret;
+}
+static void* biased_worker(void* arg)
+{
+    elr_mpl_free(arg);
+    return NULL;
+}
+
+int test_biased_pool()
+{
+    elr_mpl_t         pool = elr_mpl_create_ex(NULL, 64, NULL, NULL, ELR_MPL_BIASED);
+    elr_mpl_lock_stat stat;
+    pthread_t         thread;
+    void*             mem = NULL;
+    int               ret = 1;
+    int               i = 0;
+
+    for (i = 0; i < 1000; i++)
+        elr_mpl_free(elr_mpl_alloc(&pool));
+
+    /* the owner never took the lock. */
+    elr_mpl_lock_stats(&pool, &stat);
+    ret &= (stat.acquired == 0);
+
+    mem = elr_mpl_alloc(&pool);
+    pthread_create(&thread, NULL, biased_worker, mem);
+    pthread_join(thread, NULL);
+
+    /* the bias is revoked, the owner locks too. */
+    elr_mpl_free(elr_mpl_alloc(&pool));
+    elr_mpl_lock_stats(&pool, &stat);
+    ret &= (stat.acquired == 3);
+
+    elr_mpl_destroy(&pool);
+    return ret;
+}
+static int reset_free_count = 0;
+
+static void on_reset_free(void* mem)
+{
+    reset_free_count++;
+}
+
+int test_reset()
+{
+    /* 8 full nodes of 64 slices each. */
+    char* first[512];
+    char* mem = NULL;
+    int   ret = 1;
+    int   i = 0, j = 0;
+	elr_mpl_t pool = elr_mpl_create(NULL, 256, NULL, on_reset_free);
+
+    for (i = 0; i < 512; i++)
+        first[i] = (char*)elr_mpl_alloc(&pool);
+    elr_mpl_free(first[0]);
+
+    reset_free_count = 0;
+    elr_mpl_reset(&pool);
+    ret &= (reset_free_count == 511);
+
+    /* the same memory is handed out again, no node is added. */
+    for (i = 0; i < 512 && ret == 1; i++)
+    {
+        mem = (char*)elr_mpl_alloc(&pool);
+        for (j = 0; j < 512 && first[j] != mem; j++)
+            ;
+        if (j == 512)
+            ret = 0;
+        else
+            memset(mem, 0, 256);
+    }
+
+    elr_mpl_destroy(&pool);
+    return ret;
+}
+int test_arena()
+{
+	elr_mpl_t      parent = elr_mpl_create(NULL, 64, NULL, NULL);
+	elr_mpl_t      arena = elr_mpl_create_arena(&parent, 4096, 0);
+    elr_mpl_mark_t mark;
+    char*          first = NULL;
+    char*          mem = NULL;
+    int            ret = 1;
+    int            i = 0;
+
+    first = (char*)elr_mpl_alloc_arena(&arena, 10);
+    ret &= (first != NULL && ((size_t)first % 16) == 0);
+
+    mark = elr_mpl_mark(&arena);
+    mem = (char*)elr_mpl_alloc_arena(&arena, 24);
+    for (i = 0; i < 200; i++)
+        memset(elr_mpl_alloc_arena(&arena, 100), 1, 100);
+    memset(elr_mpl_alloc_arena(&arena, 10000), 1, 10000);
+
+    /* everything after the mark is given back, cutting starts again there. */
+    elr_mpl_rollback(&arena, mark);
+    ret &= (elr_mpl_alloc_arena(&arena, 24) == mem);
+
+    elr_mpl_reset(&arena);
+    ret &= (elr_mpl_alloc_arena(&arena, 10) != NULL);
+
+    elr_mpl_destroy(&parent);
+    ret &= (elr_mpl_avail(&arena) == 0);
+    return ret;
+}
+
+static void* reclaim_churn(void* arg)
+{
+    elr_mpl_t*  pool = (elr_mpl_t*)arg;
+    void*       mem[100];
+    int         i = 0;
+    int         round = 0;
+
+    for (round = 0; round < 200; round++)
+    {
+        for (i = 0; i < 100; i++)
+            mem[i] = elr_mpl_alloc(pool);
+        for (i = 0; i < 100; i++)
+            elr_mpl_free(mem[i]);
+        usleep(500);
+    }
+    return NULL;
+}
+
+int test_reclaimer()
+{
+	elr_mpl_t      pool = elr_mpl_create_sync(NULL, 256, NULL, NULL);
+    pthread_t      churn;
+    void*          mem[512];
+    size_t         released = 0;
+    int            ret = 1;
+    int            i = 0;
+
+    ret &= elr_mpl_start_reclaimer(10, 5);
+    ret &= (elr_mpl_start_reclaimer(10, 5) == 0);
+
+    /* nodes come and go under the reclaimer`s feet. */
+    pthread_create(&churn, NULL, reclaim_churn, &pool);
+    pthread_join(churn, NULL);
+
+    /* 512 blocks of 256 bytes fill 8 nodes, all of them go idle. */
+    for (i = 0; i < 512; i++)
+        mem[i] = elr_mpl_alloc(&pool);
+    for (i = 0; i < 512; i++)
+        elr_mpl_free(mem[i]);
+    usleep(100000);
+
+    released = elr_mpl_stop_reclaimer();
+    ret &= (released >= 512 * 256);
+    mem[0] = elr_mpl_alloc(&pool);
+    ret &= (mem[0] != NULL);
+    elr_mpl_free(mem[0]);
+
+    elr_mpl_destroy(&pool);
+    return ret;
+}
+
+int test_fullest_first()
+{
+	elr_mpl_t      pool = elr_mpl_create_ex(NULL, 256, NULL, NULL, ELR_MPL_FULLEST_FIRST);
+    void*          mem[128];
+    char*          first = NULL;
+    char*          p = NULL;
+    int            ret = 1;
+    int            i = 0;
+
+    /* two full nodes of 64 blocks, then the first keeps 54 and the second 24. */
+    for (i = 0; i < 128; i++)
+        mem[i] = elr_mpl_alloc(&pool);
+    first = (char*)mem[0];
+    for (i = 0; i < 10; i++)
+        elr_mpl_free(mem[i]);
+    for (i = 64; i < 104; i++)
+        elr_mpl_free(mem[i]);
+
+    /* the holes of the first node are filled before the second one is touched. */
+    for (i = 0; i < 10; i++)
+    {
+        p = (char*)elr_mpl_alloc(&pool);
+        ret &= (p >= first && p < (char*)mem[63] + 256);
+        mem[i] = p;
+    }
+    p = (char*)elr_mpl_alloc(&pool);
+    ret &= (p >= (char*)mem[64] && p <= (char*)mem[127]);
+    elr_mpl_free(p);
+
+    for (i = 0; i < 64; i++)
+        elr_mpl_free(mem[i]);
+    for (i = 104; i < 128; i++)
+        elr_mpl_free(mem[i]);
+    ret &= (elr_mpl_alloc(&pool) != NULL);
+
+    elr_mpl_destroy(&pool);
+    return ret;
+}
+
+int test_shm_pool()
+{
+    char             name[64];
+    elr_mpl_mapped_t shm = { NULL };
+    elr_mpl_mapped_t peer = { NULL };
+    void*            mem[16];
+    char*            frame = NULL;
+    size_t           offset = 0;
+    int              fds[2];
+    int              status = 0;
+    pid_t            pid = 0;
+    int              ret = 1;
+    int              i = 0;
+
+    sprintf(name, "/elr_mpl_test_%d", (int)getpid());
+    shm = elr_mpl_create_shm(name, 1000, 16);
+    peer = elr_mpl_attach_shm(name);
+    ret &= (shm.pool != NULL && peer.pool != NULL && shm.pool != peer.pool);
+    if (ret == 0)
+        return 0;
+
+    /* another mapping of the same pool sees the block at the same offset. */
+    frame = (char*)elr_mpl_alloc_mapped(&shm);
+    strcpy(frame, "frame 1");
+    offset = elr_mpl_mapped_offset(&shm, frame);
+    ret &= (offset != 0 && ((size_t)frame % 16) == 0);
+    ret &= (strcmp((char*)elr_mpl_mapped_ptr(&peer, offset), "frame 1") == 0);
+    elr_mpl_free_mapped(&peer, elr_mpl_mapped_ptr(&peer, offset));
+
+    /* a child process allocates and fills a frame, only the offset comes back. */
+    if (pipe(fds) != 0)
+        return 0;
+    pid = fork();
+    if (pid == 0)
+    {
+        elr_mpl_mapped_t child = elr_mpl_attach_shm(name);
+        char*            p = (char*)elr_mpl_alloc_mapped(&child);
+        size_t           off = elr_mpl_mapped_offset(&child, p);
+
+        strcpy(p, "frame 2");
+        _exit(write(fds[1], &off, sizeof(off)) == sizeof(off) ? 0 : 1);
+    }
+    ret &= (read(fds[0], &offset, sizeof(offset)) == sizeof(offset));
+    waitpid(pid, &status, 0);
+    close(fds[0]);
+    close(fds[1]);
+    frame = (char*)elr_mpl_mapped_ptr(&shm, offset);
+    ret &= (frame != NULL && strcmp(frame, "frame 2") == 0);
+    elr_mpl_free_mapped(&shm, frame);
+
+    /* the pool holds 16 blocks, no more. */
+    for (i = 0; i < 16; i++)
+        ret &= ((mem[i] = elr_mpl_alloc_mapped(&shm)) != NULL);
+    ret &= (elr_mpl_alloc_mapped(&peer) == NULL);
+    for (i = 0; i < 16; i++)
+        elr_mpl_free_mapped(&shm, mem[i]);
+
+    elr_mpl_detach(&peer);
+    elr_mpl_detach(&shm);
+    ret &= elr_mpl_unlink_shm(name);
+    ret &= (elr_mpl_attach_shm(name).pool == NULL);
+    return ret;
+}
+
+typedef struct __file_item
+{
+    size_t  next;
+    int     value;
+}
+file_item;
+
+int test_file_pool()
+{
+    char             path[64];
+    elr_mpl_mapped_t pool = { NULL };
+    file_item*       item[3];
+    file_item*       p = NULL;
+    void*            freed = NULL;
+    int              ret = 1;
+    int              i = 0;
+
+    sprintf(path, "/tmp/elr_mpl_test_%d.pool", (int)getpid());
+    pool = elr_mpl_create_file(path, sizeof(file_item), 100);
+    if (pool.pool == NULL)
+        return 0;
+
+    /* a list linked by offsets, its head is the root. */
+    for (i = 0; i < 3; i++)
+    {
+        item[i] = (file_item*)elr_mpl_alloc_mapped(&pool);
+        item[i]->value = i + 1;
+        item[i]->next = 0;
+        if (i > 0)
+            item[i - 1]->next = elr_mpl_mapped_offset(&pool, item[i]);
+    }
+    elr_mpl_set_root(&pool, item[0]);
+    freed = elr_mpl_alloc_mapped(&pool);
+    elr_mpl_free_mapped(&pool, freed);
+    ret &= elr_mpl_sync_mapped(&pool);
+    elr_mpl_detach(&pool);
+
+    pool = elr_mpl_open_file(path);
+    ret &= (pool.pool != NULL);
+    if (ret == 0)
+        return 0;
+    p = (file_item*)elr_mpl_get_root(&pool);
+    for (i = 1; p != NULL; i++)
+    {
+        ret &= (p->value == i);
+        p = (file_item*)elr_mpl_mapped_ptr(&pool, p->next);
+    }
+    ret &= (i == 4);
+
+    /* the free list came back too. */
+    p = (file_item*)elr_mpl_alloc_mapped(&pool);
+    ret &= (elr_mpl_mapped_offset(&pool, p) != 0);
+    ret &= ((char*)p - (char*)elr_mpl_get_root(&pool) == (char*)freed - (char*)item[0]);
+
+    elr_mpl_detach(&pool);
+    unlink(path);
+    ret &= (elr_mpl_open_file(path).pool == NULL);
+    return ret;
+}
+
+static void handles_relocate(void* old_mem, void* new_mem, void* ctx)
+{
+    (void)old_mem;
+    (void)new_mem;
+    (void)ctx;
+}
+
+int test_handles()
+{
+	elr_mpl_t         pool = elr_mpl_create_ex(NULL, 40, NULL, NULL, ELR_MPL_SYNC | ELR_MPL_HANDLES);
+	elr_mpl_t         plain = elr_mpl_create(NULL, 40, NULL, NULL);
+    void*             mem[200];
+    elr_mpl_handle_t  handle[200];
+    elr_mpl_handle_t  stale = 0;
+    void*             p = NULL;
+    int               ret = 1;
+    int               i = 0;
+
+    ret &= (sizeof(elr_mpl_handle_t) == 4);
+    for (i = 0; i < 200; i++)
+    {
+        mem[i] = elr_mpl_alloc(&pool);
+        handle[i] = elr_mpl_handle(mem[i]);
+        ret &= (handle[i] != 0);
+    }
+    for (i = 0; i < 200; i++)
+        ret &= (elr_mpl_resolve(&pool, handle[i]) == mem[i]);
+
+    /* the slot comes back at once but under a new generation. */
+    stale = handle[7];
+    elr_mpl_free(mem[7]);
+    ret &= (elr_mpl_resolve(&pool, stale) == NULL);
+    p = elr_mpl_alloc(&pool);
+    ret &= (p == mem[7]);
+    ret &= (elr_mpl_resolve(&pool, stale) == NULL);
+    ret &= (elr_mpl_resolve(&pool, elr_mpl_handle(p)) == p);
+
+    ret &= (elr_mpl_resolve(&pool, 0) == NULL);
+    ret &= (elr_mpl_resolve(&pool, 0x0fffffff) == NULL);
+    p = elr_mpl_alloc(&plain);
+    ret &= (elr_mpl_handle(p) == 0);
+
+    /* a reset carves the same slots again, under new generations too. */
+    elr_mpl_reset(&pool);
+    for (i = 0; i < 200; i++)
+        mem[i] = elr_mpl_alloc(&pool);
+    for (i = 0; i < 200; i++)
+    {
+        ret &= (elr_mpl_resolve(&pool, handle[i]) == NULL);
+        ret &= (elr_mpl_resolve(&pool, elr_mpl_handle(mem[i])) == mem[i]);
+    }
+
+    /* a new node taking the table entry of a released one starts above its generations. */
+    for (i = 0; i < 200; i++)
+        elr_mpl_free(mem[i]);
+    ret &= (elr_mpl_compact(&pool, handles_relocate, NULL) > 0);
+    p = elr_mpl_alloc(&pool);
+    ret &= (((elr_mpl_handle(p) ^ handle[0]) & 0x0fffffff) == 0);
+    ret &= (elr_mpl_resolve(&pool, handle[0]) == NULL);
+    ret &= (elr_mpl_resolve(&pool, elr_mpl_handle(p)) == p);
+
+    elr_mpl_destroy(&plain);
+    elr_mpl_destroy(&pool);
+    return ret;
+}
+
+int test_size_classes()
+{
+    size_t         classes[3] = { 64, 256, 1024 };
+    size_t         suggested[8];
+	elr_mpl_t      pool = elr_mpl_create_multi_ex(NULL, 3, classes, NULL, NULL,
+                        ELR_MPL_SYNC | ELR_MPL_REFINE_CLASSES);
+    void*          mem[300];
+    int            count = 0;
+    int            ret = 1;
+    int            i = 0;
+
+    /* 2100 bytes start in a 3072 bytes over-range class, then get a class of 2112. */
+    for (i = 0; i < 300; i++)
+        mem[i] = elr_mpl_alloc_multi(&pool, 2100);
+    ret &= (elr_mpl_size(mem[0]) == 3072);
+    ret &= (elr_mpl_size(mem[299]) == 2112);
+    for (i = 0; i < 300; i++)
+        elr_mpl_free(mem[i]);
+
+    for (i = 0; i < 100; i++)
+    {
+        elr_mpl_free(elr_mpl_alloc_multi(&pool, 100));
+        elr_mpl_free(elr_mpl_alloc_multi(&pool, 200));
+        elr_mpl_free(elr_mpl_alloc_multi(&pool, 700));
+    }
+
+    count = elr_mpl_suggest_classes(&pool, 8, suggested);
+    ret &= (count == 4 && suggested[0] == 112 && suggested[1] == 208
+        && suggested[2] == 704 && suggested[3] == 2112);
+    count = elr_mpl_suggest_classes(&pool, 2, suggested);
+    ret &= (count == 2 && suggested[1] == 2112);
+
+    elr_mpl_destroy(&pool);
+    return ret;
+}
+
+typedef struct __cache_counter
+{
+    int  constructed;
+    int  destructed;
+}
+cache_counter;
+
+typedef struct __cached_object
+{
+    pthread_mutex_t  mtx;
+    int              ready;
+}
+cached_object;
+
+static void cached_object_ctor(void* mem, void* ctx)
+{
+    cached_object* obj = (cached_object*)mem;
+
+    pthread_mutex_init(&obj->mtx, NULL);
+    obj->ready = 1;
+    ((cache_counter*)ctx)->constructed++;
+}
+
+static void cached_object_dtor(void* mem, void* ctx)
+{
+    cached_object* obj = (cached_object*)mem;
+
+    pthread_mutex_destroy(&obj->mtx);
+    obj->ready = 0;
+    ((cache_counter*)ctx)->destructed++;
+}
+
+int test_object_cache()
+{
+    cache_counter  counter = { 0, 0 };
+	elr_mpl_t      cache = elr_mpl_create_cache(NULL, sizeof(cached_object),
+                        cached_object_ctor, cached_object_dtor, &counter, 0);
+    cached_object* obj[100];
+    int            ret = 1;
+    int            round = 0;
+    int            i = 0;
+
+    /* the second round gets the objects of the first, still constructed. */
+    for (round = 0; round < 2; round++)
+    {
+        for (i = 0; i < 100; i++)
+        {
+            obj[i] = (cached_object*)elr_mpl_alloc(&cache);
+            ret &= (obj[i]->ready == 1);
+            pthread_mutex_lock(&obj[i]->mtx);
+            pthread_mutex_unlock(&obj[i]->mtx);
+        }
+        for (i = 0; i < 100; i++)
+            elr_mpl_free(obj[i]);
+    }
+    ret &= (counter.constructed == 100 && counter.destructed == 0);
+
+    /* a reset releases every object, they are built again afterwards. */
+    elr_mpl_reset(&cache);
+    ret &= (counter.destructed == 100);
+    obj[0] = (cached_object*)elr_mpl_alloc(&cache);
+    ret &= (obj[0]->ready == 1 && counter.constructed == 101);
+
+    elr_mpl_destroy(&cache);
+    ret &= (counter.destructed == 101);
+    return ret;
+}
+
+static int   retire_freed = 0;
+static int   retire_reader_state = 0;
+static void* retire_shared = NULL;
+
+static void retire_on_free(void* mem)
+{
+    __atomic_fetch_add(&retire_freed, 1, __ATOMIC_RELAXED);
+}
+
+static void* retire_reader(void* arg)
+{
+    int  value = 0;
+
+    elr_mpl_enter();
+    value = *(int*)__atomic_load_n(&retire_shared, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&retire_reader_state, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&retire_reader_state, __ATOMIC_ACQUIRE) != 2)
+        usleep(100);
+    /* the block is still alive, whatever the writer did meanwhile. */
+    value += *(int*)retire_shared;
+    elr_mpl_exit();
+    return (void*)(size_t)value;
+}
+
+static void* retire_worker(void* arg)
+{
+    elr_mpl_t*  pool = (elr_mpl_t*)arg;
+    int*        mem = NULL;
+    int         i = 0;
+
+    for (i = 0; i < 2000; i++)
+    {
+        elr_mpl_enter();
+        mem = (int*)elr_mpl_alloc(pool);
+        *mem = i;
+        elr_mpl_exit();
+        elr_mpl_retire(mem);
+    }
+    while (elr_mpl_retire_flush() != 0)
+        sched_yield();
+    return NULL;
+}
+
+int test_retire()
+{
+	elr_mpl_t      pool = elr_mpl_create_sync(NULL, sizeof(long), NULL, retire_on_free);
+    pthread_t      reader;
+    pthread_t      worker[4];
+    void*          value = NULL;
+    int            ret = 1;
+    int            i = 0;
+
+    retire_shared = elr_mpl_alloc(&pool);
+    *(int*)retire_shared = 21;
+    pthread_create(&reader, NULL, retire_reader, NULL);
+    while (__atomic_load_n(&retire_reader_state, __ATOMIC_ACQUIRE) != 1)
+        usleep(100);
+
+    /* the reader holds the block, no number of flushes may give it back. */
+    elr_mpl_retire(retire_shared);
+    for (i = 0; i < 10; i++)
+        ret &= (elr_mpl_retire_flush() == 1);
+    ret &= (__atomic_load_n(&retire_freed, __ATOMIC_RELAXED) == 0);
+
+    __atomic_store_n(&retire_reader_state, 2, __ATOMIC_RELEASE);
+    pthread_join(reader, &value);
+    ret &= ((size_t)value == 42);
+    for (i = 0; i < 3 && elr_mpl_retire_flush() != 0; i++);
+    ret &= (__atomic_load_n(&retire_freed, __ATOMIC_RELAXED) == 1);
+
+    for (i = 0; i < 4; i++)
+        pthread_create(&worker[i], NULL, retire_worker, &pool);
+    for (i = 0; i < 4; i++)
+        pthread_join(worker[i], NULL);
+    ret &= (__atomic_load_n(&retire_freed, __ATOMIC_RELAXED) == 1 + 4 * 2000);
+
+    elr_mpl_destroy(&pool);
+    return ret;
+}
+
+static int   refcount_freed = 0;
+
+static void refcount_on_free(void* mem)
+{
+    __atomic_fetch_add(&refcount_freed, 1, __ATOMIC_RELAXED);
+}
+
+static void* refcount_stage(void* arg)
+{
+    void**  frames = (void**)arg;
+    int     i = 0;
+
+    for (i = 0; i < 1000; i++)
+        elr_mpl_release(frames[i]);
+    return NULL;
+}
+
+int test_refcount()
+{
+	elr_mpl_t      pool = elr_mpl_create_sync(NULL, 4096, NULL, refcount_on_free);
+    void*          frames[1000];
+    pthread_t      stage[4];
+    void*          mem = NULL;
+    int            ret = 1;
+    int            i = 0;
+
+    /* a block never retained is freed by its only release. */
+    mem = elr_mpl_alloc(&pool);
+    elr_mpl_release(mem);
+    ret &= (refcount_freed == 1);
+
+    mem = elr_mpl_alloc(&pool);
+    elr_mpl_retain(mem);
+    elr_mpl_release(mem);
+    ret &= (refcount_freed == 1);
+    elr_mpl_release(mem);
+    ret &= (refcount_freed == 2);
+
+    /* every frame fans out to four stages, the last one to finish frees it. */
+    for (i = 0; i < 1000; i++)
+    {
+        frames[i] = elr_mpl_alloc(&pool);
+        elr_mpl_retain(frames[i]);
+        elr_mpl_retain(frames[i]);
+        elr_mpl_retain(frames[i]);
+    }
+    for (i = 0; i < 4; i++)
+        pthread_create(&stage[i], NULL, refcount_stage, frames);
+    for (i = 0; i < 4; i++)
+        pthread_join(stage[i], NULL);
+    ret &= (refcount_freed == 1002);
+
+    /* a freed slot comes back with no references left over. */
+    mem = elr_mpl_alloc(&pool);
+    elr_mpl_release(mem);
+    ret &= (refcount_freed == 1003);
+
+    elr_mpl_destroy(&pool);
+    return ret;
+}
+
+static int limit_hits = 0;
+
+/* runs with a pool lock held, so it only moves the limit, it never creates or destroys pools. */
+static int limit_raise(elr_mpl_ht pool, size_t need, void* ctx)
+{
+    limit_hits++;
+    if (ctx == NULL)
+        return 0;
+    elr_mpl_set_limit(pool, elr_mpl_charged(pool) + need);
+    return 1;
+}
+
+int test_limit()
+{
+	elr_mpl_t      tenant = elr_mpl_create(NULL, 64, NULL, NULL);
+	elr_mpl_t      pool = elr_mpl_create(&tenant, 1024, NULL, NULL);
+    void*          mem[300];
+    size_t         node = 0;
+    int            count = 0;
+    int            ret = 1;
+
+    /* one node first to learn its size, then room for two more. */
+    mem[count++] = elr_mpl_alloc(&pool);
+    node = elr_mpl_charged(&pool);
+    ret &= (node > 0 && elr_mpl_charged(&tenant) == node);
+    elr_mpl_set_limit(&tenant, node * 3 + node / 2);
+    elr_mpl_set_limit_callback(&tenant, limit_raise, NULL);
+    while (count < 300 && (mem[count] = elr_mpl_alloc(&pool)) != NULL)
+        count++;
+    ret &= (count < 300 && elr_mpl_charged(&tenant) == node * 3);
+    ret &= (limit_hits == 1);
+
+    /* a callback that makes room lets the allocation through. */
+    elr_mpl_set_limit_callback(&tenant, limit_raise, &tenant);
+    ret &= ((mem[count] = elr_mpl_alloc(&pool)) != NULL);
+    ret &= (limit_hits == 2 && elr_mpl_charged(&tenant) == node * 4);
+
+    elr_mpl_destroy(&pool);
+    ret &= (elr_mpl_charged(&tenant) == 0);
+    elr_mpl_destroy(&tenant);
+    return ret;
+}
+
+typedef struct __frame_queue
+{
+    elr_mpl_t*       pool;
+    pthread_mutex_t  mtx;
+    void*            frame[16];
+    int              head;
+    int              tail;
+    int              done;
+}
+frame_queue;
+
+static void* frame_producer(void* arg)
+{
+    frame_queue*  q = (frame_queue*)arg;
+    void*         frame = NULL;
+    int           i = 0;
+
+    for (i = 0; i < 1000; i++)
+    {
+        frame = elr_mpl_alloc_wait(q->pool, -1);
+        pthread_mutex_lock(&q->mtx);
+        q->frame[q->tail++ % 16] = frame;
+        pthread_mutex_unlock(&q->mtx);
+    }
+    return NULL;
+}
+
+static void* frame_consumer(void* arg)
+{
+    frame_queue*  q = (frame_queue*)arg;
+    void*         frame = NULL;
+
+    while (q->done < 3000)
+    {
+        frame = NULL;
+        pthread_mutex_lock(&q->mtx);
+        if (q->head != q->tail)
+            frame = q->frame[q->head++ % 16];
+        pthread_mutex_unlock(&q->mtx);
+        if (frame != NULL)
+        {
+            elr_mpl_free(frame);
+            q->done++;
+        }
+        else
+            sched_yield();
+    }
+    return NULL;
+}
+
+int test_alloc_wait()
+{
+	elr_mpl_t      pool = elr_mpl_create_sync(NULL, 4096, NULL, NULL);
+    frame_queue    q;
+    pthread_t      producer[3];
+    pthread_t      consumer;
+    void*          mem[4];
+    int            ret = 1;
+    int            i = 0;
+
+    elr_mpl_set_capacity(&pool, 4);
+    for (i = 0; i < 4; i++)
+        ret &= ((mem[i] = elr_mpl_alloc(&pool)) != NULL);
+    ret &= (elr_mpl_alloc(&pool) == NULL);
+    ret &= (elr_mpl_alloc_wait(&pool, 0) == NULL);
+    ret &= (elr_mpl_alloc_wait(&pool, 5000000) == NULL);
+    for (i = 0; i < 4; i++)
+        elr_mpl_free(mem[i]);
+
+    /* never more than four frames in flight, so the queue can`t overflow. */
+    memset(&q, 0, sizeof(q));
+    q.pool = &pool;
+    pthread_mutex_init(&q.mtx, NULL);
+    pthread_create(&consumer, NULL, frame_consumer, &q);
+    for (i = 0; i < 3; i++)
+        pthread_create(&producer[i], NULL, frame_producer, &q);
+    for (i = 0; i < 3; i++)
+        pthread_join(producer[i], NULL);
+    pthread_join(consumer, NULL);
+    pthread_mutex_destroy(&q.mtx);
+    ret &= (q.done == 3000);
+
+    elr_mpl_destroy(&pool);
+    return ret;
+}
+
+int test_from_buffer()
+{
+    static char    buf[4096];
+    char           tiny[16];
+	elr_mpl_t      pool = elr_mpl_create_from_buffer(NULL, 64, buf, sizeof(buf), ELR_MPL_SYNC);
+	elr_mpl_t      none = elr_mpl_create_from_buffer(NULL, 64, tiny, sizeof(tiny), 0);
+    void*          mem[64];
+    void*          again = NULL;
+    int            count = 0;
+    int            ret = (elr_mpl_avail(&pool) != 0 && none.pool == NULL);
+
+    while (count < 64 && (mem[count] = elr_mpl_alloc(&pool)) != NULL)
+    {
+        ret &= ((char*)mem[count] >= buf && (char*)mem[count] + 64 <= buf + sizeof(buf));
+        ret &= (elr_mpl_size(mem[count]) == 64);
+        count++;
+    }
+    /* 4096 bytes hold a node header and a few dozen 96 byte slices, then allocation fails. */
+    ret &= (count > 32 && count < 64);
+
+    elr_mpl_free(mem[3]);
+    again = elr_mpl_alloc(&pool);
+    ret &= (again == mem[3]);
+    ret &= (elr_mpl_alloc(&pool) == NULL);
+
+    elr_mpl_reset(&pool);
+    ret &= ((mem[0] = elr_mpl_alloc(&pool)) != NULL);
+
+    elr_mpl_destroy(&pool);
+    return ret;
+}
+
+int test_node_cache()
+{
+    void*          first[8];
+    void*          mem = NULL;
+    size_t         charged = 0;
+    int            ret = 1;
+    int            round = 0;
+    int            i = 0;
+
+    /* request-scoped child pools, every round after the first runs on the nodes of the one before. */
+    for (round = 0; round < 8; round++)
+    {
+        elr_mpl_t  pool = elr_mpl_create(NULL, 200, NULL, NULL);
+        for (i = 0; i < 100; i++)
+        {
+            mem = elr_mpl_alloc(&pool);
+            ret &= (mem != NULL);
+            memset(mem, round, 200);
+        }
+        first[round] = mem;
+        if (round == 0)
+            charged = elr_mpl_charged(&pool);
+        else
+            ret &= (elr_mpl_charged(&pool) == charged && first[round] == first[0]);
+        elr_mpl_destroy(&pool);
+    }
+
+    return ret;
+}
+
+static void* tcache_thread(void* arg)
+{
+    elr_mpl_tcache  tc;
+    void*           mem[48];
+    long            bad = 0;
+    int             round = 0;
+    int             i = 0;
+
+    elr_mpl_tcache_init(&tc, (elr_mpl_ht)arg);
+    for (round = 0; round < 2000; round++)
+    {
+        /* more than the cache holds, so refills and spills both happen. */
+        for (i = 0; i < 48; i++)
+        {
+            mem[i] = elr_mpl_tcache_alloc(&tc);
+            *(long*)mem[i] = round;
+        }
+        for (i = 0; i < 48; i++)
+        {
+            bad += (*(long*)mem[i] != round);
+            elr_mpl_tcache_free(&tc, mem[i]);
+        }
+    }
+    elr_mpl_tcache_flush(&tc);
+
+    return (void*)bad;
+}
+
+int test_tcache()
+{
+	elr_mpl_t      pool = elr_mpl_create_sync(NULL, 64, NULL, NULL);
+    pthread_t      thread[4];
+    void*          mem[8];
+    void*          bad = NULL;
+    int            ret = 1;
+    int            i = 0;
+
+    elr_mpl_set_capacity(&pool, 6);
+    ret &= (elr_mpl_alloc_batch(&pool, mem, 8) == 6);
+    ret &= (elr_mpl_alloc(&pool) == NULL);
+    mem[6] = NULL;
+    elr_mpl_free_batch(mem, 7);
+    ret &= (elr_mpl_alloc_batch(&pool, mem, 8) == 6);
+    elr_mpl_free_batch(mem, 6);
+    elr_mpl_set_capacity(&pool, 0);
+
+    for (i = 0; i < 4; i++)
+        pthread_create(&thread[i], NULL, tcache_thread, &pool);
+    for (i = 0; i < 4; i++)
+    {
+        pthread_join(thread[i], &bad);
+        ret &= (bad == NULL);
+    }
+
+    elr_mpl_destroy(&pool);
+    return ret;
+}
+
+int test_coloring()
+{
+	elr_mpl_t      pool = elr_mpl_create_ex(NULL, 1024, NULL, NULL, ELR_MPL_HANDLES | ELR_MPL_COLORED);
+	elr_mpl_t      plain = elr_mpl_create(NULL, 1024, NULL, NULL);
+    void*          mem[600];
+    int            ret = 1;
+    int            round = 0;
+    int            i = 0;
+
+    /* nodes below the mmap threshold are only colored when asked, colors make them bigger. */
+    elr_mpl_alloc(&pool);
+    elr_mpl_alloc(&plain);
+    ret &= (elr_mpl_charged(&plain) < elr_mpl_charged(&pool));
+    elr_mpl_destroy(&plain);
+    elr_mpl_reset(&pool);
+
+    /* nodes of 1KB objects leave a page slack big enough for all colors, 600 blocks take ten nodes. */
+    for (round = 0; round < 2; round++)
+    {
+        for (i = 0; i < 600; i++)
+        {
+            mem[i] = elr_mpl_alloc(&pool);
+            ret &= (mem[i] != NULL);
+            memset(mem[i], i & 0xff, 1024);
+        }
+        for (i = 0; i < 600; i++)
+        {
+            ret &= (elr_mpl_resolve(&pool, elr_mpl_handle(mem[i])) == mem[i]);
+            ret &= (((unsigned char*)mem[i])[1023] == (i & 0xff));
+        }
+        elr_mpl_reset(&pool);
+    }
+
+    elr_mpl_destroy(&pool);
+    return ret;
+}
+
+int test_cacheline()
+{
+    static char    buf[8192];
+	elr_mpl_t      pool = elr_mpl_create_ex(NULL, 24, NULL, NULL, ELR_MPL_CACHELINE);
+	elr_mpl_t      bpool = elr_mpl_create_from_buffer(NULL, 100, buf + 8, sizeof(buf) - 8, ELR_MPL_CACHELINE);
+    void*          mem = NULL;
+    int            ret = (bpool.pool != NULL);
+    int            i = 0;
+
+    for (i = 0; i < 200; i++)
+    {
+        mem = elr_mpl_alloc(&pool);
+        ret &= (mem != NULL && ((size_t)mem & 63) == 0);
+    }
+    while ((mem = elr_mpl_alloc(&bpool)) != NULL)
+    {
+        ret &= (((size_t)mem & 63) == 0 && (char*)mem + 100 <= buf + sizeof(buf));
+        i++;
+    }
+    /* 192 bytes per slice. */
+    ret &= (i - 200 >= 40);
+
+    elr_mpl_destroy(&bpool);
+    elr_mpl_destroy(&pool);
+    return ret;
+}
+
+static void* dump_biased_owner(void* arg)
+{
+    elr_mpl_t*  pools = (elr_mpl_t*)arg;
+
+    /* pools[0] is the parent, pools[1] gets the pool biased to this thread. */
+    pools[1] = elr_mpl_create_ex(&pools[0], 32, NULL, NULL, ELR_MPL_BIASED);
+    elr_mpl_alloc(&pools[1]);
+    return NULL;
+}
+
+int test_dump()
+{
+	elr_mpl_t      pool = elr_mpl_create(NULL, 256, NULL, NULL);
+	elr_mpl_t      child = elr_mpl_create(&pool, 64, NULL, NULL);
+    elr_mpl_t      biased[2];
+    elr_mpl_lock_stat stat;
+    pthread_t      thread;
+    char           path[] = "/tmp/elr_mpl_dumpXXXXXX";
+    char           text[4096];
+    char           pattern[128];
+    void*          mem[8];
+    ssize_t        len = 0;
+    int            fd = mkstemp(path);
+    int            ret = (fd >= 0);
+    int            i = 0;
+
+    for (i = 0; i < 8; i++)
+        mem[i] = elr_mpl_alloc(&pool);
+    elr_mpl_free(mem[1]);
+    elr_mpl_free(mem[6]);
+    elr_mpl_alloc(&child);
+    biased[0] = child;
+    pthread_create(&thread, NULL, dump_biased_owner, biased);
+    pthread_join(thread, NULL);
+
+    ret &= elr_mpl_dump(&pool, fd);
+    lseek(fd, 0, SEEK_SET);
+    len = read(fd, text, sizeof(text) - 1);
+    text[len > 0 ? len : 0] = '\0';
+
+    /* slices 0 to 7 carved, 1 and 6 free: 1011 1101. */
+    snprintf(pattern, sizeof(pattern), "{\"pool\":\"%p\"", pool.pool);
+    ret &= (strstr(text, pattern) != NULL);
+    ret &= (strstr(text, "\"used\":8,\"using\":6,\"free\":2,\"map\":\"bd\"") != NULL);
+    snprintf(pattern, sizeof(pattern), "\"parent\":\"%p\"", pool.pool);
+    ret &= (strstr(text, pattern) != NULL);
+    ret &= (strstr(text, "\"used\":1,\"using\":1,\"free\":0,\"map\":\"8\"") != NULL);
+
+    /* a pool biased to another thread is listed but not locked, it keeps its bias. */
+    snprintf(pattern, sizeof(pattern), "{\"pool\":\"%p\"", biased[1].pool);
+    ret &= (strstr(text, pattern) != NULL && strstr(text, "\"biased\":1") != NULL);
+    elr_mpl_lock_stats(&biased[1], &stat);
+    ret &= (stat.acquired == 0);
+
+    close(fd);
+    unlink(path);
+    elr_mpl_destroy(&pool);
+    return ret;
+}
+
+static void compact_relocate(void* old_mem, void* new_mem, void* ctx)
+{
+    void**  table = (void**)ctx;
+
+    table[*(int*)new_mem] = new_mem;
+    (void)old_mem;
+}
+
+int test_compact()
+{
+    elr_mpl_t      pool = elr_mpl_create(NULL, 64, NULL, NULL);
+    void*          table[2000];
+    size_t         charged = 0;
+    size_t         bytes = 0;
+    int            ret = 1;
+    int            i = 0;
+
+    for (i = 0; i < 2000; i++)
+    {
+        table[i] = elr_mpl_alloc(&pool);
+        *(int*)table[i] = i;
+    }
+    /* keep one block in twenty, every node is left sparse. */
+    for (i = 0; i < 2000; i++)
+    {
+        if (i % 20 != 0)
+        {
+            elr_mpl_free(table[i]);
+            table[i] = NULL;
+        }
+    }
+
+    /* a block waiting in a retire list keeps the pool from being compacted. */
+    elr_mpl_retire(elr_mpl_alloc(&pool));
+    ret &= (elr_mpl_compact(&pool, compact_relocate, table) == 0);
+    while (elr_mpl_retire_flush() != 0)
+        ;
+
+    charged = elr_mpl_charged(&pool);
+    bytes = elr_mpl_compact(&pool, compact_relocate, table);
+    ret &= (bytes > 0 && elr_mpl_charged(&pool) == charged - bytes);
+    for (i = 0; i < 2000; i += 20)
+        ret &= (*(int*)table[i] == i && elr_mpl_size(table[i]) == 64);
+
+    for (i = 0; i < 2000; i += 20)
+        elr_mpl_free(table[i]);
+    ret &= (elr_mpl_alloc(&pool) != NULL);
+    elr_mpl_destroy(&pool);
+    return ret;
+}
+
+static void foreach_visit(void* mem, void* ctx)
+{
+    *(long*)ctx += *(int*)mem;
+}
+
+static void foreach_visit_batch(void** mem, size_t count, void* ctx)
+{
+    size_t  i = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        *(long*)ctx += *(int*)mem[i];
+        /* a batch stays inside one node, so its blocks ascend. */
+        if (i > 0 && mem[i] <= mem[i - 1])
+            *(long*)ctx = -1000000000L;
+    }
+}
+
+int test_foreach()
+{
+    elr_mpl_t      pool = elr_mpl_create(NULL, 48, NULL, NULL);
+    void*          mem[1000];
+    long           expect = 0;
+    long           sum = 0;
+    int            ret = 1;
+    int            i = 0;
+
+    for (i = 0; i < 1000; i++)
+    {
+        mem[i] = elr_mpl_alloc(&pool);
+        *(int*)mem[i] = i;
+    }
+    for (i = 0; i < 1000; i++)
+    {
+        if (i % 3 == 0)
+            elr_mpl_free(mem[i]);
+        else
+            expect += i;
+    }
+
+    ret &= (elr_mpl_foreach(&pool, foreach_visit, &sum) == 666 && sum == expect);
+    sum = 0;
+    ret &= (elr_mpl_foreach_batch(&pool, foreach_visit_batch, &sum) == 666 && sum == expect);
+
+    elr_mpl_reset(&pool);
+    sum = 0;
+    ret &= (elr_mpl_foreach(&pool, foreach_visit, &sum) == 0 && sum == 0);
+    elr_mpl_destroy(&pool);
+    return ret;
+}
+
+static void* trace_thread(void* arg)
+{
+    int  i = 0;
+
+    /* more records than a thread buffers, the rest is written when the thread ends. */
+    for (i = 0; i < 300; i++)
+        elr_mpl_free(elr_mpl_alloc((elr_mpl_ht)arg));
+    return NULL;
+}
+
+int test_trace()
+{
+    elr_mpl_t             pool = ELR_MPL_INITIALIZER;
+    elr_mpl_t             multi = ELR_MPL_INITIALIZER;
+    elr_mpl_t             arena = ELR_MPL_INITIALIZER;
+    elr_mpl_t             cache = ELR_MPL_INITIALIZER;
+    elr_mpl_t             buffered = ELR_MPL_INITIALIZER;
+    long                  buffer[256];
+    size_t                sizes[2] = { 32, 128 };
+    char                  path[] = "/tmp/elr_mpl_traceXXXXXX";
+    elr_mpl_trace_header  header;
+    elr_mpl_trace_record  rec;
+    pthread_t             thread;
+    void*                 mem = NULL;
+    void*                 batch[4];
+    unsigned long long    multi_id = 0;
+    unsigned long long    arena_id = 0;
+    unsigned long long    cache_id = 0;
+    int                   count[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    int                   fd = mkstemp(path);
+    int                   ret = (fd >= 0);
+
+    ret &= elr_mpl_trace_start(fd);
+    ret &= (elr_mpl_trace_start(fd) == 0);
+    pool = elr_mpl_create_sync(NULL, 40, NULL, NULL);
+    multi = elr_mpl_create_multi(NULL, 2, sizes, NULL, NULL);
+    multi_id = (unsigned long long)(size_t)multi.pool;
+    arena = elr_mpl_create_arena(NULL, 0, 0);
+    cache = elr_mpl_create_cache(&arena, 24, NULL, NULL, NULL, ELR_MPL_COLORED);
+    buffered = elr_mpl_create_from_buffer(NULL, 16, buffer, sizeof(buffer), 0);
+    arena_id = (unsigned long long)(size_t)arena.pool;
+    cache_id = (unsigned long long)(size_t)cache.pool;
+    pthread_create(&thread, NULL, trace_thread, &pool);
+    pthread_join(thread, NULL);
+    /* a batch is recorded block by block. */
+    ret &= (elr_mpl_alloc_batch(&pool, batch, 4) == 4);
+    elr_mpl_free_batch(batch, 4);
+    mem = elr_mpl_alloc_multi(&multi, 100);
+    elr_mpl_free(mem);
+    elr_mpl_destroy(&multi);
+    elr_mpl_destroy(&buffered);
+    elr_mpl_destroy(&arena);
+    elr_mpl_destroy(&pool);
+    ret &= elr_mpl_trace_stop();
+    /* not recorded any more. */
+    elr_mpl_free(elr_mpl_alloc_multi(NULL, 16));
+
+    lseek(fd, 0, SEEK_SET);
+    ret &= (read(fd, &header, sizeof(header)) == sizeof(header));
+    ret &= (header.magic == ELR_MPL_TRACE_MAGIC && header.record_size == sizeof(elr_mpl_trace_record));
+    while (read(fd, &rec, sizeof(rec)) == sizeof(rec))
+    {
+        if (rec.op < 8)
+            count[rec.op]++;
+        if (rec.op == ELR_MPL_TRACE_ALLOC_MULTI)
+            ret &= (rec.size == 100 && rec.pool == multi_id);
+        if (rec.op == ELR_MPL_TRACE_CREATE_MULTI)
+            ret &= (rec.size == 2);
+        /* flags keep the bits above the first byte, arenas give no size. */
+        if (rec.op == ELR_MPL_TRACE_CREATE && rec.pool == cache_id)
+            ret &= (rec.size == 24 && rec.flags == ELR_MPL_COLORED && rec.object == arena_id);
+        if (rec.op == ELR_MPL_TRACE_CREATE && rec.pool == arena_id)
+            ret &= (rec.size == 0);
+        /* the classes follow their create in order. */
+        if (rec.op == ELR_MPL_TRACE_CLASS)
+            ret &= (rec.pool == multi_id && count[ELR_MPL_TRACE_CLASS] <= 2
+                && rec.size == sizes[count[ELR_MPL_TRACE_CLASS] - 1]);
+    }
+    ret &= (count[ELR_MPL_TRACE_CREATE] == 4 && count[ELR_MPL_TRACE_CREATE_MULTI] == 1);
+    ret &= (count[ELR_MPL_TRACE_ALLOC] == 304 && count[ELR_MPL_TRACE_ALLOC_MULTI] == 1);
+    ret &= (count[ELR_MPL_TRACE_FREE] == 305 && count[ELR_MPL_TRACE_DESTROY] == 4);
+    ret &= (count[ELR_MPL_TRACE_CLASS] == 2);
+
+    close(fd);
+    unlink(path);
+    return ret;
+}
 
 void clear_fragments()
 {
@@ -281,6 +1628,56 @@ void bench()
     //clear_fragments();
 }
 
+static void* false_sharing_thread(void* arg)
+{
+    volatile long*  counter = (volatile long*)arg;
+    long            i = 0;
+
+    for (i = 0; i < 2000000; i++)
+        (*counter)++;
+
+    return NULL;
+}
+
+void bench_false_sharing()
+{
+    int              flags[2] = { ELR_MPL_SYNC, ELR_MPL_SYNC | ELR_MPL_CACHELINE };
+    const char*      name[2] = { "packed", "cacheline" };
+    pthread_t        thread[4];
+    void*            mem[4];
+    struct timespec  start;
+    struct timespec  end;
+    double           ms = 0;
+    int              i = 0;
+    int              j = 0;
+
+    printf("\nfour threads each updating its own 16 bytes memory block, taken one after another from a pool.\n");
+    printf("|layout         |ms             |\n");
+
+    for (j = 0; j < 2; j++)
+    {
+        elr_mpl_t  pool = elr_mpl_create_ex(NULL, 16, NULL, NULL, flags[j]);
+
+        for (i = 0; i < 4; i++)
+        {
+            mem[i] = elr_mpl_alloc(&pool);
+            *(long*)mem[i] = 0;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < 4; i++)
+            pthread_create(&thread[i], NULL, false_sharing_thread, mem[i]);
+        for (i = 0; i < 4; i++)
+            pthread_join(thread[i], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        ms = (end.tv_sec - start.tv_sec)*1000.0 + (end.tv_nsec - start.tv_nsec)/1000000.0;
+        printf("|%-15s|%-15.3f|\n", name[j], ms);
+
+        elr_mpl_destroy(&pool);
+    }
+}
+
 /* alloc_size  the memory block size for allocating, access, freeing.*/
 /* alloc_times total times of  memory allocation operation. Need to be initialized to zero. */
 /* alloc_clocks total time consumption of  memory allocation operations. Need to be initialized to zero. */
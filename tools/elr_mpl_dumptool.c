@@ -0,0 +1,283 @@
+/*! \file elr_mpl_dumptool.c.
+ *  \brief offline viewer of the dumps written by elr_mpl_dump.
+ *
+ *  elr_mpl_dumptool heatmap [-v] dump
+ *      one row per pool, one character per memory node, darker for
+ *      fuller nodes, followed by a histogram of node occupancy. with -v
+ *      every memory node is also printed slice by slice, # in use, . free.
+ *
+ *  elr_mpl_dumptool diff old_dump new_dump
+ *      nodes, memory blocks in use and bytes of every pool in both dumps,
+ *      with pools created or destroyed in between marked + and -.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*Characters of the heatmap from an empty to a full memory node*/
+static const char  g_ramp[] = " .:-=+*#%@";
+
+/*! \brief a pool line of a dump.
+ */
+typedef struct __dump_pool
+{
+    char    addr[32];
+    size_t  object_size;
+    size_t  slice_count;
+    size_t  nodes;
+    size_t  using_count;
+    /*Bytes of the pool`s own nodes, charged also counts the children*/
+    size_t  bytes;
+    int     seen;
+}
+dump_pool;
+
+/*Find the value of "key": in a dump line, NULL if the line has none*/
+static const char* json_value(const char* line, const char* key)
+{
+    char         pattern[64];
+    const char*  p = NULL;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    p = strstr(line, pattern);
+    return p == NULL ? NULL : p + strlen(pattern);
+}
+
+static size_t json_num(const char* line, const char* key)
+{
+    const char*  p = json_value(line, key);
+
+    return p == NULL ? 0 : (size_t)strtoull(p, NULL, 10);
+}
+
+static void json_str(const char* line, const char* key, char* out, size_t size)
+{
+    const char*  p = json_value(line, key);
+    size_t       n = 0;
+
+    out[0] = '\0';
+    if (p == NULL || *p != '"')
+        return;
+    p++;
+    while (p[n] != '"' && p[n] != '\0' && n + 1 < size)
+    {
+        out[n] = p[n];
+        n++;
+    }
+    out[n] = '\0';
+}
+
+/*Read the pool lines of a dump, returns the number of pools or -1*/
+static int read_pools(const char* path, dump_pool** pools)
+{
+    FILE*       fp = fopen(path, "r");
+    char        line[65536];
+    dump_pool*  list = NULL;
+    dump_pool*  grown = NULL;
+    int         count = 0;
+    int         size = 0;
+
+    if (fp == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (json_value(line, "pool") == NULL || json_value(line, "node") != NULL)
+            continue;
+        if (count == size)
+        {
+            size = size == 0 ? 64 : size*2;
+            grown = (dump_pool*)realloc(list, size*sizeof(dump_pool));
+            if (grown == NULL)
+                break;
+            list = grown;
+        }
+        json_str(line, "pool", list[count].addr, sizeof(list[count].addr));
+        list[count].object_size = json_num(line, "object_size");
+        list[count].slice_count = json_num(line, "slice_count");
+        list[count].nodes = json_num(line, "nodes");
+        list[count].using_count = json_num(line, "using");
+        list[count].bytes = list[count].nodes*json_num(line, "node_size");
+        list[count].seen = 0;
+        count++;
+    }
+    fclose(fp);
+
+    *pools = list;
+    return count;
+}
+
+static void print_histogram(size_t* histogram, size_t nodes)
+{
+    int  i = 0;
+
+    if (nodes == 0)
+        return;
+    printf("    occupancy ");
+    for (i = 0; i < 10; i++)
+        printf(" %d0%%:%zu", i, histogram[i]);
+    printf(" 100%%:%zu\n", histogram[10]);
+}
+
+static int heatmap(const char* path, int verbose)
+{
+    FILE*   fp = fopen(path, "r");
+    char    line[65536];
+    char    addr[32];
+    char    map[65536];
+    size_t  histogram[11];
+    size_t  nodes = 0;
+    size_t  slice_count = 0;
+    size_t  used = 0;
+    size_t  using_count = 0;
+    size_t  i = 0;
+    int     digit = 0;
+    int     level = 0;
+    int     open = 0;
+
+    if (fp == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+
+    memset(histogram, 0, sizeof(histogram));
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (json_value(line, "node") != NULL)
+        {
+            used = json_num(line, "used");
+            using_count = json_num(line, "using");
+            /* arena nodes count bytes, they are shown as full. */
+            if (json_value(line, "bytes") != NULL || slice_count == 0)
+                level = 10;
+            else
+                level = (int)(using_count*10/slice_count);
+            histogram[level]++;
+            nodes++;
+            if (verbose == 0)
+            {
+                putchar(g_ramp[level > 9 ? 9 : level]);
+                continue;
+            }
+
+            json_str(line, "node", addr, sizeof(addr));
+            json_str(line, "map", map, sizeof(map));
+            printf("    %-18s %4zu/%-4zu free %-4zu |", addr, using_count, slice_count, json_num(line, "free"));
+            for (i = 0; i < used && i/4 < strlen(map); i++)
+            {
+                digit = (map[i/4] >= 'a') ? map[i/4] - 'a' + 10 : map[i/4] - '0';
+                putchar((digit >> (3 - (i & 3))) & 1 ? '#' : '.');
+            }
+            for (; i < slice_count; i++)
+                putchar(' ');
+            printf("|\n");
+        }
+        else if (json_value(line, "pool") != NULL)
+        {
+            if (open != 0)
+                printf("|\n");
+            print_histogram(histogram, nodes);
+            memset(histogram, 0, sizeof(histogram));
+            nodes = 0;
+
+            json_str(line, "pool", addr, sizeof(addr));
+            slice_count = json_num(line, "slice_count");
+            /* a biased pool of another thread is dumped without its nodes. */
+            if (json_value(line, "biased") != NULL)
+            {
+                printf("%-18s object %-6zu biased, not walked    charged %-10zu\n",
+                    addr, json_num(line, "object_size"), json_num(line, "charged"));
+                open = 0;
+                continue;
+            }
+            printf("%-18s object %-6zu nodes %-6zu using %-8zu charged %-10zu\n",
+                addr, json_num(line, "object_size"), json_num(line, "nodes"),
+                json_num(line, "using"), json_num(line, "charged"));
+            open = (verbose == 0);
+            if (open != 0)
+                printf("    |");
+        }
+    }
+    if (open != 0)
+        printf("|\n");
+    print_histogram(histogram, nodes);
+    fclose(fp);
+
+    return 0;
+}
+
+static int diff(const char* old_path, const char* new_path)
+{
+    dump_pool*  old_pools = NULL;
+    dump_pool*  new_pools = NULL;
+    dump_pool*  before = NULL;
+    long long   old_bytes = 0;
+    long long   new_bytes = 0;
+    int         old_count = read_pools(old_path, &old_pools);
+    int         new_count = read_pools(new_path, &new_pools);
+    int         i = 0;
+    int         j = 0;
+
+    if (old_count < 0 || new_count < 0)
+        return 1;
+
+    printf("  %-18s %-8s %-16s %-20s %s\n", "pool", "object", "nodes", "using", "bytes");
+    for (i = 0; i < new_count; i++)
+    {
+        before = NULL;
+        for (j = 0; j < old_count && before == NULL; j++)
+        {
+            if (old_pools[j].seen == 0 && strcmp(old_pools[j].addr, new_pools[i].addr) == 0
+                && old_pools[j].object_size == new_pools[i].object_size)
+                before = &old_pools[j];
+        }
+        new_bytes += new_pools[i].bytes;
+        if (before == NULL)
+        {
+            printf("+ %-18s %-8zu %-16zu %-20zu %zu\n", new_pools[i].addr, new_pools[i].object_size,
+                new_pools[i].nodes, new_pools[i].using_count, new_pools[i].bytes);
+            continue;
+        }
+        before->seen = 1;
+        old_bytes += before->bytes;
+        if (before->nodes == new_pools[i].nodes && before->using_count == new_pools[i].using_count)
+            continue;
+        printf("  %-18s %-8zu %6zu -> %-6zu %8zu -> %-8zu %+lld\n", new_pools[i].addr,
+            new_pools[i].object_size, before->nodes, new_pools[i].nodes,
+            before->using_count, new_pools[i].using_count,
+            (long long)new_pools[i].bytes - (long long)before->bytes);
+    }
+    for (j = 0; j < old_count; j++)
+    {
+        if (old_pools[j].seen != 0)
+            continue;
+        old_bytes += old_pools[j].bytes;
+        printf("- %-18s %-8zu %-16zu %-20zu %zu\n", old_pools[j].addr, old_pools[j].object_size,
+            old_pools[j].nodes, old_pools[j].using_count, old_pools[j].bytes);
+    }
+    printf("pools %d -> %d, bytes of nodes %lld -> %lld (%+lld)\n",
+        old_count, new_count, old_bytes, new_bytes, new_bytes - old_bytes);
+
+    free(old_pools);
+    free(new_pools);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc == 3 && strcmp(argv[1], "heatmap") == 0)
+        return heatmap(argv[2], 0);
+    if (argc == 4 && strcmp(argv[1], "heatmap") == 0 && strcmp(argv[2], "-v") == 0)
+        return heatmap(argv[3], 1);
+    if (argc == 4 && strcmp(argv[1], "diff") == 0)
+        return diff(argv[2], argv[3]);
+
+    fprintf(stderr, "usage: %s heatmap [-v] dump\n"
+                    "       %s diff old_dump new_dump\n", argv[0], argv[0]);
+    return 2;
+}